@@ -0,0 +1,134 @@
+/*
+ * globbench - Benchmark for tsh glob expansion
+ *
+ * Builds a synthetic tree of about a million files (100 directories of
+ * 10 subdirectories of 1000 files, half *.log and half *.txt, plus a
+ * flat directory holding a tenth as many) and times parseline() on
+ * patterns over it: one huge directory, one piece per level, and **
+ * walks with one thread and with the default pool.
+ *
+ * usage: globbench [files] [dir]
+ *
+ * The tree is made in dir (default a new directory under /tmp) unless
+ * dir already holds one, and only a tree made in a new directory is
+ * removed afterwards.
+ */
+#define TSH_NO_MAIN
+#include "../tsh.c"
+
+#include <ftw.h>
+
+/* now - Monotonic time in seconds */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* mkfiles - Create n empty files in dir, alternately *.log and *.txt */
+static void mkfiles(const char *dir, long n)
+{
+    char name[64];
+    long i;
+    int dfd, fd;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+	unix_error("mkdir error");
+    if ((dfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0)
+	unix_error("open error");
+    for (i = 0; i < n; i++) {
+	snprintf(name, sizeof(name), "f%06ld.%s", i, i % 2 ? "txt" : "log");
+	if ((fd = openat(dfd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)
+	    unix_error("openat error");
+	close(fd);
+    }
+    close(dfd);
+}
+
+/* mktree - Make the tree for about files files under root */
+static void mktree(const char *root, long files)
+{
+    char path[PATH_MAX];
+    long per = files / 1000 > 0 ? 1000 : files > 0 ? files : 1;
+    long ndirs = files / per, i;
+
+    printf("creating %ld files in %s\n", files + files / 10, root);
+    fflush(stdout);
+    if (mkdir(root, 0755) < 0 && errno != EEXIST)
+	unix_error("mkdir error");
+    for (i = 0; i < ndirs; i++) {
+	snprintf(path, sizeof(path), "%s/d%03ld", root, i / 10);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+	    unix_error("mkdir error");
+	snprintf(path, sizeof(path), "%s/d%03ld/s%ld", root, i / 10, i % 10);
+	mkfiles(path, per);
+    }
+    snprintf(path, sizeof(path), "%s/flat", root);
+    mkfiles(path, files / 10);
+}
+
+/* rmentry - nftw callback removing one entry */
+static int rmentry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/* run - Expand pattern iters times and print the rate */
+static void run(const char *label, const char *root, const char *pattern, int threads, int iters)
+{
+    struct arena_t arena;
+    struct pipeline_t pl;
+    char line[PATH_MAX + 64], nthr[16] = "auto";
+    size_t len;
+    double t0, t;
+    int i, n = 0;
+
+    globthreads = threads;
+    if (threads)
+	snprintf(nthr, sizeof(nthr), "%d", threads);
+    len = snprintf(line, sizeof(line), "/bin/echo %s/%s\n", root, pattern);
+    t0 = now();
+    for (i = 0; i < iters; i++) {
+	arena_init(&arena);
+	if (parseline(line, len, &arena, &pl) < 0)
+	    app_error("globbench: parse error");
+	n = pl.cmds[0].argc - 1;
+	arena_free(&arena);
+    }
+    t = (now() - t0) / iters;
+    printf("%-10s %-18s %4s threads %8d names %9.2f ms %8.2f Mnames/s\n",
+	   label, pattern, nthr, n, t * 1e3, n / t / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    long files = argc > 1 ? strtol(argv[1], NULL, 0) : 1000000;
+    char tmp[] = "/tmp/globbench.XXXXXX", path[PATH_MAX];
+    const char *root = argc > 2 ? argv[2] : NULL;
+    int made = 0;
+
+    if (root == NULL) {
+	if ((root = mkdtemp(tmp)) == NULL)
+	    unix_error("mkdtemp error");
+	made = 1;
+    }
+    snprintf(path, sizeof(path), "%s/flat", root);
+    if (access(path, F_OK) < 0)
+	mktree(root, files);
+
+    run("one dir", root, "d000/s0/*.log", 0, 200);
+    run("flat", root, "flat/*.log", 0, 5);
+    run("per level", root, "d*/s[0-4]/f*2.log", 0, 3);
+    run("walk", root, "d*/**/*.log", 1, 3);
+    run("walk", root, "d*/**/*.log", 4, 3);
+    run("walk", root, "**/f*7.txt", 1, 3);
+    run("walk", root, "**/f*7.txt", 4, 3);
+
+    if (made) {
+	printf("removing %s\n", root);
+	nftw(root, rmentry, 64, FTW_DEPTH | FTW_PHYS);
+    }
+    return 0;
+}
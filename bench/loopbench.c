@@ -0,0 +1,97 @@
+/*
+ * loopbench - Benchmark for compiled loops in tsh
+ *
+ * Runs the body "test $i = 0 || y=$i" (builtins and an assignment, so
+ * no process is started) once per word of a long for loop, three ways:
+ * as the loop itself, compiled once through the script cache; as a
+ * line looked up in the script cache every iteration; and compiled
+ * from scratch every iteration, which is what a shell that re-parses
+ * its loop bodies pays.  Reports iterations/sec for each.
+ *
+ * usage: loopbench [iterations]
+ */
+#define TSH_NO_MAIN
+#include "../tsh.c"
+
+#include <time.h>
+
+static const char body[] = "test $i = 0 || y=$i\n";
+
+/* now - Monotonic time in seconds */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* report - Print the rate of n iterations that took t seconds */
+static void report(const char *name, int n, double t)
+{
+    printf("%-10s %9d iterations  %8.3f s  %10.0f iter/s  %7.0f ns/iter\n",
+	   name, n, t, n / t, t / n * 1e9);
+}
+
+/* setindex - Set $i to the decimal value of n */
+static void setindex(int n)
+{
+    char num[16];
+
+    snprintf(num, sizeof(num), "%d", n);
+    setvar("i", 1, num, -1);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    struct arena_t arena;
+    struct node_t *root;
+    char *line, *src;
+    size_t len, cap;
+    double t0;
+    int i;
+
+    initjobs(&jobs);
+    initbuiltins();
+    initvars();
+
+    /* for i in 1 2 ... n; do body; done */
+    cap = 64 + (size_t)n * 12 + sizeof(body);
+    if ((line = malloc(cap)) == NULL)
+	unix_error("malloc error");
+    len = sprintf(line, "for i in");
+    for (i = 1; i <= n; i++)
+	len += sprintf(line + len, " %d", i);
+    len += sprintf(line + len, "; do %.*s; done\n", (int)sizeof(body) - 2, body);
+
+    t0 = now();
+    if (evalsrc(line, len) < 0)
+	app_error("loopbench: parse error");
+    report("loop", n, now() - t0);
+    free(line);
+
+    t0 = now();
+    for (i = 1; i <= n; i++) {
+	setindex(i);
+	if (evalsrc(body, sizeof(body) - 1) < 0)
+	    app_error("loopbench: parse error");
+    }
+    report("cached", n, now() - t0);
+
+    t0 = now();
+    for (i = 1; i <= n; i++) {
+	setindex(i);
+	arena_init(&arena);
+	src = arena_alloc(&arena, sizeof(body));
+	memcpy(src, body, sizeof(body));
+	if (compile(src, sizeof(body) - 1, &arena, &root) < 0)
+	    app_error("loopbench: parse error");
+	run_list(root);
+	arena_free(&arena);
+    }
+    report("reparse", n, now() - t0);
+
+    printf("script cache: %lu hits, %lu misses\n", scripts.hits, scripts.misses);
+    return 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * stress - Signal-storm and child-churn stress test for tsh job control
+ *
+ * Each round drives one tsh (on a pipe, with -p) through three phases
+ * and then has it check its own job list with "jobs --check":
+ *
+ *   churn      many short background children plus some foreground
+ *              ones, while a second process fires SIGINT and SIGTSTP
+ *              at the shell as fast as it can
+ *   storm      a foreground job hit by a burst of mixed SIGTSTP and
+ *              SIGINT, so stop and termination reports race each other
+ *   fgbg       background jobs moved to the foreground, stopped with
+ *              SIGTSTP and resumed with bg, over and over
+ *
+ * A round fails if jobs --check reports a problem (a job stuck in the
+ * foreground, a ghost entry, a stale index), if the shell stops
+ * answering, or if it holds more file descriptors than when it started.
+ * Throughput of each phase is printed at the end; the exit status is
+ * non-zero if any round failed.
+ *
+ * usage: stress [-r rounds] [-n children] [-j jobs] [tsh]
+ *
+ * The program also serves as the child it runs:
+ *   stress --ready   print "ready" and sleep until killed
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BUFSIZE  (1 << 20) /* output kept while looking for a pattern */
+#define TIMEOUT  10000     /* ms to wait for any expected output */
+
+struct shell {              /* A tsh under test */
+    pid_t pid;
+    int in;                 /* its stdin */
+    int out;                /* its stdout and stderr */
+    char *buf;              /* output not consumed yet */
+    size_t len;
+    char *last;             /* output consumed by the last expect */
+    size_t lastlen;
+};
+
+static char self[4096];     /* this program, run as the child */
+static const char *tsh = "./tsh";
+static int failures;
+
+/* now - Monotonic time in nanoseconds */
+static long long now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* die - Report a fatal error and exit */
+static void die(const char *msg)
+{
+    fprintf(stderr, "stress: %s: %s\n", msg, strerror(errno));
+    exit(2);
+}
+
+/* start - Start tsh -p on a pair of pipes */
+static void start(struct shell *sh)
+{
+    int in[2], out[2];
+
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+	die("pipe");
+    if ((sh->pid = fork()) < 0)
+	die("fork");
+    if (sh->pid == 0) {
+	dup2(in[0], 0);
+	dup2(out[1], 1);
+	dup2(out[1], 2);
+	execl(tsh, tsh, "-p", (char *)NULL);
+	die(tsh);
+    }
+    close(in[0]);
+    close(out[1]);
+    sh->in = in[1];
+    sh->out = out[0];
+    if ((sh->buf = malloc(BUFSIZE)) == NULL || (sh->last = malloc(BUFSIZE + 1)) == NULL)
+	die("malloc");
+    sh->len = 0;
+}
+
+/* stop - Close the shell's input and reap it */
+static void stop(struct shell *sh)
+{
+    close(sh->in);
+    close(sh->out);
+    kill(sh->pid, SIGKILL);
+    waitpid(sh->pid, NULL, 0);
+    free(sh->buf);
+    free(sh->last);
+}
+
+/* send - Write s to the shell */
+static void send(struct shell *sh, const char *s)
+{
+    size_t n = strlen(s);
+    ssize_t rc;
+
+    while (n > 0) {
+	if ((rc = write(sh->in, s, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    die("write");
+	}
+	s += rc;
+	n -= rc;
+    }
+}
+
+/*
+ * expect - Read the shell's output until it contains pat, waiting at
+ *    most ms milliseconds.  Everything up to the end of pat is consumed
+ *    and kept in sh->last.  If it holds the string bad, it is copied to
+ *    stderr and *seen is set.  Returns 0, or -1 on timeout or end of
+ *    output.
+ */
+static int expect(struct shell *sh, const char *pat, int ms, const char *bad, int *seen)
+{
+    struct pollfd pfd = { sh->out, POLLIN, 0 };
+    size_t plen = strlen(pat);
+    long long deadline = now() + ms * 1000000LL;
+    char *p;
+    ssize_t rc;
+
+    while (1) {
+	if ((p = memmem(sh->buf, sh->len, pat, plen)) != NULL) {
+	    p += plen;
+	    sh->lastlen = p - sh->buf;
+	    memcpy(sh->last, sh->buf, sh->lastlen);
+	    sh->last[sh->lastlen] = '\0';
+	    if (bad && strstr(sh->last, bad)) {
+		fwrite(sh->last, 1, sh->lastlen, stderr);
+		*seen = 1;
+	    }
+	    sh->len -= p - sh->buf;
+	    memmove(sh->buf, p, sh->len);
+	    return 0;
+	}
+	if (sh->len == BUFSIZE)
+	    sh->len = 0;
+	if (poll(&pfd, 1, (deadline - now()) / 1000000) <= 0)
+	    return -1;
+	if ((rc = read(sh->out, sh->buf + sh->len, BUFSIZE - sh->len)) <= 0)
+	    return -1;
+	sh->len += rc;
+    }
+}
+
+/* countfds - Number of descriptors process pid has open */
+static int countfds(pid_t pid)
+{
+    char path[64];
+    struct dirent *d;
+    DIR *dir;
+    int n = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    if ((dir = opendir(path)) == NULL)
+	return -1;
+    while ((d = readdir(dir)) != NULL)
+	if (d->d_name[0] != '.')
+	    n++;
+    closedir(dir);
+    return n;
+}
+
+/*
+ * storm - Fork a process that sends SIGINT and SIGTSTP to pid in turn
+ *    until it is killed, with no pause but a yield between them
+ */
+static pid_t storm(pid_t pid)
+{
+    pid_t p;
+    int i;
+
+    if ((p = fork()) < 0)
+	die("fork");
+    if (p == 0) {
+	for (i = 0;; i++) {
+	    if (kill(pid, i & 1 ? SIGTSTP : SIGINT) < 0)
+		_exit(0);
+	    sched_yield();
+	}
+    }
+    return p;
+}
+
+/*
+ * reapall - Kill every job the shell lists (the storms leave stopped
+ *    ones behind) until it lists none.  wait does not wait for stopped
+ *    jobs, so a killed one can still be on the list for a moment.
+ *    Returns -1 if the shell stopped answering or the jobs stayed.
+ */
+static int reapall(struct shell *sh)
+{
+    char cmd[64], *p;
+    int jid, n, tries;
+
+    for (tries = 0; tries < TIMEOUT; tries++) {
+	send(sh, "jobs\necho __listed__\n");
+	if (expect(sh, "__listed__\n", TIMEOUT, NULL, NULL) < 0)
+	    return -1;
+	for (n = 0, p = sh->last; (p = strchr(p, '[')) != NULL; p++) {
+	    if (sscanf(p, "[%d] (", &jid) != 1 || (p != sh->last && p[-1] != '\n'))
+		continue;
+	    snprintf(cmd, sizeof(cmd), "kill -9 %%%d\n", jid);
+	    send(sh, cmd);
+	    n++;
+	}
+	if (n == 0)
+	    return 0;
+	send(sh, "wait\n");
+	usleep(1000);
+    }
+    return -1;
+}
+
+/*
+ * churn - Run n children, one in ten in the foreground, while SIGINT and
+ *    SIGTSTP rain on the shell.  Returns the time taken, or -1 if the
+ *    shell stopped answering.
+ */
+static long long churn(struct shell *sh, int n)
+{
+    long long t0;
+    pid_t p;
+    int i;
+
+    t0 = now();
+    p = storm(sh->pid);
+    for (i = 0; i < n; i++)
+	send(sh, i % 10 == 9 ? "/bin/true\n" : "/bin/true &\n");
+    send(sh, "wait\necho __churned__\n");
+    if (expect(sh, "__churned__\n", TIMEOUT, NULL, NULL) < 0)
+	t0 = -1;
+    kill(p, SIGKILL);
+    waitpid(p, NULL, 0);
+    if (t0 < 0 || reapall(sh) < 0)
+	return -1;
+    return now() - t0;
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 20, n = 500, njobs = 8, r, i, k, fds0, fds, seen, bad;
+    long long t, tchurn = 0, tstorm = 0, tfgbg = 0, nsig = 0, nmoves = 0;
+    struct shell sh;
+    char cmd[4200];
+    ssize_t rc;
+
+    if (argc == 2 && !strcmp(argv[1], "--ready")) {
+	printf("ready\n");
+	fflush(stdout);
+	while (1)
+	    pause();
+    }
+
+    for (i = 1; i < argc; i++) {
+	if (!strcmp(argv[i], "-r") && i + 1 < argc)
+	    rounds = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+	    n = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+	    njobs = atoi(argv[++i]);
+	else if (argv[i][0] == '-') {
+	    fprintf(stderr, "usage: stress [-r rounds] [-n children] [-j jobs] [tsh]\n");
+	    return 2;
+	}
+	else
+	    tsh = argv[i];
+    }
+    if ((rc = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0)
+	die("readlink");
+    self[rc] = '\0';
+    if (access(tsh, X_OK) < 0)
+	die(tsh);
+    signal(SIGPIPE, SIG_IGN);
+
+    start(&sh);
+    send(&sh, "echo __up__\n");
+    if (expect(&sh, "__up__\n", TIMEOUT, NULL, NULL) < 0)
+	die("tsh did not start");
+    fds0 = countfds(sh.pid);
+
+    for (r = 1; r <= rounds; r++) {
+	bad = 0;
+
+	/* churn */
+	if ((t = churn(&sh, n)) < 0) {
+	    fprintf(stderr, "stress: round %d: churn: the shell stopped answering\n", r);
+	    failures++;
+	    break;
+	}
+	tchurn += t;
+
+	/* storm: a burst of mixed stops and interrupts at a foreground job */
+	snprintf(cmd, sizeof(cmd), "%s --ready\n", self);
+	t = now();
+	for (k = 0; k < 10; k++) {
+	    send(&sh, cmd);
+	    if (expect(&sh, "ready\n", TIMEOUT, NULL, NULL) < 0)
+		break;
+	    for (i = 0; i < 64; i++)
+		kill(sh.pid, i % 3 ? SIGINT : SIGTSTP);
+	    nsig += 64;
+	    /* stopped or dead, it is gone after this */
+	    if (reapall(&sh) < 0)
+		break;
+	}
+	if (k < 10) {
+	    fprintf(stderr, "stress: round %d: storm: the shell stopped answering\n", r);
+	    failures++;
+	    break;
+	}
+	tstorm += now() - t;
+
+	/* fgbg: background jobs pulled to the foreground, stopped and resumed */
+	snprintf(cmd, sizeof(cmd), "%s --ready &\n", self);
+	for (i = 0; i < njobs; i++)
+	    send(&sh, cmd);
+	for (i = 0; i < njobs; i++)
+	    expect(&sh, "ready\n", TIMEOUT, NULL, NULL);
+	t = now();
+	for (k = 0; k < 4 * njobs; k++) {
+	    snprintf(cmd, sizeof(cmd), "fg %%%d\n", k % njobs + 1);
+	    send(&sh, cmd);
+	    /* fg prints nothing, so stop until the stop is reported */
+	    for (i = 0; i < 100; i++) {
+		kill(sh.pid, SIGTSTP);
+		nsig++;
+		if (expect(&sh, "stopped by signal 20\n", 20, NULL, NULL) == 0)
+		    break;
+	    }
+	    if (i == 100)
+		break;
+	    snprintf(cmd, sizeof(cmd), "bg %%%d\n", k % njobs + 1);
+	    send(&sh, cmd);
+	    nmoves += 2;
+	}
+	if (k < 4 * njobs) {
+	    fprintf(stderr, "stress: round %d: fgbg: job %d never stopped\n", r, k % njobs + 1);
+	    failures++;
+	    break;
+	}
+	tfgbg += now() - t;
+	if (reapall(&sh) < 0) {
+	    fprintf(stderr, "stress: round %d: the shell stopped answering\n", r);
+	    failures++;
+	    break;
+	}
+
+	/* the job list must be sound and the shell must not leak */
+	seen = 0;
+	send(&sh, "wait\njobs --check\necho __round__\n");
+	if (expect(&sh, "__round__\n", TIMEOUT, "problem", &seen) < 0) {
+	    fprintf(stderr, "stress: round %d: the shell stopped answering\n", r);
+	    failures++;
+	    break;
+	}
+	if (seen)
+	    bad++;
+	if ((fds = countfds(sh.pid)) > fds0) {
+	    fprintf(stderr, "stress: round %d: %d descriptors open, %d at the start\n", r, fds, fds0);
+	    bad++;
+	}
+	printf("round %-3d %s\n", r, bad ? "FAIL" : "ok");
+	fflush(stdout);
+	failures += bad != 0;
+    }
+    stop(&sh);
+
+    r--;
+    if (r > 0) {
+	printf("churn  %10.0f children/s\n", tchurn ? (double)r * n / (tchurn / 1e9) : 0);
+	printf("storm  %10.0f jobs/s (%lld signals in all)\n", tstorm ? r * 10 / (tstorm / 1e9) : 0, nsig);
+	printf("fgbg   %10.0f transitions/s\n", tfgbg ? nmoves / (tfgbg / 1e9) : 0);
+    }
+    printf("%d failed round%s\n", failures, failures == 1 ? "" : "s");
+    return failures != 0;
+}
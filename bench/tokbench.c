@@ -0,0 +1,82 @@
+/*
+ * tokbench - Microbenchmark for the tsh tokenizer
+ *
+ * Builds long generated command lines (about 100 KB of arguments by
+ * default) and parses each one repeatedly with parseline(), reporting
+ * tokens/sec and MB/sec for plain words and for heavily quoted words.
+ *
+ * usage: tokbench [bytes-per-line] [iterations]
+ */
+#define TSH_NO_MAIN
+#include "../tsh.c"
+
+#include <time.h>
+
+/* now - Monotonic time in seconds */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* genline - Fill buf with about n bytes of arguments in the given style */
+static size_t genline(char *buf, size_t n, int quoted)
+{
+    static const char *plain[] = { "alpha", "b", "--long-option=value", "file_0123.log", "/usr/local/bin/x" };
+    static const char *fancy[] = { "'single quoted'", "\"double $HOME\"", "esc\\ aped", "mi'x'\"ed\"", "plain" };
+    const char **words = quoted ? fancy : plain;
+    size_t len = 0, w;
+    int i = 0;
+
+    len += sprintf(buf, "/bin/echo");
+    while (len < n) {
+	w = strlen(words[i % 5]);
+	buf[len++] = ' ';
+	memcpy(buf + len, words[i % 5], w);
+	len += w;
+	i++;
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
+/* run - Parse line iters times and print the throughput */
+static void run(const char *name, const char *line, size_t len, int iters)
+{
+    struct arena_t arena;
+    struct pipeline_t pl;
+    long tokens = 0;
+    double t0, t;
+    int i, args = 0;
+
+    t0 = now();
+    for (i = 0; i < iters; i++) {
+	arena_init(&arena);
+	if (parseline(line, len, &arena, &pl) < 0)
+	    app_error("tokbench: parse error");
+	args = pl.cmds[0].argc;
+	tokens += args;
+	arena_free(&arena);
+    }
+    t = now() - t0;
+    printf("%-8s %8zu bytes %7d args  %8.2f Mtokens/s  %8.1f MB/s\n", name, len,
+	   args, tokens / t / 1e6, (double)len * iters / t / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : 100 * 1024;
+    int iters = argc > 2 ? atoi(argv[2]) : 2000;
+    char *buf = malloc(n + 64);
+    size_t len;
+
+    if (buf == NULL)
+	unix_error("malloc error");
+    len = genline(buf, n, 0);
+    run("plain", buf, len, iters);
+    len = genline(buf, n, 1);
+    run("quoted", buf, len, iters);
+    return 0;
+}
@@ -0,0 +1,634 @@
+/*
+ * tshbench - Benchmark and smoke-test driver for tsh
+ *
+ * Runs tsh on a pipe (batch input, no prompt) or on a pseudo-terminal
+ * (prompt, ctrl-c/ctrl-z through the line discipline) and measures:
+ *
+ *   spawn      commands/s for trivial external commands, per engine
+ *   builtin    commands/s for a trivial builtin
+ *   prompt     time from a child's exit to the next prompt (waitfg)
+ *   sigint     ctrl-c to "terminated by signal 2"
+ *   sigtstp    ctrl-z to "stopped by signal 20"
+ *   jobs       adding, listing and reaping many background jobs
+ *
+ * Results are printed as CSV (label,metric,value,unit), or appended to
+ * a file with -o so that runs of different builds can be compared.
+ * With --check it instead runs a short functional test and exits with
+ * a non-zero status if anything is wrong.
+ *
+ * usage: tshbench [-n count] [-j jobs] [-l label] [-o file.csv] [--check] [tsh]
+ *
+ * The driver also serves as the child commands it times:
+ *   tshbench --stamp   print "stamp <CLOCK_MONOTONIC ns>" and exit
+ *   tshbench --ready   print "ready" and sleep until killed
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define BUFSIZE  (1 << 20) /* output kept while looking for a pattern */
+#define TIMEOUT  10000     /* ms to wait for any expected output */
+
+struct shell {              /* A tsh under test */
+    pid_t pid;
+    int in;                 /* its stdin (the pty master in pty mode) */
+    int out;                /* its stdout and stderr */
+    char *buf;              /* output not consumed yet */
+    size_t len;
+};
+
+static char self[4096];     /* this program, run as the timed command */
+static const char *tsh = "./tsh";
+static const char *label = "";
+static FILE *csv;
+static int failures;
+
+/* now - Monotonic time in nanoseconds */
+static long long now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* die - Report a fatal error and exit */
+static void die(const char *msg)
+{
+    fprintf(stderr, "tshbench: %s: %s\n", msg, strerror(errno));
+    exit(2);
+}
+
+/*
+ * start - Start tsh with the given extra option (or NULL).  On a pty the
+ *    shell prompts and is the terminal's foreground process group, so
+ *    ctrl-c and ctrl-z reach it; on a pipe it runs with -p.
+ */
+static void start(struct shell *sh, int pty, const char *opt)
+{
+    int in[2], out[2], master = -1, slave;
+    struct termios tio;
+    char *argv[5];
+    int argc = 0;
+
+    argv[argc++] = (char *)tsh;
+    if (!pty)
+	argv[argc++] = "-p";
+    if (opt)
+	argv[argc++] = (char *)opt;
+    argv[argc] = NULL;
+
+    if (pty) {
+	if ((master = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC)) < 0 ||
+	    grantpt(master) < 0 || unlockpt(master) < 0)
+	    die("posix_openpt");
+    }
+    else if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+	die("pipe");
+
+    if ((sh->pid = fork()) < 0)
+	die("fork");
+    if (sh->pid == 0) {
+	if (pty) {
+	    setsid();
+	    if ((slave = open(ptsname(master), O_RDWR)) < 0)
+		die("open pty");
+	    ioctl(slave, TIOCSCTTY, 0);
+	    /* no echo, so the output holds only what tsh prints */
+	    tcgetattr(slave, &tio);
+	    tio.c_lflag &= ~ECHO;
+	    tcsetattr(slave, TCSANOW, &tio);
+	    dup2(slave, 0);
+	    dup2(slave, 1);
+	    dup2(slave, 2);
+	    if (slave > 2)
+		close(slave);
+	}
+	else {
+	    dup2(in[0], 0);
+	    dup2(out[1], 1);
+	    dup2(out[1], 2);
+	}
+	execv(tsh, argv);
+	die(tsh);
+    }
+
+    if (pty)
+	sh->in = sh->out = master;
+    else {
+	close(in[0]);
+	close(out[1]);
+	sh->in = in[1];
+	sh->out = out[0];
+    }
+    if ((sh->buf = malloc(BUFSIZE)) == NULL)
+	die("malloc");
+    sh->len = 0;
+}
+
+/* stop - Close the shell's input and reap it */
+static void stop(struct shell *sh)
+{
+    close(sh->in);
+    if (sh->out != sh->in)
+	close(sh->out);
+    kill(sh->pid, SIGKILL);
+    waitpid(sh->pid, NULL, 0);
+    free(sh->buf);
+}
+
+/* feed - Write s to the shell */
+static void feed(struct shell *sh, const char *s)
+{
+    size_t n = strlen(s);
+    ssize_t rc;
+
+    while (n > 0) {
+	if ((rc = write(sh->in, s, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    die("write");
+	}
+	s += rc;
+	n -= rc;
+    }
+}
+
+/*
+ * expect - Read the shell's output until it contains pat.  Everything
+ *    up to the end of pat is consumed.  Returns the time pat arrived, or
+ *    -1 on timeout or end of output.  If line is not NULL it receives
+ *    the rest of the line that follows pat.
+ */
+static long long expect(struct shell *sh, const char *pat, char *line, size_t linesz)
+{
+    struct pollfd pfd = { sh->out, POLLIN, 0 };
+    size_t plen = strlen(pat), n;
+    long long deadline = now() + TIMEOUT * 1000000LL, t;
+    char *p, *nl;
+    ssize_t rc;
+
+    t = now();
+    while (1) {
+	if ((p = memmem(sh->buf, sh->len, pat, plen)) != NULL) {
+	    p += plen;
+	    if (line) {
+		/* wait for the whole line */
+		if ((nl = memchr(p, '\n', sh->buf + sh->len - p)) == NULL)
+		    goto more;
+		n = nl - p < (ssize_t)linesz - 1 ? (size_t)(nl - p) : linesz - 1;
+		memcpy(line, p, n);
+		line[n] = '\0';
+	    }
+	    sh->len -= p - sh->buf;
+	    memmove(sh->buf, p, sh->len);
+	    return t;
+	}
+	/* keep only a tail that could still start a match */
+	if (sh->len > BUFSIZE / 2 && sh->len > plen) {
+	    memmove(sh->buf, sh->buf + sh->len - plen, plen);
+	    sh->len = plen;
+	}
+    more:
+	if (poll(&pfd, 1, (deadline - now()) / 1000000) <= 0)
+	    return -1;
+	if ((rc = read(sh->out, sh->buf + sh->len, BUFSIZE - sh->len)) <= 0)
+	    return -1;
+	t = now();
+	sh->len += rc;
+    }
+}
+
+/* report - Print one CSV row */
+static void report(const char *metric, double value, const char *unit)
+{
+    fprintf(csv, "%s,%s,%.3f,%s\n", label, metric, value, unit);
+    fflush(csv);
+}
+
+/* cmpll - qsort comparison of long longs */
+static int cmpll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* report_lat - Print mean, p50, p99 and max of n latencies (ns) */
+static void report_lat(const char *metric, long long *v, int n)
+{
+    char name[128];
+    double sum = 0;
+    int i;
+
+    if (n == 0)
+	return;
+    qsort(v, n, sizeof(*v), cmpll);
+    for (i = 0; i < n; i++)
+	sum += v[i];
+    snprintf(name, sizeof(name), "%s_mean", metric);
+    report(name, sum / n / 1e3, "us");
+    snprintf(name, sizeof(name), "%s_p50", metric);
+    report(name, v[n / 2] / 1e3, "us");
+    snprintf(name, sizeof(name), "%s_p99", metric);
+    report(name, v[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] / 1e3, "us");
+    snprintf(name, sizeof(name), "%s_max", metric);
+    report(name, v[n - 1] / 1e3, "us");
+}
+
+/* bench_rate - Commands/s for n copies of cmd fed through a pipe */
+static void bench_rate(const char *metric, const char *opt, const char *cmd, int n)
+{
+    struct shell sh;
+    char line[256];
+    long long t0, t1;
+    int i;
+
+    start(&sh, 0, opt);
+    snprintf(line, sizeof(line), "%s\n", cmd);
+    t0 = now();
+    for (i = 0; i < n; i++)
+	feed(&sh, line);
+    feed(&sh, "echo __done__\n");
+    if ((t1 = expect(&sh, "__done__", NULL, 0)) < 0)
+	fprintf(stderr, "tshbench: %s: timed out\n", metric);
+    else
+	report(metric, n / ((t1 - t0) / 1e9), "cmds/s");
+    stop(&sh);
+}
+
+/* bench_prompt - Child exit to next prompt, n times */
+static void bench_prompt(int n)
+{
+    struct shell sh;
+    long long *lat = calloc(n, sizeof(long long)), t;
+    char cmd[4200], stamp[64];
+    int i, k = 0;
+
+    start(&sh, 1, NULL);
+    expect(&sh, "tsh> ", NULL, 0);
+    snprintf(cmd, sizeof(cmd), "%s --stamp\n", self);
+    for (i = 0; i < n; i++) {
+	feed(&sh, cmd);
+	if (expect(&sh, "stamp ", stamp, sizeof(stamp)) < 0 ||
+	    (t = expect(&sh, "tsh> ", NULL, 0)) < 0)
+	    break;
+	lat[k++] = t - atoll(stamp);
+    }
+    report_lat("exit_to_prompt", lat, k);
+    stop(&sh);
+    free(lat);
+}
+
+/* bench_signal - Keystroke key to the shell's message msg, n times */
+static void bench_signal(const char *metric, const char *key, const char *msg, int n)
+{
+    struct shell sh;
+    long long *lat = calloc(n, sizeof(long long)), t0, t1;
+    char cmd[4200];
+    int i, k = 0;
+
+    start(&sh, 1, NULL);
+    expect(&sh, "tsh> ", NULL, 0);
+    snprintf(cmd, sizeof(cmd), "%s --ready\n", self);
+    for (i = 0; i < n; i++) {
+	feed(&sh, cmd);
+	if (expect(&sh, "ready", NULL, 0) < 0)
+	    break;
+	t0 = now();
+	feed(&sh, key);
+	if ((t1 = expect(&sh, msg, NULL, 0)) < 0)
+	    break;
+	lat[k++] = t1 - t0;
+	/* a stopped job is killed before the next round */
+	if (strstr(msg, "stopped")) {
+	    feed(&sh, "kill -9 %1\n");
+	    if (expect(&sh, "terminated by signal 9", NULL, 0) < 0)
+		break;
+	}
+	else if (expect(&sh, "tsh> ", NULL, 0) < 0)
+	    break;
+    }
+    report_lat(metric, lat, k);
+    stop(&sh);
+    free(lat);
+}
+
+/* bench_jobs - Add, list and reap n background jobs */
+static void bench_jobs(int n)
+{
+    struct shell sh;
+    char cmd[4200], *kill9;
+    long long t0, t1;
+    size_t len;
+    int i;
+
+    start(&sh, 0, NULL);
+    snprintf(cmd, sizeof(cmd), "%s --ready &\n", self);
+    t0 = now();
+    for (i = 0; i < n; i++)
+	feed(&sh, cmd);
+    feed(&sh, "echo __added__\n");
+    if ((t1 = expect(&sh, "__added__", NULL, 0)) < 0) {
+	fprintf(stderr, "tshbench: jobs: timed out adding jobs\n");
+	stop(&sh);
+	return;
+    }
+    report("bg_add", n / ((t1 - t0) / 1e9), "jobs/s");
+
+    t0 = now();
+    feed(&sh, "jobs\necho __listed__\n");
+    if ((t1 = expect(&sh, "__listed__", NULL, 0)) >= 0)
+	report("jobs_list", (t1 - t0) / 1e3, "us");
+
+    /* one kill for every job, then wait for the reaper */
+    if ((kill9 = malloc(16 * (n + 1))) == NULL)
+	die("malloc");
+    len = sprintf(kill9, "kill -9");
+    for (i = 1; i <= n; i++)
+	len += sprintf(kill9 + len, " %%%d", i);
+    strcpy(kill9 + len, "\nwait\necho __reaped__\n");
+    t0 = now();
+    feed(&sh, kill9);
+    if ((t1 = expect(&sh, "__reaped__", NULL, 0)) >= 0)
+	report("bg_reap", n / ((t1 - t0) / 1e9), "jobs/s");
+    free(kill9);
+    stop(&sh);
+}
+
+/* check - Record the result of one functional test */
+static void check(const char *name, int ok)
+{
+    printf("%-28s %s\n", name, ok ? "ok" : "FAIL");
+    if (!ok)
+	failures++;
+}
+
+/*
+ * request - Connect to the server socket at path (retrying while tsh
+ *    starts), send req, shut down the write side and read every reply
+ *    into buf until the server closes the connection.  Returns the
+ *    length read, or -1.
+ */
+static ssize_t request(const char *path, const char *req, char *buf, size_t size)
+{
+    struct sockaddr_un sa;
+    struct pollfd pfd;
+    long long deadline = now() + TIMEOUT * 1000000LL;
+    size_t len = 0;
+    ssize_t rc;
+    int fd;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+	die("socket");
+    while (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+	if (now() > deadline) {
+	    close(fd);
+	    return -1;
+	}
+	usleep(10000);
+    }
+    if (write(fd, req, strlen(req)) != (ssize_t)strlen(req))
+	die("write");
+    shutdown(fd, SHUT_WR);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (len < size - 1 && poll(&pfd, 1, (deadline - now()) / 1000000) > 0 &&
+	   (rc = read(fd, buf + len, size - 1 - len)) > 0)
+	len += rc;
+    buf[len] = '\0';
+    close(fd);
+    return len;
+}
+
+/* run_checks - A quick functional test of the shell */
+static int run_checks(void)
+{
+    struct shell sh;
+    char cmd[4200], dir[] = "/tmp/tshcheckXXXXXX", sock[64], reply[4096];
+
+    if (mkdtemp(dir) == NULL)
+	die("mkdtemp");
+
+    start(&sh, 0, NULL);
+    feed(&sh, "echo hello world\n");
+    check("builtin echo", expect(&sh, "hello world\n", NULL, 0) >= 0);
+    feed(&sh, "/bin/echo 'quoted  arg' | /usr/bin/tr a-z A-Z\n");
+    check("pipeline", expect(&sh, "QUOTED  ARG\n", NULL, 0) >= 0);
+    snprintf(cmd, sizeof(cmd), "cd %s\n/bin/echo one > f\n/bin/echo two >> f\n/bin/cat < f\n", dir);
+    feed(&sh, cmd);
+    check("redirection", expect(&sh, "one\ntwo\n", NULL, 0) >= 0);
+    feed(&sh, "/bin/ls /nonexistent 2>&1 | /bin/grep -c nonexistent\n");
+    check("fd duplication", expect(&sh, "1\n", NULL, 0) >= 0);
+    feed(&sh, "echo x($(echo hi)) $(echo a b)\n");
+    check("command substitution", expect(&sh, "x(hi) a b\n", NULL, 0) >= 0);
+    feed(&sh, "nosuchcommand\n");
+    check("command not found", expect(&sh, "nosuchcommand: Command not found", NULL, 0) >= 0);
+    feed(&sh, "/bin/sleep 0.1 &\njobs\n");
+    check("background job", expect(&sh, "Running /bin/sleep 0.1 &", NULL, 0) >= 0);
+    feed(&sh, "/bin/sleep 0.1 & echo then this\n");
+    check("& between commands", expect(&sh, "then this\n", NULL, 0) >= 0);
+    feed(&sh, "wait\nparallel -j 4 echo item < f\n");
+    check("parallel", expect(&sh, "parallel: 2 of 2 commands run, 0 failed", NULL, 0) >= 0);
+    feed(&sh, "submit -j 1 /bin/sleep 0.1\nX=early\nsubmit /bin/echo $X\nX=late\nwait\nsubmit -j 0\n");
+    check("submit expands early", expect(&sh, "early\n", NULL, 0) >= 0);
+    feed(&sh, "FOO=bar /usr/bin/printenv FOO\necho [$FOO]\n");
+    check("assignment prefix", expect(&sh, "bar\n[]\n", NULL, 0) >= 0);
+    feed(&sh, "export FOO=baz\n/usr/bin/printenv FOO\nunset FOO\n/usr/bin/printenv FOO\necho unset $?\n");
+    check("export and unset", expect(&sh, "baz\nunset 1\n", NULL, 0) >= 0);
+    feed(&sh, "FOO=local\n/usr/bin/printenv FOO\necho local $?\n");
+    check("unexported variable", expect(&sh, "local 1\n", NULL, 0) >= 0);
+    /* ls is cached from the old PATH; the new one must win */
+    feed(&sh, "ls -d /\nprintf '#!/bin/sh\\necho mine\\n' > ls\n/bin/chmod +x ls\n"
+	 "PATH=.\nls\nPATH=/usr/bin:/bin\n");
+    check("PATH change", expect(&sh, "/\nmine\n", NULL, 0) >= 0);
+    feed(&sh, "/bin/mkdir -p g/sub/deep\ncd g\n/usr/bin/touch a.c b.c c.h sub/x.c sub/deep/y.c\n"
+	 "echo *.c\n");
+    check("glob", expect(&sh, "a.c b.c\n", NULL, 0) >= 0);
+    feed(&sh, "echo *.zzz\n");
+    check("glob without matches", expect(&sh, "*.zzz\n", NULL, 0) >= 0);
+    feed(&sh, "echo '*.c' \\*.c\n");
+    check("quoted glob", expect(&sh, "*.c *.c\n", NULL, 0) >= 0);
+    feed(&sh, "echo **/*.c\n");
+    check("recursive glob", expect(&sh, "a.c b.c sub/deep/y.c sub/x.c\n", NULL, 0) >= 0);
+    feed(&sh, "echo [ab].c [!a].c [a-b].?\n");
+    check("bracket glob", expect(&sh, "a.c b.c b.c a.c b.c\n", NULL, 0) >= 0);
+    feed(&sh, "cd ..\n/bin/rm -r g\necho removed\n");
+    expect(&sh, "removed\n", NULL, 0);
+    feed(&sh, "for i in 1 2 3; do echo i$i; done\n");
+    check("for", expect(&sh, "i1\ni2\ni3\n", NULL, 0) >= 0);
+    feed(&sh, "X=a; while /usr/bin/test $X != aaa; do X=${X}a; echo $X; done\n");
+    check("while", expect(&sh, "aa\naaa\n", NULL, 0) >= 0);
+    feed(&sh, "Y=; until /usr/bin/test \"$Y\" = bb; do Y=${Y}b; done; echo until $Y\n");
+    check("until", expect(&sh, "until bb\n", NULL, 0) >= 0);
+    feed(&sh, "if /bin/false; then echo yes; else echo no; fi\n"
+	 "if /bin/true; then echo yes; else echo no; fi\n");
+    check("if/else", expect(&sh, "no\nyes\n", NULL, 0) >= 0);
+    feed(&sh, "/bin/false && echo skipped; echo and $?\n/bin/false || echo ran; echo or $?\n"
+	 "/bin/true || echo skipped; /bin/true && /bin/false; echo last $?\n");
+    check("&& and ||", expect(&sh, "and 1\nran\nor 0\nlast 1\n", NULL, 0) >= 0);
+    feed(&sh, "wait -n\necho wait $?\n");
+    check("wait -n without jobs", expect(&sh, "wait 127\n", NULL, 0) >= 0);
+    feed(&sh, "timeout 0.2 /bin/sleep 5\necho timeout $?\n");
+    check("timeout", expect(&sh, "timeout 124\n", NULL, 0) >= 0);
+    feed(&sh, "timeout -k 0.3 0.1 /bin/sh -c \"trap '' TERM; /bin/sleep 5\" &\n"
+	 "/bin/sleep 0.2\njobs\nwait\necho grace $?\n");
+    check("timed out job listed", expect(&sh, "Expired timeout", NULL, 0) >= 0);
+    check("timeout grace", expect(&sh, "terminated by signal 9 (timed out)", NULL, 0) >= 0 &&
+	  expect(&sh, "grace 124\n", NULL, 0) >= 0);
+    stop(&sh);
+    snprintf(cmd, sizeof(cmd), "%s/f", dir);
+    unlink(cmd);
+    snprintf(cmd, sizeof(cmd), "%s/ls", dir);
+    unlink(cmd);
+
+    /* two requests in one write: each gets its job and done records */
+    snprintf(sock, sizeof(sock), "%s/sock", dir);
+    snprintf(cmd, sizeof(cmd), "-S%s", sock);
+    start(&sh, 0, cmd);
+    check("server", request(sock, "/bin/true\n/bin/sh -c 'exit 3'\n", reply, sizeof(reply)) > 0 &&
+	  strstr(reply, "1 job 1 ") && strstr(reply, "2 job 2 ") &&
+	  strstr(reply, "1 done 1 0 ") && strstr(reply, "2 done 2 3 "));
+    stop(&sh);
+    unlink(sock);
+
+    /* a 64-byte ring keeps the tail; the reaped job keeps its ID */
+    start(&sh, 0, "-C64");
+    feed(&sh, "/usr/bin/seq 1 2000 &\nwait\noutput %1\n");
+    check("output capture", expect(&sh, "[output: 8829 bytes dropped]\n988\n1989\n", NULL, 0) >= 0 &&
+	  expect(&sh, "1999\n2000\n", NULL, 0) >= 0);
+    feed(&sh, "/bin/echo next &\nwait\noutput %1\n");
+    check("output after reaping", expect(&sh, "[2] (", NULL, 0) >= 0 &&
+	  expect(&sh, "dropped]\n988\n", NULL, 0) >= 0);
+    stop(&sh);
+
+    /* history written by one shell is searched by the next */
+    snprintf(cmd, sizeof(cmd), "-H%s/hist", dir);
+    start(&sh, 0, cmd);
+    feed(&sh, "echo alpha one\necho beta two\necho alphabet\necho done\n");
+    expect(&sh, "done\n", NULL, 0);
+    stop(&sh);
+    start(&sh, 0, cmd);
+    feed(&sh, "history alpha\n");
+    check("history search", expect(&sh, "     1  echo alpha one\n     3  echo alphabet\n", NULL, 0) >= 0);
+    feed(&sh, "history -p 'echo b'\n");
+    check("history prefix", expect(&sh, "     2  echo beta two\n", NULL, 0) >= 0);
+    stop(&sh);
+    unlink(cmd + 2);
+    rmdir(dir);
+
+    start(&sh, 0, "--timeout=0.2");
+    feed(&sh, "/bin/sleep 5\necho timeout $?\n");
+    check("--timeout", expect(&sh, "timeout 124\n", NULL, 0) >= 0);
+    stop(&sh);
+
+    start(&sh, 1, NULL);
+    check("prompt", expect(&sh, "tsh> ", NULL, 0) >= 0);
+    snprintf(cmd, sizeof(cmd), "%s --ready\n", self);
+    feed(&sh, cmd);
+    expect(&sh, "ready", NULL, 0);
+    feed(&sh, "\003");
+    check("ctrl-c", expect(&sh, "terminated by signal 2", NULL, 0) >= 0);
+    feed(&sh, cmd);
+    expect(&sh, "ready", NULL, 0);
+    feed(&sh, "\032");
+    check("ctrl-z", expect(&sh, "stopped by signal 20", NULL, 0) >= 0);
+    feed(&sh, "jobs\n");
+    check("stopped job listed", expect(&sh, "Stopped", NULL, 0) >= 0);
+    feed(&sh, "bg %1\n");
+    check("bg", expect(&sh, "--ready", NULL, 0) >= 0);
+    /* fg prints nothing; give the shell time to resume the job */
+    feed(&sh, "fg %1\n");
+    usleep(200000);
+    feed(&sh, "\003");
+    check("fg then ctrl-c", expect(&sh, "terminated by signal 2", NULL, 0) >= 0);
+    feed(&sh, "quit\n");
+    stop(&sh);
+
+    printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+    return failures != 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: tshbench [-n count] [-j jobs] [-l label] [-o file.csv] [--check] [tsh]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int n = 2000, njobs = 500, checkmode = 0, i;
+    const char *outfile = NULL;
+    ssize_t rc;
+
+    /* helper modes, run by tsh as the timed commands */
+    if (argc == 2 && !strcmp(argv[1], "--stamp")) {
+	printf("stamp %lld\n", now());
+	return 0;
+    }
+    if (argc == 2 && !strcmp(argv[1], "--ready")) {
+	printf("ready\n");
+	fflush(stdout);
+	while (1)
+	    pause();
+    }
+
+    for (i = 1; i < argc; i++) {
+	if (!strcmp(argv[i], "-n") && i + 1 < argc)
+	    n = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+	    njobs = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+	    label = argv[++i];
+	else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+	    outfile = argv[++i];
+	else if (!strcmp(argv[i], "--check"))
+	    checkmode = 1;
+	else if (argv[i][0] == '-')
+	    usage();
+	else
+	    tsh = argv[i];
+    }
+    if ((rc = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0)
+	die("readlink");
+    self[rc] = '\0';
+    if (access(tsh, X_OK) < 0)
+	die(tsh);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (checkmode)
+	return run_checks();
+
+    csv = stdout;
+    if (outfile && (csv = fopen(outfile, "a")) == NULL)
+	die(outfile);
+    if (csv != stdout)
+	fseek(csv, 0, SEEK_END);
+    if (ftell(csv) <= 0)
+	fprintf(csv, "label,metric,value,unit\n");
+
+    bench_rate("spawn_rate_posix_spawn", "-sspawn", "/bin/true", n);
+    bench_rate("spawn_rate_fork", "-sfork", "/bin/true", n);
+    bench_rate("builtin_rate", NULL, "true", n * 50);
+    bench_prompt(n / 4);
+    bench_signal("sigint_latency", "\003", "terminated by signal 2", 50);
+    bench_signal("sigtstp_latency", "\032", "stopped by signal 20", 50);
+    bench_jobs(njobs);
+    return 0;
+}
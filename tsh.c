@@ -3,36 +3,141 @@
  * 
  * <Viet Minh Nguyen/vmnuye2@uno.edu>
  */
+#define _GNU_SOURCE             /* pipe2, F_SETPIPE_SZ, signalfd, cpu_set_t */
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define INBUFSIZE (256*1024) /* read size for piped input */
+#define OUTBUFSIZE (64*1024) /* stdout buffer when it is not a terminal */
+#define ARENABLK  (64*1024) /* default arena block size */
+#define ARENASPARE 8      /* most default-size blocks kept for reuse */
 #define MAXJID    1<<16   /* max job ID */
+#define ADMITTICK 500     /* ms between load checks while submit jobs wait */
+#define WHEELTICK 10      /* ms per tick of the timeout wheel */
+#define WHEELBITS 6       /* each level of the wheel has 1<<WHEELBITS slots */
+#define WHEELLEVELS 4     /* ... so it spans 2^24 ticks (46 hours) */
+#define WHEELMASK ((1UL << WHEELBITS) - 1)
+#define KILLGRACE 5000    /* default ms from a timed-out job's SIGTERM to SIGKILL */
+#define CAPCHUNK  4096    /* first buffer of a job's captured output */
+#define HISTGROW  (1<<20) /* history file growth step (bytes) */
+#define HISTDEAD  0x80000000u /* size flag of a record its writer gave up */
+#define HISTHOLE  1000    /* ms a reserved record may stay empty before readers skip it */
+#define GLOBBUF   (256*1024) /* getdents64 batch size */
+#define GLOBMAXTHREADS 8  /* most threads a ** walk uses */
+#define SCRIPTCACHE 64    /* compiled lines kept (power of two) */
+#define LOOPPOLL  64      /* loop iterations between signal checks */
+#define TRACECAP  (1<<16) /* events held by the trace ring (power of two) */
+#define HISTSUB   32      /* histogram buckets per power of two */
+#define HISTBUCKETS (2*HISTSUB + 58*HISTSUB) /* enough for any 64-bit value */
+
+/* Token types */
+#define TOK_WORD  0 /* a word, possibly quoted */
+#define TOK_PIPE  1 /* | */
+#define TOK_AMP   2 /* & */
+#define TOK_LESS  3 /* < */
+#define TOK_GREAT 4 /* > */
+#define TOK_DGREAT 5   /* >> */
+#define TOK_LESSAND 6  /* <& */
+#define TOK_GREATAND 7 /* >& */
+#define TOK_IONUM 8    /* digits right before a redirection, as in 2> */
+#define TOK_SEMI  9    /* ; */
+#define TOK_ANDIF 10   /* && */
+#define TOK_ORIF  11   /* || */
+#define TOK_NEWLINE 12 /* end of a line */
+
+/* Script node types */
+#define N_PIPE  0 /* a pipeline */
+#define N_AND   1 /* left && right */
+#define N_OR    2 /* left || right */
+#define N_IF    3 /* if cond; then body; else alt; fi (elif nests in alt) */
+#define N_WHILE 4 /* while cond; do body; done */
+#define N_UNTIL 5 /* until cond; do body; done */
+#define N_FOR   6 /* for name in words; do body; done */
+
+/* Word flags */
+#define WF_QUOTED 0x1 /* has quotes or backslashes to remove */
+#define WF_EXPAND 0x2 /* has $ expansions */
+#define WF_GLOB   0x4 /* has unquoted *, ? or [ */
+#define WF_SUBST  0x8 /* has $(...) */
+
+/* Spawn engines */
+#define ENGINE_SPAWN 0 /* posix_spawn (vfork-style clone in glibc) */
+#define ENGINE_FORK  1 /* fork followed by execve */
+
+/* pidfd_send_signal flag (linux/pidfd.h, Linux 6.9) */
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
+
+/* I/O priorities (linux/ioprio.h) */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT    1
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_WHO_PGRP    2
+
+/* Trace events; the spans also keep a latency histogram */
+#define TR_PARSE   0 /* span: tokenize and parse a command line */
+#define TR_BUILTIN 1 /* span: run a builtin in the shell */
+#define TR_SPAWN   2 /* span: start one process (fork or posix_spawn) */
+#define TR_WAIT    3 /* span: wait for a foreground job */
+#define TR_COMMAND 4 /* span: a command line, from read to done */
+#define TR_EXEC    5 /* instant: a child execs its command (spawned: has exec'd) */
+#define TR_SIGCHLD 6 /* instant: SIGCHLD read from sigfd */
+#define TR_REAP    7 /* instant: a process was reaped */
+#define TR_PROMPT  8 /* instant: ready for the next command line */
+#define NTRACE     9
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define QU 4    /* queued by submit, not started yet */
 
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped), QU (queued)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     QU -> BG  : admitted by the submit queue, or bg command
+ *     QU -> FG  : fg command
  * At most 1 job can be in the FG state.
  */
 
@@ -40,46 +145,707 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
-int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+int pipe_size = 0;          /* F_SETPIPE_SZ for pipeline pipes (0 = kernel default) */
+int engine = ENGINE_SPAWN;  /* how external commands are started */
+const char *statename[] = { "Undefined", "Foreground", "Running", "Stopped", "Queued" };
+                            /* job states as jobs -l and --stats show them */
+
+int sigfd = -1;             /* signalfd delivering SIGCHLD, SIGINT, SIGTSTP, SIGQUIT */
+int epfd = -1;              /* epoll instance driving the event loop */
+sigset_t loop_mask;         /* signals routed through sigfd (kept blocked) */
+sigset_t child_mask;        /* signal mask restored in children before execve */
+
+struct input_t {            /* Line reader for the shell's input */
+    int fd;                 /* stdin or the script given on the command line */
+    char *buf;              /* mapped file, or buffer of bytes read so far */
+    size_t pos;             /* start of the next line in buf */
+    size_t len;             /* number of valid bytes in buf */
+    size_t cap;             /* allocated size of buf (0 if mapped) */
+    char *tail;             /* copy of an unterminated last line plus '\n' */
+    int mapped;             /* buf is an mmap of the whole input file */
+    int eof;                /* read() returned 0 */
+    int pollable;           /* fd is registered with epfd */
+    int watching;           /* EPOLLIN currently enabled for fd */
+    int ready;              /* epoll reported fd readable */
+};
+struct input_t input;       /* The shell's input stream */
+int stdout_tty;             /* stdout is a terminal: flush after every command */
+int exitstatus;             /* status of the last foreground command */
+int sigint_pending;         /* ctrl-c arrived with no foreground job */
+
+struct redir_t {            /* One I/O redirection of a command */
+    int fd;                 /* descriptor being redirected */
+    int flags;              /* open(2) flags */
+    const char *path;       /* file opened onto fd, or NULL for N>&M */
+    int dupfd;              /* M of N>&M or N<&M, or -1 for N>&- (close N) */
+};
+
+struct cmd_t {              /* One command of a pipeline */
+    char **argv;            /* NULL-terminated argument list */
+    int argc;               /* number of arguments */
+    struct redir_t *redirs; /* redirections, applied in order */
+    int nredirs;            /* number of redirections */
+    char **assigns;         /* NAME=value words before the command */
+    int nassigns;
+    struct builtin_t *builtin; /* the builtin argv[0] names, if looked up already */
+};
+
+struct place_t {            /* Where and how a job's processes run */
+    cpu_set_t cpus;         /* CPU affinity, if hascpus */
+    int hascpus;
+    int nice;               /* nice value, if hasnice */
+    int hasnice;
+    int ioprio;             /* ioprio_set value, or -1 */
+    int policy;             /* SCHED_OTHER, SCHED_BATCH or SCHED_IDLE, or -1 */
+};
+
+struct pipeline_t {         /* A parsed command line */
+    struct cmd_t *cmds;     /* the commands, in pipeline order */
+    int ncmds;              /* number of commands (0 for a blank line) */
+    int bg;                 /* ends with & */
+    int timed;              /* prefixed with the time builtin */
+    long timeout;           /* ms it may run (timeout prefix or --timeout), or 0 */
+    long grace;             /* ... then ms from SIGTERM to SIGKILL (0 = none) */
+    struct place_t *place;  /* placement given with run, or NULL */
+    struct job_t *queued;   /* the submit job these processes start, or NULL */
+};
+
+struct token_t {            /* One token of a command line */
+    int type;               /* TOK_WORD or an operator */
+    int flags;              /* WF_* for words */
+    const char *p;          /* raw text in the command line */
+    size_t len;
+};
+
+struct arenablk_t {         /* One block of an arena */
+    struct arenablk_t *next;
+    size_t size;            /* usable bytes in data */
+    max_align_t data[];
+};
+
+struct arena_t {            /* Bump allocator for everything one command needs */
+    struct arenablk_t *blk; /* current block (head of the chain) */
+    char *ptr;              /* next free byte in blk */
+    char *end;              /* end of blk */
+    char *last;             /* most recent allocation, which can grow in place */
+};
+struct arenablk_t *arena_spare; /* released blocks, reused by the next command */
+int arena_nspare;               /* ... and how many there are */
+
+struct proc_t {             /* One process of a job's pipeline */
+    pid_t pid;              /* process ID */
+    int pidfd;              /* pidfd until it is reaped, or -1 */
+    int done;               /* true once the process has been reaped */
+};
+
+struct workq_t {            /* Work queue of a parallel batch */
+    char **tmpl;            /* command template; {} is replaced by the item */
+    int tmplc;
+    struct redir_t *redirs; /* output redirections given to every command */
+    int nredirs;
+    char *itembuf;          /* the input, one item per line */
+    char **items;
+    int nitems;
+    int next;               /* index of the next item to start */
+    int maxrun;             /* at most this many commands at once */
+    int done;               /* commands that have finished */
+    int failed;             /* ... with a non-zero status or a signal */
+    int aborted;            /* ctrl-c or a timeout: start nothing more */
+    struct timespec start;  /* when the batch was submitted */
+    struct place_t *place;  /* placement of every command, or NULL */
+};
 
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (process group ID of the pipeline) */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int nprocs;             /* number of processes in the pipeline */
+    int nlive;              /* processes not yet reaped */
+    int termsig;            /* last signal that killed a process, or 0 */
+    int stopsig;            /* signal that last stopped it, or 0 */
+    int status;             /* exit status of the pipeline's last command */
+    struct proc_t *procs;   /* the pipeline's processes, in order */
+    int proccap;            /* allocated size of procs */
+    struct workq_t *wq;     /* work queue feeding a parallel batch, or NULL */
+    struct rusage ru;       /* summed wait4() usage of the reaped processes */
+    struct timespec start;  /* CLOCK_MONOTONIC time the job was started */
+    struct timespec end;    /* ... and the time its last process was reaped */
+    time_t started;         /* wall-clock start, for display only */
+    int timed;              /* report the usage when done (time builtin) */
+    int expired;            /* 1 once its timeout sent SIGTERM, 2 once SIGKILL */
+    long grace;             /* ms from that SIGTERM to SIGKILL (0 = none) */
+    unsigned long due;      /* wheel tick of its deadline ... */
+    struct job_t *tnext;    /* ... and its timer wheel slot, while it has one */
+    struct job_t **tpprev;
+    const char *cmdline;    /* command line (interned in strpool) */
+    struct job_t *prev;     /* job list, in creation order */
+    struct job_t *next;
+    struct job_t *qnext;    /* submit queue, while the job is QU */
+    char *runline;          /* ... and its expanded words, quoted (malloc'd) */
+    struct capture_t *cap;  /* its captured output (-C), or NULL */
+    int *waitst;            /* where wait wants the status, or NULL */
+    struct client_t *client; /* server client that asked for the job, or NULL */
+    unsigned long tag;      /* ... and the number of its request */
+};
+
+struct intmap_t {           /* Open-addressing hash map: int key (> 0) -> pointer */
+    int *keys;              /* 0 marks an empty slot */
+    void **vals;
+    size_t cap;             /* power of two */
+    size_t count;
+};
+
+struct joblist_t {          /* The job list */
+    struct job_t *head;     /* oldest job */
+    struct job_t *tail;     /* newest job */
+    int count;              /* number of jobs */
+    struct job_t *fg;       /* the foreground job, if any */
+    struct intmap_t bypid;  /* PID of every live process -> job */
+    struct intmap_t byjid;  /* job ID -> job */
+    int nrun;               /* jobs in the BG or FG state */
+    struct job_t *qhead;    /* submit queue, oldest first */
+    struct job_t *qtail;
+    int nqueued;
+    int nheld;              /* IDs kept by captured output of reaped jobs */
+    int nextjid;            /* smallest job ID never handed out */
+    int *freejids;          /* released job IDs, reused first */
+    int nfree;
+    int freecap;
+    struct job_t *spare;    /* deleted job structs kept for reuse */
+};
+struct joblist_t jobs;      /* The job list */
+struct intmap_t waitfds;    /* pidfds in the event loop while wait runs */
+
+struct admit_t {            /* When the submit queue may start a job */
+    int maxrun;             /* at most this many running jobs (0 = no limit) */
+    double maxload;         /* ... while the 1-minute load average is below (0 = off) */
+    long minmem;            /* ... and at least this many MB are available (0 = off) */
+    int tfd;                /* timerfd that rechecks load and memory, or -1 */
+    int armed;
+};
+struct admit_t admit = { -1, 0, 0, -1, 0 }; /* maxrun -1: one per CPU */
+
+struct wheel_t {            /* Hierarchical timer wheel of job deadlines */
+    int tfd;                /* timerfd set for the next tick with work, or -1 */
+    int count;              /* jobs on the wheel */
+    unsigned long now;      /* next tick to run */
+    long long base;         /* now_ns() at tick 0 */
+    struct job_t *slots[WHEELLEVELS][1 << WHEELBITS];
+};
+struct wheel_t wheel = { -1 };
+long deftimeout;            /* --timeout: ms any job may run, or 0 */
+
+struct strent_t {           /* An interned string */
+    struct strent_t *next;  /* bucket chain */
+    size_t hash;
+    int refs;               /* number of holders */
+    char s[];               /* the NUL-terminated string */
+};
+
+struct strpool_t {          /* Reference-counted string intern pool */
+    struct strent_t **buckets;
+    size_t nbuckets;        /* power of two */
+    size_t count;
+};
+struct strpool_t strpool;   /* Pool holding every job's command line */
+
+struct pathdir_t {          /* One directory of $PATH */
+    char *path;             /* directory name */
+    int fd;                 /* O_PATH descriptor used for lookups and execveat */
+};
+
+struct hashent_t {          /* Cached result of a PATH search */
+    char *name;             /* command name as typed */
+    char *path;             /* resolved file */
+    int dir;                /* index into pathdirs, or -1 if added with hash -p */
+    struct timespec mtime;  /* mtime of that directory when it was searched */
+    int hits;               /* times the entry was used */
+    struct hashent_t *next; /* bucket chain */
+};
+
+struct cmdhash_t {          /* Command name -> executable cache */
+    char *pathvar;          /* copy of $PATH the table was built for */
+    struct pathdir_t *dirs; /* parsed $PATH */
+    int ndirs;
+    struct hashent_t **buckets;
+    size_t nbuckets;        /* power of two */
+    size_t count;
+};
+struct cmdhash_t cmdhash;   /* The executable cache */
+
+struct node_t {             /* One command of a compiled script */
+    int type;               /* N_* */
+    struct node_t *next;    /* the command after it in its list */
+    struct node_t *left, *right; /* operands of && and || */
+    struct node_t *cond, *body, *alt; /* parts of if, while, until and for */
+    struct token_t *toks;   /* N_PIPE: its tokens; N_FOR: the words */
+    int ntoks;
+    int bg;                 /* N_PIPE: followed by & */
+    char *src;              /* N_PIPE: its text and a newline, for the job list */
+    size_t srclen;
+    char *name;             /* N_FOR: the variable */
+    struct builtin_t *builtin; /* N_PIPE: a lone builtin named by a plain word */
+};
+
+struct script_t {           /* A compiled line in the script cache */
+    char *src;              /* the line, which the tokens point into */
+    size_t len;
+    size_t hash;
+    struct arena_t arena;   /* src, tokens and nodes */
+    struct node_t *root;
+    int busy;               /* running (perhaps nested, via $(...)) */
+    struct script_t *next;  /* hash chain */
+};
+
+struct scripts_t {          /* Lines compiled to nodes, by their text */
+    struct script_t *buckets[SCRIPTCACHE];
+    int count;
+    int depth;              /* scripts running */
+    unsigned long hits, misses;
+};
+struct scripts_t scripts;
+
+struct parser_t {           /* State of compile */
+    struct token_t *toks;
+    int ntoks;
+    int i;                  /* next token */
+    struct arena_t *a;
+    int failed;             /* a syntax error was reported, or... */
+    int incomplete;         /* ... the text ended inside a construct */
+};
+
+struct contline_t {         /* Lines of a construct that is not finished */
+    char *buf;
+    size_t len, cap;
+};
+struct contline_t contline;
+int loopbreak;              /* ctrl-c: leave the loops and lists running */
+unsigned looptick;          /* loop iterations, for LOOPPOLL */
+
+struct strvec_t {           /* A growable array of strings */
+    char **v;
+    size_t n, cap;
+};
+
+struct globseg_t {          /* One compiled /-separated piece of a pattern */
+    const unsigned char *prog; /* match program of G_* opcodes */
+    const char *lit;        /* the piece itself if it has no wildcards */
+    size_t litlen;
+    const char *pre, *suf;  /* literal text every match starts/ends with */
+    size_t prelen, suflen;
+    int dot;                /* starts with '.', so it may match dot files */
+    int star2;              /* the piece is ** */
+};
+
+struct globout_t {          /* Names found by one thread of a glob */
+    struct strvec_t v;
+    struct arenablk_t *blk; /* blocks holding the names */
+    char *ptr, *end;        /* free part of the newest block */
+    char *buf;              /* getdents64 buffer */
+};
+
+struct globctx_t {          /* One pattern being expanded */
+    struct globseg_t *segs;
+    int nsegs;
+    int dirsonly;           /* ends in '/': only directories match */
+    char path[PATH_MAX];    /* the directory being read */
+    struct globout_t out;
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+
+struct globwalk_t {         /* A ** walk shared by its threads */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* todo grew, or the walk is over */
+    struct strvec_t todo;   /* directories still to read */
+    int busy;               /* threads reading one */
+    const struct globseg_t *seg; /* matched in every directory (NULL: report the directories) */
+};
+
+struct globthr_t {          /* One thread of a ** walk */
+    struct globwalk_t *walk;
+    struct globout_t out;
+    pthread_t tid;
+};
+
+int globthreads;            /* threads per ** walk (0: one per CPU, up to GLOBMAXTHREADS) */
+
+struct var_t {              /* A shell variable */
+    char *str;              /* "NAME=value", the form envp needs */
+    size_t namelen;
+    int exported;           /* passed to the commands the shell runs */
+    struct var_t *next;     /* bucket chain */
+};
+
+struct vartab_t {           /* The shell variables */
+    struct var_t **buckets;
+    size_t nbuckets;        /* power of two */
+    size_t count;
+    size_t nexported;
+    char **envp;            /* snapshot of the exported ones, shared by */
+    int envdirty;           /* ... every exec until one of them changes */
+};
+struct vartab_t vars;       /* The shell's variables */
+pid_t lastbg;               /* $!: last process of the newest & job */
+int substdepth;             /* $(...) commands being run */
+
+struct builtin_t {          /* A command run inside the shell */
+    const char *name;
+    int (*fn)(char **argv); /* runs the command, returns its exit status */
+};
+struct builtin_t **btab;    /* builtins hashed by name, one per slot */
+size_t bmask;               /* size of btab - 1 */
+
+struct capture_t {          /* Captured output of a background job */
+    int fd;                 /* read end of the job's output pipe, -1 at EOF */
+    int jid;
+    struct job_t *job;      /* the job, or NULL once it has been reaped */
+    int status;             /* ... and then its exit status */
+    const char *cmdline;    /* command line (interned in strpool) */
+    char *buf;              /* the last size bytes, a ring once size is max */
+    size_t size;
+    unsigned long long total; /* bytes received */
+};
+
+struct captures_t {         /* Output capture of background jobs (-C) */
+    size_t max;             /* bytes kept per job (0 = off) */
+    struct intmap_t byjid;  /* job ID -> struct capture_t */
+    struct intmap_t byfd;   /* pipe -> struct capture_t, until EOF */
+};
+struct captures_t captures;
+
+struct client_t {           /* A connection to the command server (-S) */
+    int fd;
+    char *in;               /* received bytes not yet run */
+    size_t inlen;
+    size_t incap;
+    char *out;              /* replies the socket has not taken yet */
+    size_t outlen;
+    size_t outcap;
+    unsigned long seq;      /* requests received so far */
+    int pending;            /* ... whose job has not finished */
+    int eof;                /* the client is done sending */
+};
+
+struct server_t {           /* The command server */
+    int fd;                 /* listening socket, or -1 */
+    int epfd;               /* epoll set of the sockets, nested in epfd */
+    int paused;             /* epfd taken out of the event loop meanwhile */
+    const char *path;
+    pid_t owner;            /* the shell (forked children must not unlink it) */
+    struct intmap_t clients; /* fd -> struct client_t */
+    struct client_t *serving; /* client whose request is being run */
+    struct job_t *lastjob;  /* job created by that request, if any */
+};
+struct server_t server = { -1, -1 };
+
+struct histhdr_t {          /* Header of the history file */
+    char magic[8];          /* "tshhist1" */
+    _Atomic uint64_t used;  /* bytes in use, header included */
+};
+
+struct histrec_t {          /* One history entry, 8-byte aligned in the file */
+    _Atomic uint32_t size;  /* record size; 0 until the entry is complete,
+			       HISTDEAD is set if it never will be */
+    int32_t status;         /* exit status of the command */
+    int64_t when;           /* start time (seconds since the epoch) */
+    int64_t dur;            /* how long it took (ns) */
+    uint32_t cmdlen;        /* command line, without the newline */
+    uint32_t cwdlen;        /* working directory */
+    char text[];            /* cmdline NUL cwd NUL */
+};
+
+struct posting_t {          /* Entries containing one trigram, ascending */
+    uint32_t *ids;
+    uint32_t n;
+    uint32_t cap;
+};
+
+struct histlog_t {          /* The shell's command history */
+    int fd;                 /* history file, or -1 when disabled */
+    char *map;              /* shared mapping of the file */
+    size_t mapsize;
+    uint64_t indexed;       /* file offset the index covers */
+    uint64_t holeat;        /* empty record the index is stuck at ... */
+    long long holesince;    /* ... and when it was first seen */
+    uint64_t *offs;         /* entry number - 1 -> record offset */
+    uint32_t n;
+    uint32_t cap;
+    struct intmap_t tri;    /* trigram -> struct posting_t */
+};
+struct histlog_t histlog = { -1 };
+
+struct trace_t {            /* One trace event */
+    atomic_ulong seq;       /* ring index + 1 once the event is complete */
+    int type;               /* TR_* */
+    pid_t pid;              /* process the event is about, or 0 */
+    int jid;                /* its job, or 0 */
+    long long ts;           /* CLOCK_MONOTONIC, ns */
+    long long dur;          /* ns (spans only) */
+};
+
+struct tracering_t {        /* Lock-free multi-producer ring of trace events */
+    atomic_ulong head;      /* next index to claim */
+    unsigned long tail;     /* next index to write out (shell only) */
+    unsigned long dropped;  /* events overwritten before they were written */
+    struct trace_t ev[TRACECAP];
+};
+struct tracering_t *tracering; /* shared mapping, so forked children post too */
+FILE *traceout;             /* Chrome trace-event JSON, with -T */
+long long trace_t0;         /* time origin of the trace */
+int trace_nwritten;         /* events written to traceout */
+pid_t trace_owner;          /* the shell (forked children must not close it) */
+
+struct hist_t {             /* Log-linear (HDR-style) latency histogram */
+    unsigned long long count, sum, max;
+    unsigned long long buckets[HISTBUCKETS];
+};
+struct hist_t hists[NTRACE]; /* one per span type */
 /* End global variables */
 
 
 /* Function prototypes */
 
 /* Here are the functions that you will implement */
-void eval(char *cmdline);
-int builtin_cmd(char **argv);
-void do_bgfg(char **argv);
-void do_redirect(char **argv);
+void eval(const char *cmdline, size_t len);
+void run_pipeline(struct pipeline_t *pl, struct arena_t *a, const char *cmdline, size_t len);
+int builtin_cmd(struct cmd_t *cmd);
+int isbuiltin(const char *name);
+int do_bgfg(char **argv);
+int parse_redirect(int op, int fd, const char *word, struct redir_t *r);
+int do_redirect(struct cmd_t *cmd);
+pid_t spawn(struct cmd_t *cmd, pid_t pgid, int infd, int outfd, int usefork,
+	    const struct place_t *place);
 void waitfg(pid_t pid);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 
+/* PATH search */
+const char *pathvar(void);
+size_t hashmem(const char *p, size_t len);
+size_t hashname(const char *name);
+void cmdhash_reset(void);
+struct hashent_t *cmdhash_insert(const char *name, const char *path, int dir,
+				 struct timespec mtime);
+int cmdhash_delete(const char *name);
+struct hashent_t *findcmd(const char *name);
+int do_hash(char **argv);
+
+/* Parallel batches */
+void do_parallel(struct pipeline_t *pl, const char *cmdline, size_t len);
+pid_t workq_start(struct workq_t *wq, pid_t pgid);
+int workq_fill(struct job_t *job);
+void workq_reaped(struct job_t *job, int status);
+void workq_report(struct workq_t *wq);
+void workq_free(struct workq_t *wq);
+double elapsed(struct timespec *since);
+
+/* Resource accounting */
+int do_jobs(char **argv);
+void timebuiltin(struct cmd_t *cmd);
+void rusage_add(struct rusage *sum, const struct rusage *ru);
+void rusage_sub(struct rusage *ru, const struct rusage *before);
+double tsdiff(const struct timespec *end, const struct timespec *start);
+void reportusage(const char *label, double real, const struct rusage *ru);
+void jobusage(struct job_t *job);
+
+/* Job placement */
+int placeclass(const char *s, size_t n, const char *name);
+int parse_place(char **argv, int i, struct place_t *p);
+int parse_cpus(const char *s, cpu_set_t *set);
+int place_task(const struct place_t *p, pid_t tid);
+int place_self(const struct place_t *p);
+void place_merge(struct place_t *dst, const struct place_t *src);
+int do_place(char **argv);
+
+/* Admission queue */
+void do_submit(struct pipeline_t *pl, const char *cmdline, size_t len);
+int parse_submit(char **argv, struct admit_t *lim);
+void admit_jobs(void);
+int admit_ok(void);
+void admit_timer(int on);
+int startqueued(struct job_t *job, int state);
+void unqueue(struct joblist_t *jobs, struct job_t *job);
+int queuepos(struct job_t *job);
+char *quotepipeline(struct pipeline_t *pl);
+void quoteadd(char **buf, size_t *len, size_t *cap, const char *s, size_t n, int quote);
+
+/* Job timeouts */
+long parse_duration(const char *s);
+int parse_timeout(char **argv, long *timeout, long *grace);
+void settimeout(struct job_t *job, long ms);
+unsigned long wheel_tick(void);
+void wheel_add(struct job_t *job, unsigned long due);
+void wheel_del(struct job_t *job);
+void wheel_cascade(int level);
+void wheel_run(void);
+unsigned long wheel_next(void);
+void wheel_arm(void);
+void job_expire(struct job_t *job);
+
+/* History */
+void hist_open(const char *path);
+int hist_map(uint64_t need);
+void hist_add(const char *cmdline, size_t len, int status, long long dur);
+void hist_sync(void);
+int hist_skiphole(uint64_t used);
+int hist_valid(struct histrec_t *r, uint64_t room);
+int hist_match(uint32_t id, const char *q, size_t qlen, int prefix);
+int do_history(char **argv);
+
+/* Output capture */
+void capture_start(struct job_t *job, int fd);
+void capture_read(struct capture_t *cap);
+void capture_eof(struct capture_t *cap);
+unsigned long long capture_print(struct capture_t *cap, unsigned long long from);
+void capture_drop(struct capture_t *cap);
+int capcmp(const void *a, const void *b);
+int do_output(char **argv);
+
+/* Server mode */
+void serve(const char *path);
+void serve_unlink(void);
+void serve_poll(void);
+void serve_event(int fd, uint32_t events);
+void serve_request(struct client_t *c, const char *line, size_t len);
+void serve_done(struct job_t *job);
+void serve_send(struct client_t *c, const char *buf, size_t n);
+int serve_flush(struct client_t *c);
+void serve_close(struct client_t *c);
+
+/* Lists, conditionals and loops */
+int evalsrc(const char *src, size_t len);
+void contline_add(const char *line, size_t len);
+int needscript(const char *s, size_t len);
+struct script_t *script_get(const char *src, size_t len, int *rc);
+void script_flush(void);
+int compile(char *src, size_t len, struct arena_t *a, struct node_t **root);
+struct node_t *parse_list(struct parser_t *ps, const char *const *stops);
+struct node_t *parse_andor(struct parser_t *ps);
+struct node_t *parse_command(struct parser_t *ps);
+struct node_t *parse_if(struct parser_t *ps);
+struct node_t *parse_while(struct parser_t *ps);
+struct node_t *parse_for(struct parser_t *ps);
+struct node_t *newnode(struct parser_t *ps, int type);
+int iskeyword(const struct token_t *t, const char *kw);
+int expect(struct parser_t *ps, const char *kw);
+void parse_error(struct parser_t *ps);
+void run_list(struct node_t *n);
+void run_node(struct node_t *n);
+void run_pipe(struct node_t *n);
+void loop_poll(void);
+
+/* Globbing */
+size_t globexpand(struct arena_t *a, const char *pat, char ***words);
+void globcompile(struct arena_t *a, const char *p, size_t n, struct globseg_t *s);
+int globmatch(const struct globseg_t *s, const char *name, size_t len);
+void globdir(struct globctx_t *g, size_t plen, int i, int check);
+void globscan(struct globout_t *out, const char *path, size_t plen,
+	      const struct globseg_t *s, int flags, struct strvec_t *dirs);
+void globwalk(struct globout_t *out, const char *path, size_t plen, const struct globseg_t *s);
+void *globwalker(void *arg);
+void globemit(struct globout_t *out, const char *path, size_t plen, const char *name, size_t nlen);
+void globmerge(struct globout_t *out, struct globout_t *from);
+void globfree(struct globout_t *out);
+int globcmp(const void *a, const void *b);
+void strvec_push(struct strvec_t *v, char *s);
+
+/* Shell variables */
+void initvars(void);
+struct var_t *findvar(const char *name, size_t len);
+const char *getvar(const char *name);
+void setvar(const char *name, size_t len, const char *value, int export);
+int unsetvar(const char *name);
+char **envsnapshot(void);
+size_t namelen(const char *s);
+const char *expandvar(const char **pp, const char *end, size_t *len);
+int do_unset(char **argv);
+
+/* Builtin commands */
+void initbuiltins(void);
+struct builtin_t *findbuiltin(const char *name);
+int redirect_save(struct cmd_t *cmd, int *fds, int *copies);
+void redirect_restore(int *fds, int *copies, int n);
+int do_quit(char **argv);
+int do_cd(char **argv);
+int do_echo(char **argv);
+int do_printf(char **argv);
+const char *putescape(const char *p);
+int do_true(char **argv);
+int do_false(char **argv);
+int do_test(char **argv);
+int testexpr(char **av, int n);
+int testunary(const char *op, const char *arg);
+int testbinary(const char *a, const char *op, const char *b);
+int do_export(char **argv);
+int do_kill(char **argv);
+int signum(const char *name);
+int do_wait(char **argv);
+struct job_t *waitarg(const char *arg);
+
+/* Tracing and latency statistics */
+long long now_ns(void);
+void trace_open(const char *path);
+void trace_post(int type, long long ts, long long dur, pid_t pid, int jid);
+void trace_span(int type, long long start, pid_t pid, int jid);
+void trace_flush(void);
+void trace_close(void);
+int histbucket(unsigned long long v);
+unsigned long long histvalue(int b);
+unsigned long long histpct(struct hist_t *h, double pct);
+int do_stats(char **argv);
+
+/* Event loop */
+void init_eventloop(void);
+void dispatch_signals(void);
+void eventloop_wait(int timeout, int want_input);
+void input_open(int fd);
+int readcmdline(const char **line, size_t *len);
+
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parseline(const char *cmdline, size_t len, struct arena_t *a, struct pipeline_t *pl); 
+int buildpipeline(struct token_t *toks, int ntoks, struct arena_t *a, struct pipeline_t *pl);
+int addword(struct arena_t *a, struct cmd_t *cmd, size_t *argcap, const struct token_t *t);
+int tokenize(const char *s, size_t n, struct arena_t *a, struct token_t **toks);
+const char *scanword(const char *p, const char *end);
+char *expandword(struct arena_t *a, const struct token_t *t, int glob, int *nfields);
+const char *substend(const char *p, const char *end);
+char *cmdsubst(struct arena_t *a, const char *cmd, size_t len, size_t *outlen);
+int splitfields(char *s, size_t len);
+
+void arena_init(struct arena_t *a);
+void *arena_alloc(struct arena_t *a, size_t n);
+void *arena_grow(struct arena_t *a, void *p, size_t oldn, size_t newn);
+void arena_free(struct arena_t *a);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs(struct joblist_t *jobs);
+struct job_t *addjob(struct joblist_t *jobs, pid_t *pids, int nprocs, int state,
+		     const char *cmdline, size_t len);
+int deletejob(struct joblist_t *jobs, pid_t pid); 
+void removejob(struct joblist_t *jobs, struct job_t *job);
+void releasejid(struct joblist_t *jobs, int jid);
+void setjobstate(struct joblist_t *jobs, struct job_t *job, int state);
+int procdone(struct joblist_t *jobs, struct job_t *job, pid_t pid);
+void addjobproc(struct joblist_t *jobs, struct job_t *job, pid_t pid);
+int signaljob(struct job_t *job, int sig);
+pid_t fgpid(struct joblist_t *jobs);
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct joblist_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs(struct joblist_t *jobs);
+void listjobs_long(struct joblist_t *jobs);
+void listjobs_stats(struct joblist_t *jobs);
+int checkjobs(struct joblist_t *jobs);
+
+void intmap_put(struct intmap_t *m, int key, void *val);
+void *intmap_get(struct intmap_t *m, int key);
+size_t intmap_slot(struct intmap_t *m, int key);
+void intmap_del(struct intmap_t *m, int key);
+const char *strpool_intern(const char *s, size_t len);
+void strpool_release(const char *s);
 
 void usage(void);
 void unix_error(char *msg);
@@ -87,21 +853,34 @@ void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
 
+#ifndef TSH_NO_MAIN
 /*
  * main - The shell's main routine 
  */
 int main(int argc, char **argv) 
 {
     char c;
-    char cmdline[MAXLINE];
+    const char *cmdline;
+    size_t len;
+    char *script = NULL; /* batch mode input file */
+    char *histpath = NULL; /* history file */
+    char *sockpath = NULL; /* serve commands on this socket */
+    char *end;
+    long val;
+    int fd;
+    long long start;
     int emit_prompt = 1; /* emit prompt (default) */
+    static struct option longopts[] = {
+        { "timeout", required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt_long(argc, argv, "hvpC:f:H:P:s:S:t:T:", longopts, NULL)) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -112,52 +891,122 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'C':             /* capture the output of & jobs */
+            captures.max = atol(optarg);
+	    break;
+        case 'f':             /* run a script in batch mode */
+            script = optarg;
+	    break;
+        case 'H':             /* keep the command history in a file */
+            histpath = optarg;
+	    break;
+        case 'P':             /* size of pipeline pipe buffers */
+            val = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || val < 0 || val > INT_MAX)
+                usage();
+            pipe_size = val;
+	    break;
+        case 's':             /* spawn engine: spawn or fork */
+            if (!strcmp(optarg, "fork"))
+                engine = ENGINE_FORK;
+            else if (!strcmp(optarg, "spawn"))
+                engine = ENGINE_SPAWN;
+            else
+                usage();
+	    break;
+        case 'S':             /* run commands sent to a Unix socket */
+            sockpath = optarg;
+	    break;
+        case 't':             /* give every job a deadline */
+            if ((deftimeout = parse_duration(optarg)) < 0)
+                usage();
+	    break;
+        case 'T':             /* write a Chrome trace of every command */
+            trace_open(optarg);
+	    break;
 	default:
             usage();
 	}
     }
+    if (script == NULL && optind < argc) /* tsh script.tsh */
+        script = argv[optind];
+
+    /* When stdout is a file or pipe, let a large buffer batch the
+     * output; it is flushed before a child starts and before the shell
+     * sleeps, so ordering with the children's output is preserved. */
+    if (!(stdout_tty = isatty(STDOUT_FILENO)))
+        setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZE);
+
+    /* Route the job control signals through the event loop.  SIGCHLD,
+     * SIGINT, SIGTSTP and SIGQUIT stay blocked for the life of the shell
+     * and are read from sigfd, so the job list is only ever touched
+     * from ordinary (non-signal) context. */
+    init_eventloop();
+    if (script) {
+        if ((fd = open(script, O_RDONLY|O_CLOEXEC)) < 0)
+            unix_error(script);
+        emit_prompt = 0;
+        input_open(fd);
+    }
+    else
+        input_open(STDIN_FILENO);
 
-    /* Install the signal handlers */
+    /* Take the environment as the initial (exported) shell variables
+     * (before anything below looks one up) */
+    initvars();
 
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    /* An interactive shell keeps its history in ~/.tsh_history */
+    if (histpath == NULL && !script && isatty(STDIN_FILENO) && getvar("HOME")) {
+        snprintf(sbuf, sizeof(sbuf), "%s/.tsh_history", getvar("HOME"));
+        histpath = sbuf;
+    }
+    if (histpath)
+        hist_open(histpath);
 
     /* Ignoring these signals simplifies reading from stdin/stdout */
     Signal(SIGTTIN, SIG_IGN);          /* ignore SIGTTIN */
     Signal(SIGTTOU, SIG_IGN);          /* ignore SIGTTOU */
 
+    /* Initialize the job list */
+    initjobs(&jobs);
 
-    /* This one provides a clean way to kill the shell */
-    Signal(SIGQUIT, sigquit_handler); 
+    /* Hash the builtin command names */
+    initbuiltins();
 
-    /* Initialize the job list */
-    initjobs(jobs);
+    /* Server mode replaces the read/eval loop */
+    if (sockpath)
+        serve(sockpath);
 
     /* Execute the shell's read/eval loop */
     while (1) {
 
 	/* Read command line */
 	if (emit_prompt) {
-	    printf("%s", prompt);
+	    printf("%s", contline.len ? "> " : prompt);
 	    fflush(stdout);
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
+	trace_post(TR_PROMPT, now_ns(), 0, 0, 0);
+	if (!readcmdline(&cmdline, &len)) { /* End of file (ctrl-d) */
+	    if (contline.len)
+		printf("syntax error: unexpected end of file\n");
 	    fflush(stdout);
-	    exit(0);
+	    exit(contline.len ? 2 : 0);
 	}
 
 	/* Evaluate the command line */
-	eval(cmdline);
-	fflush(stdout);
-	fflush(stdout);
+	start = now_ns();
+	eval(cmdline, len);
+	trace_span(TR_COMMAND, start, 0, 0);
+	/* A script of builtins never sleeps; drain the trace ring here */
+	if (tracering && atomic_load(&tracering->head) - tracering->tail > TRACECAP / 2)
+	    trace_flush();
+	if (stdout_tty)
+	    fflush(stdout);
     } 
 
     exit(0); /* control never reaches here */
 }
+#endif /* TSH_NO_MAIN */
 
 /* 
  * eval - Evaluate the command line that the user has just typed in
@@ -171,395 +1020,6312 @@ int main(int argc, char **argv)
  * when we type ctrl-c (ctrl-z) at the keyboard.  
 */
 /*References of the following code lines: 1. book: "CS: APP", 2. Tips from slide: /lecture/07ecf-part2/pdf*/
-void eval(char *cmdline) 
+void eval(const char *cmdline, size_t len) 
+{
+    long long start = now_ns();
+    int rc;
+
+    //ctrl-c stops the lists and loops of one line only
+    loopbreak = 0;
+
+    //A line that goes on with an unfinished if, for or while joins the lines before it
+    if (contline.len > 0) {
+        contline_add(cmdline, len);
+        cmdline = contline.buf;
+        len = contline.len;
+    }
+
+    //evalsrc returns -1 (after printing why) if the line has a syntax error,
+    //-2 if it stops in the middle of a construct: then wait for the next line
+    rc = evalsrc(cmdline, len);
+    if (rc == -2 && server.serving) {
+        printf("syntax error: unexpected end of line\n");
+        rc = -1;
+    }
+    if (rc == -2) {
+        if (contline.len == 0)
+            contline_add(cmdline, len);
+        return;
+    }
+    contline.len = 0;
+    //Log the line (a store into the mapped history file, never fsync'd)
+    if (histlog.fd >= 0 && rc > 0)
+        hist_add(cmdline, len, exitstatus, now_ns() - start);
+}
+
+/*
+ * contline_add - Append a line to the unfinished construct, ending it
+ *    with a newline if it has none (the last line of a file)
+ */
+void contline_add(const char *line, size_t len)
 {
-    int bg;//Declare variable and name it as bg(background)
-    char *argv[MAXARGS];//Declare argument list as an array of type char, each pointer in this array points to an argument string. 
+    if (contline.len + len + 1 > contline.cap) {
+        contline.cap = 2 * (contline.len + len + 1);
+        if ((contline.buf = realloc(contline.buf, contline.cap)) == NULL)
+            unix_error("realloc error");
+    }
+    memcpy(contline.buf + contline.len, line, len);
+    contline.len += len;
+    if (contline.len == 0 || contline.buf[contline.len-1] != '\n')
+        contline.buf[contline.len++] = '\n';
+}
+
+/*
+ * evalsrc - Run the len bytes at src: a single pipeline directly, anything
+ *    with ;, &&, ||, a newline or a keyword through the script cache.
+ *    Returns 1 if something ran, 0 for a blank line, -1 after a syntax
+ *    error or -2 if src ends inside a construct.
+ */
+int evalsrc(const char *src, size_t len)
+{
+    struct arena_t arena;//holds the argv arrays and every other piece of the parsed line
+    struct pipeline_t pl;
+    struct script_t *sc;
+    long long start = now_ns();
+    int rc;
+
+    if (!needscript(src, len)) {
+        //Call parseline function that will parse the command line and build the argv arrays
+        arena_init(&arena);
+        rc = parseline(src, len, &arena, &pl);
+        trace_span(TR_PARSE, start, 0, 0);
+        if (rc >= 0 && pl.ncmds > 0)
+            run_pipeline(&pl, &arena, src, len);
+        arena_free(&arena);
+        return rc < 0 ? -1 : pl.ncmds > 0;
+    }
+
+    if ((sc = script_get(src, len, &rc)) == NULL)
+        return rc;
+    trace_span(TR_PARSE, start, 0, 0);
+    sc->busy++;
+    scripts.depth++;
+    run_list(sc->root);
+    scripts.depth--;
+    sc->busy--;
+    return sc->root != NULL;
+}
+
+/*
+ * run_pipeline - Run a parsed command line: a builtin runs in the shell,
+ *    anything else becomes a job with one child per command.
+ */
+void run_pipeline(struct pipeline_t *pl, struct arena_t *a, const char *cmdline, size_t len)
+{
+    char **argv = pl->cmds[0].argv;//argument list of the first command
+    pid_t *pids;//process ID of each command in the pipeline
+    int nprocs, i;
+    int infd, pipefd[2];
+    int capfd[2] = { -1, -1 };//pipe the shell reads a captured job's output from
+    struct redir_t *redirs;
     pid_t pid;//Declare variable name pid as process ID, type pid_t
+    pid_t pgid = 0;//process group shared by every command of the pipeline
     struct job_t *job;
-    sigset_t mask;
-    sigset_t prev_mask;
-    //Call parseline function that will parse the command line and build the argv array
-    //If user has requested a background job, the function will return 1
-    bg = parseline(cmdline, argv);
 
-    //argv[0] is the name of the executable object file(from the book "CS: APP")
-    //If argv[0] is equal to Null, that means no executable object file will be read
-    if (argv[0] == NULL)
-        return; 
+    //A line of assignments alone sets shell variables
+    if (pl->cmds[0].argc == 0) {
+        for (i = 0; i < pl->cmds[0].nassigns; i++)
+            setvar(pl->cmds[0].assigns[i], namelen(pl->cmds[0].assigns[i]),
+                   pl->cmds[0].assigns[i] + namelen(pl->cmds[0].assigns[i]) + 1, -1);
+        exitstatus = 0;
+        return;
+    }
+
+    //A server request never holds up the others behind a foreground job
+    //(but && and loops need each command's status before going on)
+    if (server.serving && substdepth == 0 && scripts.depth == 0)
+        pl->bg = 1;
+
+    //Every job gets the --timeout deadline unless a timeout prefix gives it another
+    pl->timeout = deftimeout;
+    pl->grace = KILLGRACE;
+
+    //time runs the rest of the line and reports its resource usage once it is done
+    if (!strcmp(argv[0], "time")) {
+        if (pl->cmds[0].argc < 2) {
+            printf("usage: time command [arg...]\n");
+            return;
+        }
+        argv = ++pl->cmds[0].argv;
+        pl->cmds[0].argc--;
+        pl->timed = 1;
+    }
+
+    //submit queues the job until the admission limits let it start
+    if (!strcmp(argv[0], "submit")) {
+        do_submit(pl, cmdline, len);
+        return;
+    }
+
+    //run places every process of the job (CPUs, nice, I/O priority, policy)
+    if (!strcmp(argv[0], "run")) {
+        pl->place = arena_alloc(a, sizeof(struct place_t));
+        if ((i = parse_place(argv, 1, pl->place)) < 0 || argv[i] == NULL) {
+            if (i >= 0)
+                printf("usage: run [--cpus list] [--nice n] [--ionice class[:level]] [--sched policy] command [arg...]\n");
+            exitstatus = 2;
+            return;
+        }
+        argv = pl->cmds[0].argv += i;
+        pl->cmds[0].argc -= i;
+    }
+
+    //timeout gives the job a deadline: SIGTERM when it passes, SIGKILL a grace period later
+    if (!strcmp(argv[0], "timeout")) {
+        if ((i = parse_timeout(argv, &pl->timeout, &pl->grace)) < 0) {
+            exitstatus = 2;
+            return;
+        }
+        argv = pl->cmds[0].argv += i;
+        pl->cmds[0].argc -= i;
+    }
+
+    //parallel needs its redirections and the & flag, which builtin_cmd does not see
+    if (pl->ncmds == 1 && !strcmp(argv[0], "parallel")) {
+        do_parallel(pl, cmdline, len);
+        return;
+    }
+
+    //A timed builtin is measured in the shell itself
+    if (pl->ncmds == 1 && pl->timed && isbuiltin(argv[0])) {
+        timebuiltin(&pl->cmds[0]);
+        return;
+    }
 
     //Call function builtin_cmd, check if the return value is false, that means no command is built in
     //if the return value is true, at least one command is built in
-    if (!builtin_cmd(argv)){
-       
-        sigemptyset(&mask);
-        sigaddset(&mask, SIGCHLD);
-        sigaddset(&mask, SIGINT);
-        sigaddset(&mask, SIGTSTP);
-        sigprocmask(SIG_BLOCK, &mask, &prev_mask);//Block SIGINT and save previous blacked set
-        
-        //Call fork() to create new processes, return twice
-        //Check if pid = 0, child process is created, the tsh shell will execute whatever inside child's process
-        if ((pid = fork()) == 0){
-            sigprocmask(SIG_UNBLOCK, &mask, NULL);//Child must unblock signals before execve()
-            setpgid(0,0);
-            
-            do_redirect(argv);
-            
-            //Call function execve() which will load and run the executable object file in argv[0] by convention
-            //execve() will not return any value if the executable object file is found and execute sucessfully
-            //on the contrary, it will return -1
-            //if it returns -1, print out the message that "Command not found" if execve() return -1
-            if (execve(argv[0], argv, environ)<0){
-                printf("%s: Command not found.\n", argv[0]);
-                exit(0);
+    //(builtins only run in the shell itself when they are not part of a pipeline,
+    //and there they cannot be placed: run's options do not apply to them)
+    if (pl->ncmds > 1 || !builtin_cmd(&pl->cmds[0])){
+        //SIGCHLD, SIGINT and SIGTSTP are permanently blocked and only read
+        //from sigfd by the event loop, so the children cannot be reaped before
+        //addjob() below has recorded them; no extra masking is needed here.
+
+        pids = arena_alloc(a, pl->ncmds * sizeof(pid_t));
+
+        //With -C a background job writes its stdout and stderr into a pipe
+        //the event loop drains; the job's own redirections still win
+        if (pl->bg && captures.max > 0) {
+            if (pipe2(capfd, O_CLOEXEC) < 0)
+                unix_error("pipe error");
+            fcntl(capfd[0], F_SETFL, O_NONBLOCK);
+            for (i = 0; i < pl->ncmds; i++) {
+                redirs = arena_alloc(a, (pl->cmds[i].nredirs + 1) * sizeof(struct redir_t));
+                redirs[0].fd = STDERR_FILENO;
+                redirs[0].flags = 0;
+                redirs[0].path = NULL;
+                redirs[0].dupfd = capfd[1];
+                memcpy(redirs + 1, pl->cmds[i].redirs, pl->cmds[i].nredirs * sizeof(struct redir_t));
+                pl->cmds[i].redirs = redirs;
+                pl->cmds[i].nredirs++;
+            }
+        }
+
+        infd = -1;
+        nprocs = 0;
+        for (i = 0; i < pl->ncmds; i++) {
+            //Every command but the last writes into a fresh pipe
+            pipefd[0] = pipefd[1] = -1;
+            if (i < pl->ncmds - 1) {
+                if (pipe2(pipefd, O_CLOEXEC) < 0)
+                    unix_error("pipe error");
+                if (pipe_size > 0 && fcntl(pipefd[1], F_SETPIPE_SZ, pipe_size) < 0 && verbose)
+                    printf("F_SETPIPE_SZ %d: %s\n", pipe_size, strerror(errno));
             }
+
+            //A builtin inside a pipeline has to run in a forked copy of the shell
+            if ((pid = spawn(&pl->cmds[i], pgid, infd, i < pl->ncmds - 1 ? pipefd[1] : capfd[1],
+                             pl->ncmds > 1 && isbuiltin(pl->cmds[i].argv[0]), pl->place)) > 0) {
+                if (pgid == 0)
+                    pgid = pid;
+                pids[nprocs++] = pid;
+            }
+
+            //The parent keeps only the read end for the next command
+            if (infd >= 0)
+                close(infd);
+            if (pipefd[1] >= 0)
+                close(pipefd[1]);
+            infd = pipefd[0];
+        }
+        if (capfd[1] >= 0)
+            close(capfd[1]);
+        //Nothing could be started (e.g. command not found)
+        if (nprocs == 0) {
+            if (capfd[0] >= 0)
+                close(capfd[0]);
+            exitstatus = 127;
+            return;
+        }
+
+        //A job from the submit queue already has its ID and command line
+        if (pl->queued) {
+            job = pl->queued;
+            pl->queued = NULL;
+            for (i = 0; i < nprocs; i++)
+                addjobproc(&jobs, job, pids[i]);
+            clock_gettime(CLOCK_MONOTONIC, &job->start);
+            job->started = time(NULL);
+            job->timed = pl->timed;
+            job->grace = pl->grace;
+            settimeout(job, pl->timeout);
+            setjobstate(&jobs, job, pl->bg ? BG : FG);
+            if (pl->bg)
+                lastbg = pids[nprocs-1];
+            if (capfd[0] >= 0)
+                capture_start(job, capfd[0]);
+            if (!pl->bg)
+                waitfg(pgid);
+            return;
         }
 
         //if the user has NOT asked for a BACKGROUND job, the tsh shell will call function waitfg() to wait until the foreground job to terminate
-        if(!bg){
-            addjob(jobs, pid, FG, cmdline); 
-            sigprocmask(SIG_UNBLOCK, &mask, NULL);//Parents will unblock signals after addjob()
+        if(!pl->bg){
+            job = addjob(&jobs, pids, nprocs, FG, cmdline, len); 
+            job->timed = pl->timed;
+            job->grace = pl->grace;
+            settimeout(job, pl->timeout);
             //Thus, call waitfg() to wait until a child in its wait set terminates
-            waitfg(pid);         
+            waitfg(pgid);         
         }
         //ELSE PRINT OUT COMMAND LINE THAT THE TSH SHELL IS EXECUTING AND ITS PROCESS ID IN BACKGROUND
         else{
-            addjob(jobs, pid, BG, cmdline);
-            job = getjobpid(jobs, pid);//get process ID of the job
-            sigprocmask(SIG_UNBLOCK, &mask, NULL);//Parents wull unblock signals after addjob()
+            job = addjob(&jobs, pids, nprocs, BG, cmdline, len);
+            job->timed = pl->timed;
+            job->grace = pl->grace;
+            settimeout(job, pl->timeout);
+            lastbg = pids[nprocs-1];
+            if (capfd[0] >= 0)
+                capture_start(job, capfd[0]);
+            exitstatus = 0;
             printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
         }
     }
     return;
 }
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+/*
+ * spawn - Start cmd in a child that joins process group pgid (0 makes
+ *    the child the leader of a new group).  stdin/stdout come from
+ *    infd/outfd when they are not -1; the command's redirections are
+ *    applied on top.  The child starts with the shell's original signal
+ *    mask and default SIGTTIN/SIGTTOU dispositions.
+ *
+ *    The default engine is posix_spawn, which glibc implements with
+ *    clone(CLONE_VM|CLONE_VFORK) and so does not copy the shell's page
+ *    tables.  fork+execve is used when -s fork was given, when usefork
+ *    is set (a builtin that must run in a copy of the shell), or when
+ *    place is not NULL: affinity, nice, I/O priority and the scheduling
+ *    policy are set in the child before execve, which posix_spawn
+ *    cannot do.
+ *
+ *    Returns the child's PID, or -1 if it could not be started, in which
+ *    case the reason has been printed.
  */
-int parseline(const char *cmdline, char **argv) 
+pid_t spawn(struct cmd_t *cmd, pid_t pgid, int infd, int outfd, int usefork,
+	    const struct place_t *place)
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
-
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t defsigs;
+    struct hashent_t *he = NULL;
+    struct builtin_t *b;
+    struct redir_t *r;
+    const char *path = cmd->argv[0];
+    int fds[cmd->nredirs + 1];
+    char **envp = envsnapshot();
+    char *envbuf[cmd->nassigns ? vars.nexported + cmd->nassigns + 1 : 1];
+    long long start = now_ns();
+    pid_t pid;
+    int i, rc;
 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
+    //Bare command names are looked up in $PATH through the executable cache
+    if (!usefork && strchr(path, '/') == NULL) {
+        if ((he = findcmd(path)) == NULL) {
+            printf("%s: Command not found.\n", path);
+            return -1;
+        }
+        path = he->path;
     }
-    else {
-	delim = strchr(buf, ' ');
+
+    //NAME=value before the command overrides or adds to its environment
+    if (cmd->nassigns) {
+        size_t n = 0, len;
+        char **e;
+        for (e = envp; *e; e++) {
+            len = namelen(*e);
+            for (i = 0; i < cmd->nassigns; i++)
+                if (!strncmp(cmd->assigns[i], *e, len + 1))
+                    break;
+            if (i == cmd->nassigns)
+                envbuf[n++] = *e;
+        }
+        for (i = 0; i < cmd->nassigns; i++)
+            envbuf[n++] = cmd->assigns[i];
+        envbuf[n] = NULL;
+        envp = envbuf;
     }
 
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) /* ignore spaces */
-	       buf++;
+    //Flush so the child's output cannot overtake ours (and a forked
+    //child does not inherit a copy of our buffered output)
+    fflush(stdout);
 
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
-	}
-	else {
-	    delim = strchr(buf, ' ');
-	}
+    if (usefork || place || engine == ENGINE_FORK) {
+        //Call fork() to create new processes, return twice
+        //Check if pid = 0, child process is created, the tsh shell will execute whatever inside child's process
+        if ((pid = fork()) == 0){
+            sigprocmask(SIG_SETMASK, &child_mask, NULL);//Child must restore the original mask before execve()
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            setpgid(0, pgid);//The first command leads the group, the others join it
+
+            //Wire stdin/stdout to the neighbouring pipes (dup2 clears O_CLOEXEC)
+            if (infd >= 0)
+                dup2(infd, STDIN_FILENO);
+            if (outfd >= 0)
+                dup2(outfd, STDOUT_FILENO);
+            if (do_redirect(cmd) < 0)
+                exit(1);
+            //Apply the job's placement (run) to the process before it runs anything
+            if (place && place_self(place) < 0)
+                exit(1);
+
+            //A builtin inside a pipeline runs in its own child
+            if (usefork && (b = findbuiltin(cmd->argv[0])) != NULL) {
+                rc = b->fn(cmd->argv);
+                fflush(stdout);
+                exit(rc);
+            }
+
+            trace_post(TR_EXEC, now_ns(), 0, getpid(), 0);
+
+            //A cached PATH hit is executed relative to the directory's O_PATH
+            //descriptor, which skips walking the directory components again
+            if (he && he->dir >= 0)
+                execveat(cmdhash.dirs[he->dir].fd, cmd->argv[0], cmd->argv, envp, 0);
+
+            //Call function execve() which will load and run the executable object file in argv[0] by convention
+            //execve() will not return any value if the executable object file is found and execute sucessfully
+            //on the contrary, it will return -1
+            //if it returns -1, print out the message that "Command not found" if execve() return -1
+            if (execve(path, cmd->argv, envp)<0){
+                printf("%s: Command not found.\n", cmd->argv[0]);
+                exit(0);
+            }
+        }
+        if (pid < 0)
+            unix_error("fork error");
+        //Also set the child's process group from the parent so that a
+        //signal forwarded before the child runs still reaches its group
+        setpgid(pid, pgid ? pgid : pid);
+        trace_span(TR_SPAWN, start, pid, 0);
+        return pid;
+    }
+
+    //posix_spawn performs the same setup from a list of actions
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&fa);
+    sigemptyset(&defsigs);
+    sigaddset(&defsigs, SIGTTIN);
+    sigaddset(&defsigs, SIGTTOU);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP|POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, &child_mask);
+    posix_spawnattr_setsigdefault(&attr, &defsigs);
+    if (infd >= 0)
+        posix_spawn_file_actions_adddup2(&fa, infd, STDIN_FILENO);
+    if (outfd >= 0)
+        posix_spawn_file_actions_adddup2(&fa, outfd, STDOUT_FILENO);
+    //A failed file action comes back from posix_spawn as a bare errno that
+    //cannot be told apart from a failed exec, so files are opened here
+    //(close-on-exec) and only dup2'd into place by the child
+    rc = 0;
+    for (i = 0; i < cmd->nredirs; i++) {
+        r = &cmd->redirs[i];
+        fds[i] = -1;
+        if (r->path == NULL) {
+            if (r->dupfd < 0)
+                posix_spawn_file_actions_addclose(&fa, r->fd);
+            else if (r->dupfd != r->fd)
+                posix_spawn_file_actions_adddup2(&fa, r->dupfd, r->fd);
+            continue;
+        }
+        if ((fds[i] = open(r->path, r->flags|O_CLOEXEC, 0666)) < 0) {
+            printf("%s: %s\n", r->path, strerror(errno));
+            rc = -1;
+            break;
+        }
+        posix_spawn_file_actions_adddup2(&fa, fds[i], r->fd);
     }
-    argv[argc] = NULL;
-    
-    if (argc == 0)  /* ignore blank line */
-	return 1;
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-	argv[--argc] = NULL;
+    if (rc == 0)
+        rc = posix_spawn(&pid, path, &fa, &attr, cmd->argv, envp);
+    while (--i >= 0)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (rc < 0)
+        return -1;
+    if (rc != 0) {
+        //glibc reports exec and file action failures here and has already reaped the child
+        if (rc == ENOENT || rc == EACCES || rc == ENOEXEC || rc == ENOTDIR)
+            printf("%s: Command not found.\n", cmd->argv[0]);
+        else
+            printf("%s: %s\n", cmd->argv[0], strerror(rc));
+        return -1;
     }
-    return bg;
+    //posix_spawn only returns once the child has exec'd
+    trace_post(TR_EXEC, now_ns(), 0, pid, 0);
+    trace_span(TR_SPAWN, start, pid, 0);
+    return pid;
 }
 
+/* How each token type is shown in a syntax error */
+const char *opname[] = { "", "|", "&", "<", ">", ">>", "<&", ">&", "", ";", "&&", "||", "newline" };
+
 /* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
- * Book: page 791
+ * parseline - Parse the command line into a pipeline.
+ * 
+ * Words are split by the tokenizer, which handles single and double
+ * quotes and backslash escapes anywhere in a word.  "|" separates
+ * commands, "<" and ">" redirect, and a final "&" asks for a BG job.
+ * Everything (argv arrays included, which have no size limit) is
+ * allocated from arena a.  Return true if the user has requested a BG
+ * job, false if the user has requested a FG job, or -1 after printing
+ * a message if the line has a syntax error.
  */
-int builtin_cmd(char **argv) 
+int parseline(const char *cmdline, size_t len, struct arena_t *a, struct pipeline_t *pl) 
 {
-    if (!strcmp(argv[0], "quit")) {//Deal with quit command
-        exit(0);
-    }
-    if (!strcmp(argv[0], "jobs")) {//Deal with jobs command
-        listjobs(jobs);
-        return 1;
-    }
-    if (!strcmp(argv[0], "bg")) {//Deal with background job command
-        do_bgfg(argv);
-        return 1;
-    }
-    if (!strcmp(argv[0], "fg")) {//Deal with fore ground job command
-        do_bgfg(argv);
-        return 1;
+    struct token_t *toks;       /* the line's tokens */
+    int ntoks;
+
+    if ((ntoks = tokenize(cmdline, len, a, &toks)) < 0) {
+	pl->ncmds = 0;
+	return -1;
     }
-    
-    return 0;     /* not a builtin command */
+    /* the newline that ends the line is not a separator */
+    while (ntoks > 0 && toks[ntoks-1].type == TOK_NEWLINE)
+	ntoks--;
+    return buildpipeline(toks, ntoks, a, pl);
 }
 
-
-/* 
- * do_redirect - scans argv for any use of < or > which indicate input or output redirection
- *
+/*
+ * buildpipeline - Build pipeline pl from ntoks tokens of one pipeline,
+ *    expanding its words; parseline without the tokenizer, which lets a
+ *    compiled script expand the same tokens every time it runs them.
  */
-void do_redirect(char **argv)
+int buildpipeline(struct token_t *toks, int ntoks, struct arena_t *a, struct pipeline_t *pl)
+{
+    struct cmd_t *cmd = NULL;   /* command being built */
+    int i;
+    size_t argcap = 0, redircap = 0, cmdcap = 0, assigncap = 0;
+    int fd;
+
+    pl->cmds = NULL;
+    pl->ncmds = 0;
+    pl->bg = 0;
+    pl->timed = 0;
+    pl->timeout = 0;
+    pl->grace = 0;
+    pl->place = NULL;
+    pl->queued = NULL;
+    if (ntoks == 0)  /* ignore blank line */
+	return 0;
+
+    for (i = 0; i < ntoks; i++) {
+	if (cmd == NULL) {
+	    /* start the next command of the pipeline */
+	    if (pl->ncmds == (int)cmdcap) {
+		pl->cmds = arena_grow(a, pl->cmds, cmdcap * sizeof(*cmd), (cmdcap ? 2 * cmdcap : 4) * sizeof(*cmd));
+		cmdcap = cmdcap ? 2 * cmdcap : 4;
+	    }
+	    cmd = &pl->cmds[pl->ncmds++];
+	    memset(cmd, 0, sizeof(*cmd));
+	    argcap = redircap = assigncap = 0;
+	}
+
+	switch (toks[i].type) {
+	case TOK_WORD:
+	    /* NAME=value words before the command are assignments */
+	    if (cmd->argc == 0 && namelen(toks[i].p) > 0 &&
+		toks[i].p[namelen(toks[i].p)] == '=') {
+		if (cmd->nassigns == (int)assigncap) {
+		    cmd->assigns = arena_grow(a, cmd->assigns, assigncap * sizeof(char *), (assigncap ? 2 * assigncap : 4) * sizeof(char *));
+		    assigncap = assigncap ? 2 * assigncap : 4;
+		}
+		cmd->assigns[cmd->nassigns++] = expandword(a, &toks[i], 0, NULL);
+		break;
+	    }
+	    addword(a, cmd, &argcap, &toks[i]);
+	    break;
+
+	case TOK_IONUM:
+	case TOK_LESS:
+	case TOK_GREAT:
+	case TOK_DGREAT:
+	case TOK_LESSAND:
+	case TOK_GREATAND:
+	    /* [n]op word; the tokenizer only makes an IONUM before an operator */
+	    fd = -1;
+	    if (toks[i].type == TOK_IONUM) {
+		if (toks[i].len > 9) {
+		    printf("%.*s: bad file descriptor\n", (int)toks[i].len, toks[i].p);
+		    return -1;
+		}
+		fd = atoi(toks[i].p);
+		i++;
+	    }
+	    if (i + 1 == ntoks || toks[i+1].type != TOK_WORD) {
+		printf("syntax error near unexpected token `%s'\n",
+		       i + 1 == ntoks ? "newline" : opname[toks[i+1].type]);
+		return -1;
+	    }
+	    if (cmd->nredirs == (int)redircap) {
+		cmd->redirs = arena_grow(a, cmd->redirs, redircap * sizeof(struct redir_t), (redircap ? 2 * redircap : 2) * sizeof(struct redir_t));
+		redircap = redircap ? 2 * redircap : 2;
+	    }
+	    i++;
+	    if (parse_redirect(toks[i-1].type, fd, expandword(a, &toks[i], 0, NULL), &cmd->redirs[cmd->nredirs++]) < 0)
+		return -1;
+	    break;
+
+	case TOK_PIPE:
+	case TOK_AMP:
+	    if ((cmd->argc == 0 && (cmd->nassigns == 0 || toks[i].type == TOK_PIPE)) ||
+		(toks[i].type == TOK_PIPE && i + 1 == ntoks) ||
+		(toks[i].type == TOK_AMP && i + 1 != ntoks)) {
+		printf("syntax error near unexpected token `%s'\n", opname[toks[i].type]);
+		return -1;
+	    }
+	    /* should the job run in the background? */
+	    if (toks[i].type == TOK_AMP)
+		pl->bg = 1;
+	    cmd = NULL;
+	    break;
+
+	default:    /* ; && || and newlines separate pipelines */
+	    printf("syntax error near unexpected token `%s'\n", opname[toks[i].type]);
+	    return -1;
+	}
+    }
+    if (cmd && cmd->argc == 0 && (cmd->nassigns == 0 || pl->ncmds > 1)) {
+	printf("syntax error: missing command\n");
+	return -1;
+    }
+    return pl->bg;
+}
+
+/*
+ * addword - Append the words that word token t expands to to the argv
+ *    of cmd, whose array has room for *argcap pointers.  Returns how
+ *    many words were added.
+ */
+int addword(struct arena_t *a, struct cmd_t *cmd, size_t *argcap, const struct token_t *t)
+{
+    size_t newcap, nwords;
+    char *word, **words;
+    int nf = 0;
+
+    /* a pattern becomes the names it matches, or stays as it is;
+       the output of $(...) is not a pattern (it would run twice) */
+    if (!(t->flags & WF_GLOB) || (t->flags & WF_SUBST) ||
+	(nwords = globexpand(a, expandword(a, t, 1, NULL), &words)) == 0) {
+	word = expandword(a, t, 0, &nf);
+	/* an unquoted expansion that comes out empty is no word at all */
+	if (nf == 0)
+	    return 0;
+	words = &word;
+	nwords = nf;
+    }
+    if ((size_t)cmd->argc + nwords >= *argcap) {
+	newcap = *argcap ? 2 * *argcap : 8;
+	if (newcap < (size_t)cmd->argc + nwords + 1)
+	    newcap = cmd->argc + nwords + 1;
+	cmd->argv = arena_grow(a, cmd->argv, *argcap * sizeof(char *), newcap * sizeof(char *));
+	*argcap = newcap;
+    }
+    if (nf > 1) { /* split output: NUL-separated words */
+	for (; nf > 0; nf--, word += strlen(word) + 1)
+	    cmd->argv[cmd->argc++] = word;
+    }
+    else {
+	memcpy(cmd->argv + cmd->argc, words, nwords * sizeof(char *));
+	cmd->argc += nwords;
+    }
+    cmd->argv[cmd->argc] = NULL;
+    return nwords;
+}
+
+/*******************************
+ * Tokenizer and command arena
+ *******************************/
+
+/* Character classes seen by the tokenizer */
+#define CH_WORD  0 /* part of a word */
+#define CH_SPACE 1 /* blank: ends a word */
+#define CH_OP    2 /* operator: ends a word and forms a token */
+#define CH_QUOTE 3 /* quote or backslash: handled inside the word */
+#define CH_DOLLAR 4 /* $: an expansion inside the word */
+#define CH_GLOB  5 /* *, ? or [: the word is a pattern */
+
+unsigned char chclass[256] = {
+    [' '] = CH_SPACE, ['\t'] = CH_SPACE, ['\r'] = CH_SPACE,
+    ['|'] = CH_OP, ['&'] = CH_OP, ['<'] = CH_OP, ['>'] = CH_OP,
+    [';'] = CH_OP, ['\n'] = CH_OP,
+    ['\''] = CH_QUOTE, ['"'] = CH_QUOTE, ['\\'] = CH_QUOTE,
+    ['$'] = CH_DOLLAR, ['*'] = CH_GLOB, ['?'] = CH_GLOB, ['['] = CH_GLOB,
+};
+
+/*
+ * scanword - Return the first byte in [p, end) that may not be an
+ *    ordinary word character.  With SSE2, 16 bytes are tested per step:
+ *    bytes <= ' ' (blanks, newlines and control characters) plus each operator,
+ *    quote, $ and pattern character.  Callers recheck the result with chclass, since a
+ *    control character is reported here but is ordinary.
+ */
+const char *scanword(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i bar = _mm_set1_epi8('|'), amp = _mm_set1_epi8('&');
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+    const __m128i sq = _mm_set1_epi8('\''), dq = _mm_set1_epi8('"');
+    const __m128i bs = _mm_set1_epi8('\\'), dollar = _mm_set1_epi8('$');
+    const __m128i star = _mm_set1_epi8('*'), qmark = _mm_set1_epi8('?');
+    const __m128i bracket = _mm_set1_epi8('['), semi = _mm_set1_epi8(';');
+    __m128i v, m;
+    int mask;
+
+    while (end - p >= 16) {
+	v = _mm_loadu_si128((const __m128i *)p);
+	m = _mm_cmpeq_epi8(_mm_max_epu8(v, blank), blank); /* v <= ' ' */
+	m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, bar), _mm_cmpeq_epi8(v, amp)));
+	m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)));
+	m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, sq), _mm_cmpeq_epi8(v, dq)));
+	m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, bs), _mm_cmpeq_epi8(v, dollar)));
+	m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, star), _mm_cmpeq_epi8(v, qmark)));
+	m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, bracket), _mm_cmpeq_epi8(v, semi)));
+	if ((mask = _mm_movemask_epi8(m)) != 0)
+	    return p + __builtin_ctz(mask);
+	p += 16;
+    }
+#endif
+    while (p < end && chclass[(unsigned char)*p] == CH_WORD)
+	p++;
+    return p;
+}
+
+/*
+ * tokenize - Split the n bytes at s into tokens, stored in an array
+ *    allocated from a.  Words keep pointing at their raw text; quote
+ *    removal happens in expandword.  A '#' at the start of a word begins
+ *    a comment, which runs to the end of the line.  Returns the number of
+ *    tokens, or -1 after printing a message if a quote is not closed.
+ */
+int tokenize(const char *s, size_t n, struct arena_t *a, struct token_t **toks)
+{
+    const char *p = s, *end = s + n, *q;
+    struct token_t *t;
+    size_t cap = 0;
+    int ntoks = 0;
+
+    *toks = NULL;
+    while (1) {
+	while (p < end && chclass[(unsigned char)*p] == CH_SPACE) /* ignore spaces */
+	    p++;
+	if (p < end && *p == '#') /* skip a comment, but not the newline after it */
+	    while (p < end && *p != '\n')
+		p++;
+	if (p == end)
+	    break;
+
+	if (ntoks == (int)cap) {
+	    *toks = arena_grow(a, *toks, cap * sizeof(**toks), (cap ? 2 * cap : 16) * sizeof(**toks));
+	    cap = cap ? 2 * cap : 16;
+	}
+	t = &(*toks)[ntoks++];
+	t->p = p;
+	t->flags = 0;
+
+	if (chclass[(unsigned char)*p] == CH_OP) {
+	    t->type = *p == '|' ? TOK_PIPE : *p == '&' ? TOK_AMP : *p == '<' ? TOK_LESS :
+		*p == '>' ? TOK_GREAT : *p == ';' ? TOK_SEMI : TOK_NEWLINE;
+	    t->len = 1;
+	    /* && and || */
+	    if (p + 1 < end && (t->type == TOK_PIPE || t->type == TOK_AMP) && p[1] == *p) {
+		t->type = t->type == TOK_PIPE ? TOK_ORIF : TOK_ANDIF;
+		t->len = 2;
+	    }
+	    /* two-character redirections: >> <& >& */
+	    if (p + 1 < end && (t->type == TOK_LESS || t->type == TOK_GREAT)) {
+		if (p[1] == '&')
+		    t->type = t->type == TOK_LESS ? TOK_LESSAND : TOK_GREATAND;
+		else if (p[1] == '>' && t->type == TOK_GREAT)
+		    t->type = TOK_DGREAT;
+		if (t->type != TOK_LESS && t->type != TOK_GREAT)
+		    t->len = 2;
+	    }
+	    p += t->len;
+	    continue;
+	}
+
+	/* A word runs until an unquoted blank or operator */
+	t->type = TOK_WORD;
+	while ((p = scanword(p, end)) < end) {
+	    switch (chclass[(unsigned char)*p]) {
+	    case CH_WORD: /* control character */
+		p++;
+		continue;
+	    case CH_GLOB:
+		t->flags |= WF_GLOB;
+		p++;
+		continue;
+	    case CH_DOLLAR:
+		if (p + 1 < end && p[1] == '(') {
+		    if ((q = substend(p + 2, end)) == NULL) {
+			printf("syntax error: missing )\n");
+			return -1;
+		    }
+		    t->flags |= WF_SUBST;
+		    p = q + 1;
+		    continue;
+		}
+		t->flags |= WF_EXPAND;
+		if (p + 1 < end && p[1] == '{') {
+		    if ((q = memchr(p + 2, '}', end - p - 2)) == NULL) {
+			printf("syntax error: missing }\n");
+			return -1;
+		    }
+		    p = q + 1;
+		}
+		else
+		    p++;
+		continue;
+	    case CH_QUOTE:
+		t->flags |= WF_QUOTED;
+		if (*p == '\\') {
+		    p = p + 2 < end ? p + 2 : end;
+		    continue;
+		}
+		if (*p == '\'') {
+		    q = memchr(p + 1, '\'', end - p - 1);
+		}
+		else {
+		    for (q = p + 1; q < end && *q != '"'; q++) {
+			if (*q == '\\')
+			    q++;
+			else if (*q == '$') {
+			    t->flags |= WF_EXPAND;
+			    if (q + 1 < end && q[1] == '(') {
+				if ((q = substend(q + 2, end)) == NULL) {
+				    printf("syntax error: missing )\n");
+				    return -1;
+				}
+				t->flags |= WF_SUBST;
+			    }
+			}
+		    }
+		    if (q >= end)
+			q = NULL;
+		}
+		if (q == NULL) {
+		    printf("syntax error: unterminated %c\n", *p);
+		    return -1;
+		}
+		p = q + 1;
+		continue;
+	    }
+	    break; /* blank or operator */
+	}
+	t->len = p - t->p;
+
+	/* An unquoted number glued to < or > names the descriptor */
+	if (p < end && (*p == '<' || *p == '>') && t->flags == 0) {
+	    for (q = t->p; q < p && isdigit((unsigned char)*q); q++)
+		;
+	    if (q == p)
+		t->type = TOK_IONUM;
+	}
+    }
+    return ntoks;
+}
+
+/*
+ * expandword - Return a NUL-terminated copy of word t, allocated from a,
+ *    with quoting removed and variables expanded: '...' is literal,
+ *    "..." is literal except for $ and that \ escapes ", \, $, ` and
+ *    newline, and an unquoted \ escapes the next character.  Expansions
+ *    are not split into fields.  With glob set the copy is a pattern
+ *    for globexpand instead: quoted or expanded *, ?, [ and \ keep a \
+ *    in front so they only match themselves.
+ *
+ *    $(...) is replaced by the command's output.  If nfields is not
+ *    NULL, the output of an unquoted one is split at blanks and
+ *    newlines: the copy then holds *nfields NUL-separated words, 0 if
+ *    an unquoted word expanded to nothing.
+ */
+char *expandword(struct arena_t *a, const struct token_t *t, int glob, int *nfields)
+{
+    const char *p = t->p, *end = t->p + t->len, *v, *q;
+    size_t cap = (glob ? 2 * t->len : t->len) + 1, n = 0, fstart = 0, vlen, i;
+    char *out;
+    int dquote = 0, sep = 0, nsep = 0, split;
+
+/* append c, escaped if it is a pattern character that must stay literal */
+#define PUTLIT(c) do {							\
+	NEWFIELD();							\
+	if (glob && ((c) == '*' || (c) == '?' || (c) == '[' || (c) == '\\')) \
+	    out[n++] = '\\';						\
+	out[n++] = (c);							\
+    } while (0)
+/* end the current word if a split is pending and it has anything in it */
+#define NEWFIELD() do {							\
+	if (sep && n > fstart) {					\
+	    out[n++] = '\0';						\
+	    fstart = n;							\
+	    nsep++;							\
+	}								\
+	sep = 0;							\
+    } while (0)
+
+    /* a word that is just $(...) is split where the output was read */
+    if (nfields && t->flags == WF_SUBST && t->len > 3 && p[0] == '$' && p[1] == '(' &&
+	substend(p + 2, end) == end - 1) {
+	out = cmdsubst(a, p + 2, t->len - 3, &vlen);
+	*nfields = splitfields(out, vlen);
+	return out;
+    }
+
+    out = arena_alloc(a, cap);
+    if ((t->flags & ~WF_GLOB) == 0) {
+	memcpy(out, p, t->len);
+	out[t->len] = '\0';
+	if (nfields)
+	    *nfields = 1;
+	return out;
+    }
+    for (; p < end; p++) {
+	v = NULL;
+	split = 0;
+	if (*p == '$' && p + 1 < end && p[1] == '(') {
+	    q = substend(p + 2, end);
+	    v = cmdsubst(a, p + 2, q - p - 2, &vlen);
+	    split = nfields && !dquote;
+	    p = q + 1;
+	}
+	else if (*p == '$')
+	    v = expandvar(&p, end, &vlen);
+	if (v != NULL) {
+	    /* the rest of the word still needs at most 2 * (end - p) + 1 bytes */
+	    if (n + 2 * (vlen + (end - p)) + 2 > cap) {
+		out = arena_grow(a, out, cap, 2 * cap + 2 * vlen);
+		cap = 2 * cap + 2 * vlen;
+	    }
+	    for (i = 0; i < vlen; i++) {
+		if (split && (v[i] == ' ' || v[i] == '\t' || v[i] == '\n'))
+		    sep = 1;
+		else if (v[i] != '\0')
+		    PUTLIT(v[i]);
+	    }
+	    p--;
+	}
+	else if (*p == '"') {
+	    dquote = !dquote;
+	    NEWFIELD();
+	}
+	else if (*p == '\'' && !dquote) {
+	    NEWFIELD();
+	    while (*++p != '\'')
+		PUTLIT(*p);
+	}
+	else if (*p == '\\' && p + 1 < end &&
+		 (!dquote || strchr("\"\\$`\n", p[1]))) {
+	    if (*++p != '\n') /* \<newline> is a line continuation */
+		PUTLIT(*p);
+	}
+	else if (dquote) {
+	    PUTLIT(*p);
+	}
+	else {
+	    NEWFIELD();
+	    out[n++] = *p;
+	}
+    }
+#undef PUTLIT
+#undef NEWFIELD
+    out[n] = '\0';
+    if (nfields)
+	*nfields = n == 0 && !(t->flags & WF_QUOTED) ? 0 : nsep + 1;
+    return out;
+}
+
+/*
+ * expandvar - Expand the $ at *pp: $NAME, ${NAME}, $? (last status),
+ *    $! (last background process) or $$ (the shell).  Advances *pp past
+ *    it and returns the value (len bytes, "" if unset), or NULL if the $
+ *    is just a character.
+ */
+const char *expandvar(const char **pp, const char *end, size_t *len)
+{
+    static char num[24];
+    const char *p = *pp + 1, *v;
+    char name[256];
+    size_t n;
+    int brace = 0;
+
+    if (p < end && *p == '{') {
+	brace = 1;
+	p++;
+    }
+    if (p < end && (*p == '?' || *p == '!' || *p == '$')) {
+	*len = snprintf(num, sizeof(num), "%d", *p == '?' ? exitstatus :
+			*p == '!' ? (int)lastbg : (int)getpid());
+	v = num;
+	n = 1;
+    }
+    else {
+	for (n = 0; p + n < end && (p[n] == '_' || isalpha((unsigned char)p[n]) ||
+				    (n > 0 && isdigit((unsigned char)p[n]))); n++)
+	    ;
+	if (n == 0 || n >= sizeof(name))
+	    return NULL;
+	memcpy(name, p, n);
+	name[n] = '\0';
+	if ((v = getvar(name)) == NULL)
+	    v = "";
+	*len = strlen(v);
+    }
+    if (brace && (p + n >= end || p[n] != '}'))
+	return NULL;
+    *pp = p + n + brace;
+    return v;
+}
+
+/*
+ * substend - Return the ) closing a $( whose text starts at p, or NULL.
+ *    Parentheses nest, and quoted ones do not count.
+ */
+const char *substend(const char *p, const char *end)
+{
+    int depth = 1;
+
+    for (; p < end; p++) {
+	if (*p == '\\') {
+	    p++;
+	}
+	else if (*p == '\'') {
+	    if ((p = memchr(p + 1, '\'', end - p - 1)) == NULL)
+		return NULL;
+	}
+	else if (*p == '"') {
+	    for (p++; p < end && *p != '"'; p++)
+		if (*p == '\\')
+		    p++;
+	    if (p >= end)
+		return NULL;
+	}
+	else if (*p == '(') {
+	    depth++;
+	}
+	else if (*p == ')' && --depth == 0) {
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * cmdsubst - Run the len bytes at cmd as a command line and return its
+ *    standard output, less trailing newlines, in a buffer from a
+ *    (*outlen bytes plus a NUL).  The command runs like any other line,
+ *    so a builtin does not fork; its stdout goes to a memfd, which
+ *    cannot fill up and stall it the way a pipe nobody reads would.
+ *    A list or loop runs with the shell's own stdout on the memfd.
+ */
+char *cmdsubst(struct arena_t *a, const char *cmd, size_t len, size_t *outlen)
+{
+    struct arena_t arena;
+    struct pipeline_t pl;
+    struct cmd_t *last;
+    struct redir_t *redirs;
+    struct stat st;
+    char *buf;
+    ssize_t n = 0, r;
+    struct script_t *sc;
+    int fd, saved, rc;
+
+    if ((fd = memfd_create("tsh-subst", MFD_CLOEXEC)) < 0)
+	unix_error("memfd_create error");
+
+    /* a list or loop is compiled first, so syntax errors are not captured */
+    arena_init(&arena);
+    if (needscript(cmd, len)) {
+	if ((sc = script_get(cmd, len, &rc)) == NULL) {
+	    if (rc == -2)
+		printf("syntax error: unexpected end of file\n");
+	}
+	else {
+	    fflush(stdout);
+	    if ((saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10)) < 0)
+		unix_error("fcntl error");
+	    dup2(fd, STDOUT_FILENO);
+	    substdepth++;
+	    sc->busy++;
+	    scripts.depth++;
+	    run_list(sc->root);
+	    scripts.depth--;
+	    sc->busy--;
+	    substdepth--;
+	    fflush(stdout);
+	    dup2(saved, STDOUT_FILENO);
+	    close(saved);
+	}
+    }
+    /* stdout of the last command goes to fd unless it redirects it */
+    else if (parseline(cmd, len, &arena, &pl) >= 0 && pl.ncmds > 0) {
+	last = &pl.cmds[pl.ncmds-1];
+	redirs = arena_alloc(&arena, (last->nredirs + 1) * sizeof(struct redir_t));
+	redirs[0].fd = STDOUT_FILENO;
+	redirs[0].flags = 0;
+	redirs[0].path = NULL;
+	redirs[0].dupfd = fd;
+	memcpy(redirs + 1, last->redirs, last->nredirs * sizeof(struct redir_t));
+	last->redirs = redirs;
+	last->nredirs++;
+	fflush(stdout);
+	substdepth++;
+	run_pipeline(&pl, &arena, cmd, len);
+	substdepth--;
+	fflush(stdout);
+    }
+    arena_free(&arena);
+
+    if (fstat(fd, &st) < 0)
+	unix_error("fstat error");
+    buf = arena_alloc(a, st.st_size + 1);
+    while (n < st.st_size && (r = pread(fd, buf + n, st.st_size - n, n)) > 0)
+	n += r;
+    close(fd);
+    while (n > 0 && buf[n-1] == '\n')
+	n--;
+    buf[n] = '\0';
+    *outlen = n;
+    return buf;
+}
+
+/*
+ * splitfields - Split the len bytes at s in place into words separated
+ *    by single NULs, dropping blanks, newlines and NUL bytes.  Returns
+ *    the number of words.
+ */
+int splitfields(char *s, size_t len)
+{
+    size_t r, w = 0;
+    int nf = 0, sep = 0;
+
+    for (r = 0; r < len; r++) {
+	if (s[r] == ' ' || s[r] == '\t' || s[r] == '\n' || s[r] == '\0') {
+	    sep |= s[r] != '\0';
+	    continue;
+	}
+	if (nf == 0 || sep) {
+	    if (nf > 0)
+		s[w++] = '\0';
+	    nf++;
+	}
+	sep = 0;
+	s[w++] = s[r];
+    }
+    s[w] = '\0';
+    return nf;
+}
+
+/* arena_init - Start an empty arena */
+void arena_init(struct arena_t *a)
+{
+    a->blk = NULL;
+    a->ptr = a->end = a->last = NULL;
+}
+
+/*
+ * arena_alloc - Allocate n bytes (aligned for any type) from a.  Blocks
+ *    come from arena_spare when possible, so steady-state commands do not
+ *    call malloc at all.
+ */
+void *arena_alloc(struct arena_t *a, size_t n)
+{
+    struct arenablk_t *b, **pp;
+    size_t size;
+
+    n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if ((size_t)(a->end - a->ptr) < n) {
+	size = n > ARENABLK ? n : ARENABLK;
+	for (pp = &arena_spare; (b = *pp) != NULL; pp = &b->next)
+	    if (b->size >= size)
+		break;
+	if (b != NULL) {
+	    *pp = b->next;
+	    arena_nspare--;
+	}
+	else if ((b = malloc(sizeof(*b) + size)) == NULL)
+	    unix_error("malloc error");
+	else
+	    b->size = size;
+	b->next = a->blk;
+	a->blk = b;
+	a->ptr = (char *)b->data;
+	a->end = a->ptr + b->size;
+    }
+    a->last = a->ptr;
+    a->ptr += n;
+    return a->last;
+}
+
+/*
+ * arena_grow - Resize an allocation of oldn bytes at p (NULL if oldn is 0)
+ *    to newn bytes.  The latest allocation grows in place when the block
+ *    has room; otherwise the contents move to a new allocation.
+ */
+void *arena_grow(struct arena_t *a, void *p, size_t oldn, size_t newn)
+{
+    void *q;
+
+    if (p != NULL && p == a->last && (size_t)(a->end - a->last) >= newn) {
+	a->ptr = a->last + ((newn + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1));
+	return p;
+    }
+    q = arena_alloc(a, newn);
+    if (oldn)
+	memcpy(q, p, oldn);
+    return q;
+}
+
+/*
+ * arena_free - Release everything allocated from a.  Up to ARENASPARE
+ *    default-size blocks go back on arena_spare; larger ones (a long
+ *    line, a big glob result) and the rest go back to malloc.
+ */
+void arena_free(struct arena_t *a)
+{
+    struct arenablk_t *b, *next;
+
+    for (b = a->blk; b; b = next) {
+	next = b->next;
+	if (b->size > ARENABLK || arena_nspare >= ARENASPARE) {
+	    free(b);
+	    continue;
+	}
+	b->next = arena_spare;
+	arena_spare = b;
+	arena_nspare++;
+    }
+    arena_init(a);
+}
+
+/********************************
+ * End tokenizer and command arena
+ ********************************/
+
+/*************
+ * Globbing
+ *************/
+
+/*
+ * A pattern is split at '/' and each piece compiled once into a small
+ * program for globmatch.  Directories are read with getdents64 in
+ * GLOBBUF batches; a piece's literal prefix and suffix reject most names
+ * with a memcmp before the program runs.  A ** piece walks the whole
+ * tree below it, one directory at a time from a shared stack, with up
+ * to globthreads threads reading in parallel.  The threads never touch
+ * the command's arena: each collects its matches in blocks of its own,
+ * which are spliced into the arena once the walk is over.
+ */
+
+/* Match program opcodes */
+#define G_END  0 /* end of the name */
+#define G_CHAR 1 /* the next byte of the program, literally */
+#define G_ANY  2 /* any one character */
+#define G_STAR 3 /* any run of characters */
+#define G_SET  4 /* one character in the 32-byte bitmap that follows */
+
+/* The piece a final ** matches in every directory: * */
+const unsigned char globallprog[] = { G_STAR, G_END };
+const struct globseg_t globall = { globallprog, NULL, 0, "", "", 0, 0, 0, 0 };
+
+/* globscan flags */
+#define GS_EMIT     0x1 /* add matching names to the results */
+#define GS_MATCHDIRS 0x2 /* collect matching directories (through symlinks) */
+#define GS_WALK     0x4 /* collect every subdirectory that is not hidden */
+#define GS_LINKS    0x8 /* with GS_WALK, add symlinks to directories to the results */
+
+/* globcompile - Compile the n bytes of pattern piece p into s */
+void globcompile(struct arena_t *a, const char *p, size_t n, struct globseg_t *s)
+{
+    unsigned char *prog = arena_alloc(a, 34 * n + 1), *set;
+    const char *end = p + n, *q;
+    size_t len = 0, i;
+    int neg, c, lo, star = 0;
+    char *t;
+
+    memset(s, 0, sizeof(*s));
+    s->star2 = n == 2 && p[0] == '*' && p[1] == '*';
+    while (p < end) {
+	if (*p == '*') {
+	    if (!star) /* ** within a piece is just * */
+		prog[len++] = G_STAR;
+	    star = 1;
+	    p++;
+	    continue;
+	}
+	star = 0;
+	if (*p == '?') {
+	    prog[len++] = G_ANY;
+	    p++;
+	}
+	else if (*p == '[') {
+	    /* find the closing ], which may not be the first member */
+	    q = p + 1;
+	    if (q < end && (*q == '!' || *q == '^'))
+		q++;
+	    if (q < end && *q == ']')
+		q++;
+	    for (; q < end && *q != ']'; q++)
+		if (*q == '\\' && q + 1 < end)
+		    q++;
+	    if (q == end) { /* no ]: an ordinary character */
+		prog[len++] = G_CHAR;
+		prog[len++] = *p++;
+		continue;
+	    }
+	    prog[len++] = G_SET;
+	    set = prog + len;
+	    memset(set, 0, 32);
+	    len += 32;
+	    p++;
+	    neg = *p == '!' || *p == '^';
+	    if (neg)
+		p++;
+	    lo = -1;
+	    while (p < q) {
+		if (*p == '\\' && p + 1 < q)
+		    p++;
+		c = (unsigned char)*p++;
+		if (c == '-' && lo >= 0 && p < q) { /* a-z */
+		    if (*p == '\\' && p + 1 < q)
+			p++;
+		    for (c = (unsigned char)*p++; lo <= c; lo++)
+			set[lo / 8] |= 1 << (lo % 8);
+		    lo = -1;
+		    continue;
+		}
+		set[c / 8] |= 1 << (c % 8);
+		lo = c;
+	    }
+	    if (neg)
+		for (i = 0; i < 32; i++)
+		    set[i] = ~set[i];
+	    set[0] &= ~1; /* never the terminating NUL */
+	    p = q + 1;
+	}
+	else {
+	    if (*p == '\\' && p + 1 < end)
+		p++;
+	    prog[len++] = G_CHAR;
+	    prog[len++] = *p++;
+	}
+    }
+    prog[len] = G_END;
+    s->prog = prog;
+
+    /* the literal text at both ends, and the whole piece if that is all */
+    for (i = 0; prog[i] == G_CHAR; i += 2)
+	;
+    s->prelen = i / 2;
+    s->dot = prog[0] == G_CHAR && prog[1] == '.';
+    s->pre = t = arena_alloc(a, s->prelen + 1);
+    for (i = 0; i < s->prelen; i++)
+	t[i] = prog[2*i+1];
+    t[i] = '\0';
+    if (prog[2*s->prelen] == G_END) {
+	s->lit = s->pre;
+	s->litlen = s->prelen;
+	return;
+    }
+    /* the suffix is the run of characters after the last *, ? or set */
+    for (i = len; i >= 2 && prog[i-2] == G_CHAR; i -= 2)
+	;
+    s->suflen = (len - i) / 2;
+    s->suf = t = arena_alloc(a, s->suflen + 1);
+    for (n = 0; n < s->suflen; n++)
+	t[n] = prog[i + 2*n + 1];
+}
+
+/* globmatch - Does name (len bytes) match piece s? */
+int globmatch(const struct globseg_t *s, const char *name, size_t len)
+{
+    const unsigned char *pc, *starpc = NULL;
+    const char *starname = NULL;
+    unsigned char c;
+
+    if (s->lit)
+	return len == s->litlen && !memcmp(name, s->lit, len);
+    if (len < s->prelen + s->suflen || memcmp(name, s->pre, s->prelen) ||
+	memcmp(name + len - s->suflen, s->suf, s->suflen))
+	return 0;
+    for (pc = s->prog; ; ) {
+	c = *name;
+	switch (*pc) {
+	case G_END:
+	    if (c == '\0')
+		return 1;
+	    break;
+	case G_STAR:
+	    starpc = ++pc;
+	    starname = name;
+	    continue;
+	case G_ANY:
+	    if (c != '\0') {
+		pc++;
+		name++;
+		continue;
+	    }
+	    break;
+	case G_CHAR:
+	    if (c == pc[1] && c != '\0') {
+		pc += 2;
+		name++;
+		continue;
+	    }
+	    break;
+	case G_SET:
+	    if (pc[1 + c / 8] & (1 << (c % 8))) {
+		pc += 33;
+		name++;
+		continue;
+	    }
+	    break;
+	}
+	/* mismatch: let the last * take one more character */
+	if (starpc == NULL || *starname == '\0')
+	    return 0;
+	pc = starpc;
+	name = ++starname;
+    }
+}
+
+/* globemit - Add path (plen bytes) + name (nlen bytes) to out's results */
+void globemit(struct globout_t *out, const char *path, size_t plen, const char *name, size_t nlen)
+{
+    struct arenablk_t *b;
+    size_t n = plen + nlen + 1, size;
+    char *s;
+
+    if ((size_t)(out->end - out->ptr) < n) {
+	size = n > ARENABLK ? n : ARENABLK;
+	if ((b = malloc(sizeof(*b) + size)) == NULL)
+	    unix_error("malloc error");
+	b->size = size;
+	b->next = out->blk;
+	out->blk = b;
+	out->ptr = (char *)b->data;
+	out->end = out->ptr + size;
+    }
+    s = out->ptr;
+    out->ptr += n;
+    memcpy(s, path, plen);
+    memcpy(s + plen, name, nlen);
+    s[plen + nlen] = '\0';
+    strvec_push(&out->v, s);
+}
+
+/* strvec_push - Append s to v */
+void strvec_push(struct strvec_t *v, char *s)
+{
+    if (v->n == v->cap) {
+	v->cap = v->cap ? 2 * v->cap : 64;
+	if ((v->v = realloc(v->v, v->cap * sizeof(char *))) == NULL)
+	    unix_error("realloc error");
+    }
+    v->v[v->n++] = s;
+}
+
+/*
+ * globscan - Read the directory path (plen bytes, "" for the current
+ *    one) and, depending on flags, add the names matching s to out, the
+ *    matching directories to dirs, or every subdirectory to dirs.  Names
+ *    starting with '.' only match a piece that starts with one, and . and
+ *    .. never match.  Directories go to dirs as malloc'd "path/name/".
+ */
+void globscan(struct globout_t *out, const char *path, size_t plen,
+	      const struct globseg_t *s, int flags, struct strvec_t *dirs)
+{
+    struct dirent64 *d;
+    struct stat st;
+    const char *name;
+    char *dir;
+    size_t nlen;
+    long n, off;
+    int fd, match, walk, isdir, link;
+
+    if ((fd = open(plen ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	return;
+    if (out->buf == NULL && (out->buf = malloc(GLOBBUF)) == NULL)
+	unix_error("malloc error");
+    while ((n = syscall(SYS_getdents64, fd, out->buf, GLOBBUF)) > 0) {
+	for (off = 0; off < n; off += d->d_reclen) {
+	    d = (struct dirent64 *)(out->buf + off);
+	    name = d->d_name;
+	    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+		continue;
+	    nlen = strlen(name);
+	    match = s && (name[0] != '.' || s->dot) && globmatch(s, name, nlen);
+	    walk = (flags & GS_WALK) && name[0] != '.';
+	    if (match && (flags & GS_EMIT))
+		globemit(out, path, plen, name, nlen);
+	    if (!walk && !(match && (flags & GS_MATCHDIRS)))
+		continue;
+
+	    /* a walk stays below its start; a pattern follows symlinks */
+	    isdir = d->d_type == DT_DIR;
+	    link = d->d_type == DT_LNK;
+	    if (d->d_type == DT_UNKNOWN && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		isdir = S_ISDIR(st.st_mode);
+		link = S_ISLNK(st.st_mode);
+	    }
+	    if (link)
+		isdir = fstatat(fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+	    if (!isdir)
+		continue;
+	    if ((dir = malloc(plen + nlen + 2)) == NULL)
+		unix_error("malloc error");
+	    memcpy(dir, path, plen);
+	    memcpy(dir + plen, name, nlen);
+	    dir[plen + nlen] = '/';
+	    dir[plen + nlen + 1] = '\0';
+	    if (link && walk) { /* a walk does not enter it */
+		if (flags & GS_LINKS)
+		    globemit(out, dir, plen + nlen + 1, "", 0);
+		free(dir);
+		continue;
+	    }
+	    strvec_push(dirs, dir);
+	}
+    }
+    close(fd);
+}
+
+/*
+ * globwalker - One thread of a ** walk: take a directory off the shared
+ *    stack, read it, push its subdirectories, until the stack is empty
+ *    and no other thread is reading one.
+ */
+void *globwalker(void *arg)
+{
+    struct globthr_t *t = arg;
+    struct globwalk_t *w = t->walk;
+    struct strvec_t found = { NULL, 0, 0 };
+    char *dir;
+    size_t i;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+	while (w->todo.n == 0 && w->busy > 0)
+	    pthread_cond_wait(&w->cond, &w->lock);
+	if (w->todo.n == 0)
+	    break;
+	dir = w->todo.v[--w->todo.n];
+	w->busy++;
+	pthread_mutex_unlock(&w->lock);
+
+	if (w->seg == NULL) /* the directories themselves are the result */
+	    globemit(&t->out, dir, strlen(dir), "", 0);
+	globscan(&t->out, dir, strlen(dir), w->seg, w->seg ? GS_EMIT | GS_WALK : GS_WALK | GS_LINKS, &found);
+	free(dir);
+
+	pthread_mutex_lock(&w->lock);
+	for (i = 0; i < found.n; i++)
+	    strvec_push(&w->todo, found.v[i]);
+	found.n = 0;
+	w->busy--;
+	if (w->todo.n > 1 || w->busy == 0)
+	    pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(found.v);
+    return NULL;
+}
+
+
+/*
+ * globwalk - Walk the tree at path (plen bytes), adding to out every name
+ *    in it that matches s, or with s NULL every directory (as "dir/"),
+ *    symlinks to directories included though the walk does not enter them.
+ *    The calling thread reads the top directory alone, then is joined by
+ *    up to globthreads - 1 helpers if there is more than one directory
+ *    left to read.
+ */
+void globwalk(struct globout_t *out, const char *path, size_t plen, const struct globseg_t *s)
+{
+    struct globwalk_t w;
+    struct globthr_t thr[GLOBMAXTHREADS];
+    int nthr, i;
+
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.seg = s;
+    if (s == NULL)
+	globemit(out, path, plen, "", 0);
+    globscan(out, path, plen, s, s ? GS_EMIT | GS_WALK : GS_WALK | GS_LINKS, &w.todo);
+
+    if (globthreads <= 0) {
+	globthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (globthreads > GLOBMAXTHREADS)
+	    globthreads = GLOBMAXTHREADS;
+	if (globthreads < 1)
+	    globthreads = 1;
+    }
+    nthr = w.todo.n < (size_t)globthreads ? (int)w.todo.n : globthreads;
+    memset(thr, 0, sizeof(thr));
+    thr[0].walk = &w;
+    thr[0].out = *out;
+    for (i = 1; i < nthr; i++) {
+	thr[i].walk = &w;
+	if (pthread_create(&thr[i].tid, NULL, globwalker, &thr[i]) != 0)
+	    break;
+    }
+    nthr = i > 1 ? i : 1;
+    globwalker(&thr[0]);
+    *out = thr[0].out;
+
+    /* hand each helper's results and blocks over to out */
+    for (i = 1; i < nthr; i++) {
+	pthread_join(thr[i].tid, NULL);
+	globmerge(out, &thr[i].out);
+    }
+    free(w.todo.v);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+}
+
+/* globmerge - Move the results and blocks of from to the end of out */
+void globmerge(struct globout_t *out, struct globout_t *from)
+{
+    struct arenablk_t *b;
+    size_t i;
+
+    for (i = 0; i < from->v.n; i++)
+	strvec_push(&out->v, from->v.v[i]);
+    if (from->blk) {
+	for (b = from->blk; b->next; b = b->next)
+	    ;
+	b->next = out->blk;
+	out->blk = from->blk;
+    }
+    free(from->v.v);
+    free(from->buf);
+}
+
+/* globfree - Release everything held by out, results included */
+void globfree(struct globout_t *out)
+{
+    struct arenablk_t *b;
+
+    while ((b = out->blk) != NULL) {
+	out->blk = b->next;
+	free(b);
+    }
+    free(out->v.v);
+    free(out->buf);
+}
+
+/*
+ * globdir - Match pieces i.. of g's pattern below g->path[0..plen), which
+ *    ends in '/' unless it is empty.  check asks for path to be tested
+ *    for existence, since a literal piece was added to it unread.
+ */
+void globdir(struct globctx_t *g, size_t plen, int i, int check)
+{
+    const struct globseg_t *s = &g->segs[i];
+    struct strvec_t dirs = { NULL, 0, 0 };
+    struct globout_t tmp;
+    struct stat st;
+    size_t k, n;
+    int last = i + 1 == g->nsegs && !g->dirsonly;
+
+    if (i == g->nsegs) {
+	g->path[plen] = '\0';
+	if (!check || fstatat(AT_FDCWD, g->path, &st, g->dirsonly ? 0 : AT_SYMLINK_NOFOLLOW) == 0)
+	    globemit(&g->out, g->path, plen, "", 0);
+	return;
+    }
+    if (s->lit) {
+	if (plen + s->litlen + 2 > sizeof(g->path))
+	    return;
+	memcpy(g->path + plen, s->lit, s->litlen);
+	plen += s->litlen;
+	if (!last)
+	    g->path[plen++] = '/';
+	globdir(g, plen, i + 1, 1);
+	return;
+    }
+    g->path[plen] = '\0';
+    if (s->star2 && last) { /* a final **: everything below */
+	globwalk(&g->out, g->path, plen, &globall);
+	return;
+    }
+    if (s->star2 && i + 2 == g->nsegs && !g->dirsonly) { /* **\/piece */
+	globwalk(&g->out, g->path, plen, &g->segs[i+1]);
+	return;
+    }
+    if (s->star2) { /* every directory below, then the rest in each */
+	memset(&tmp, 0, sizeof(tmp));
+	globwalk(&tmp, g->path, plen, NULL);
+	for (k = 0; k < tmp.v.n; k++) {
+	    if ((n = strlen(tmp.v.v[k])) + 1 < sizeof(g->path)) {
+		memcpy(g->path, tmp.v.v[k], n);
+		globdir(g, n, i + 1, 0);
+	    }
+	}
+	globfree(&tmp);
+	return;
+    }
+    globscan(&g->out, g->path, plen, s, last ? GS_EMIT : GS_MATCHDIRS, &dirs);
+    for (k = 0; k < dirs.n; k++) {
+	if ((n = strlen(dirs.v[k])) + 1 < sizeof(g->path)) {
+	    memcpy(g->path, dirs.v[k], n);
+	    globdir(g, n, i + 1, 0);
+	}
+	free(dirs.v[k]);
+    }
+    free(dirs.v);
+}
+
+/* globcmp - qsort comparison of two names */
+int globcmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * globexpand - Expand pattern pat (as made by expandword) into the names
+ *    it matches, sorted.  *words is set to an array of them allocated
+ *    from a; returns how many there are, 0 if none.
+ */
+size_t globexpand(struct arena_t *a, const char *pat, char ***words)
+{
+    struct globctx_t g;
+    struct arenablk_t *b;
+    const char *p, *q;
+    size_t n, plen = 0;
+
+    memset(&g, 0, sizeof(g));
+    if (*pat == '/') {
+	g.path[plen++] = '/';
+	while (*pat == '/')
+	    pat++;
+    }
+
+    /* compile each piece; ** twice in a row is the same as once */
+    for (n = 1, p = pat; *p; p++)
+	n += *p == '/';
+    g.segs = arena_alloc(a, n * sizeof(*g.segs));
+    for (p = pat; *p; p = *q ? q + 1 : q) {
+	if ((q = strchr(p, '/')) == NULL)
+	    q = p + strlen(p);
+	if (q == p)
+	    continue;
+	globcompile(a, p, q - p, &g.segs[g.nsegs]);
+	if (!(g.segs[g.nsegs].star2 && g.nsegs > 0 && g.segs[g.nsegs-1].star2))
+	    g.nsegs++;
+    }
+    g.dirsonly = p > pat && p[-1] == '/';
+    if (g.nsegs == 0)
+	return 0;
+
+    globdir(&g, plen, 0, 0);
+    if (g.out.v.n == 0) {
+	globfree(&g.out);
+	return 0;
+    }
+    free(g.out.buf);
+
+    /* the names live on in the command's arena */
+    qsort(g.out.v.v, g.out.v.n, sizeof(char *), globcmp);
+    n = g.out.v.n;
+    *words = arena_alloc(a, n * sizeof(char *));
+    memcpy(*words, g.out.v.v, n * sizeof(char *));
+    free(g.out.v.v);
+    for (b = g.out.blk; b->next; b = b->next)
+	;
+    if (a->blk) {
+	b->next = a->blk->next;
+	a->blk->next = g.out.blk;
+    }
+    else {
+	b->next = NULL;
+	a->blk = g.out.blk;
+    }
+    return n;
+}
+
+/*************
+ * End globbing
+ *************/
+
+/****************************************
+ * Lists, conditionals and loops
+ ****************************************/
+
+/*
+ * needscript - Return true unless the len bytes at s are a single
+ *    pipeline that parseline can run as it is: ;, &&, || or a newline
+ *    inside the text, a | at its end or a keyword as its first word take
+ *    the script path.  Quoted separators are found as well, which only costs a trip
+ *    through the script cache.
+ */
+int needscript(const char *s, size_t len)
+{
+    static const char *const keywords[] = {
+	"if", "then", "elif", "else", "fi", "for", "while", "until", "do", "done", NULL
+    };
+    const char *p, *end = s + len, *q;
+    int i;
+
+    while (end > s && chclass[(unsigned char)end[-1]] == CH_SPACE)
+	end--;
+    while (end > s && end[-1] == '\n')
+	end--;
+    if (memchr(s, ';', end - s) || memchr(s, '\n', end - s) || (end > s && end[-1] == '|'))
+	return 1;
+    /* && or a lone & with more after it (not the & of >& or <&) */
+    for (p = s; (p = memchr(p, '&', end - p)) != NULL && p + 1 < end; p++)
+	if (p[1] == '&' || p == s || (p[-1] != '>' && p[-1] != '<'))
+	    return 1;
+    for (p = s; (p = memchr(p, '|', end - p)) != NULL && p + 1 < end; p += 2)
+	if (p[1] == '|')
+	    return 1;
+
+    for (p = s; p < end && chclass[(unsigned char)*p] == CH_SPACE; p++)
+	;
+    for (q = p; q < end && chclass[(unsigned char)*q] == CH_WORD; q++)
+	;
+    if (q - p < 2 || q - p > 5)
+	return 0;
+    for (i = 0; keywords[i]; i++)
+	if ((size_t)(q - p) == strlen(keywords[i]) && !memcmp(p, keywords[i], q - p))
+	    return 1;
+    return 0;
+}
+
+/*
+ * script_get - Return the compiled form of the len bytes at src from
+ *    the script cache, compiling them on a miss.  Returns NULL with *rc
+ *    set to -1 after a syntax error or -2 if src ends inside a construct.
+ */
+struct script_t *script_get(const char *src, size_t len, int *rc)
+{
+    struct script_t *sc, **bucket;
+    size_t hash = hashmem(src, len);
+
+    bucket = &scripts.buckets[hash & (SCRIPTCACHE - 1)];
+    for (sc = *bucket; sc != NULL; sc = sc->next)
+	if (sc->hash == hash && sc->len == len && !memcmp(sc->src, src, len)) {
+	    scripts.hits++;
+	    return sc;
+	}
+
+    scripts.misses++;
+    if (scripts.count >= SCRIPTCACHE)
+	script_flush();
+    if ((sc = malloc(sizeof(*sc))) == NULL)
+	unix_error("malloc error");
+    arena_init(&sc->arena);
+    sc->src = arena_alloc(&sc->arena, len + 1);
+    memcpy(sc->src, src, len);
+    sc->src[len] = '\0';
+    sc->len = len;
+    sc->hash = hash;
+    sc->busy = 0;
+    if ((*rc = compile(sc->src, len, &sc->arena, &sc->root)) < 0) {
+	arena_free(&sc->arena);
+	free(sc);
+	return NULL;
+    }
+    sc->next = *bucket;
+    *bucket = sc;
+    scripts.count++;
+    return sc;
+}
+
+/* script_flush - Drop every cached script that is not running */
+void script_flush(void)
+{
+    struct script_t *sc, **pp;
+    int i;
+
+    for (i = 0; i < SCRIPTCACHE; i++) {
+	for (pp = &scripts.buckets[i]; (sc = *pp) != NULL; ) {
+	    if (sc->busy) {
+		pp = &sc->next;
+		continue;
+	    }
+	    *pp = sc->next;
+	    arena_free(&sc->arena);
+	    free(sc);
+	    scripts.count--;
+	}
+    }
+}
+
+/*
+ * compile - Parse the len bytes at src into a list of nodes (*root,
+ *    NULL for a blank line) allocated from a.  Tokens and nodes point
+ *    into src, which must live as long as they do.  Returns 0, -1 after
+ *    printing a syntax error, or -2 if src ends inside a construct (an
+ *    if without its fi, say) and needs more lines.
+ *
+ *    list     := and-or ((';' | '&' | newline) and-or)*
+ *    and-or   := command (('&&' | '||') newline* command)*
+ *    command  := pipeline | if | while | until | for
+ */
+int compile(char *src, size_t len, struct arena_t *a, struct node_t **root)
+{
+    struct parser_t ps;
+
+    *root = NULL;
+    if ((ps.ntoks = tokenize(src, len, a, &ps.toks)) < 0)
+	return -1;
+    ps.i = 0;
+    ps.a = a;
+    ps.failed = ps.incomplete = 0;
+    *root = parse_list(&ps, NULL);
+    if (ps.failed)
+	return -1;
+    if (ps.incomplete)
+	return -2;
+    /* a keyword nothing was waiting for */
+    if (ps.i < ps.ntoks) {
+	parse_error(&ps);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * parse_list - Parse commands up to the end of the tokens or one of the
+ *    keywords in stops (NULL-terminated, or NULL at the top level), which
+ *    is left for the caller.  Returns the first command of the list, or
+ *    NULL if it is empty or the parse stopped.
+ */
+struct node_t *parse_list(struct parser_t *ps, const char *const *stops)
+{
+    struct node_t *head = NULL, **tail = &head, *n;
+    int i;
+
+    while (1) {
+	while (ps->i < ps->ntoks && ps->toks[ps->i].type == TOK_NEWLINE)
+	    ps->i++;
+	if (ps->i == ps->ntoks) {
+	    if (stops == NULL)
+		return head;
+	    ps->incomplete = 1;
+	    return NULL;
+	}
+	for (i = 0; stops && stops[i]; i++)
+	    if (iskeyword(&ps->toks[ps->i], stops[i]))
+		return head;
+
+	if ((n = parse_andor(ps)) == NULL)
+	    return NULL;
+	*tail = n;
+	tail = &n->next;
+
+	if (ps->i == ps->ntoks)
+	    continue;
+	switch (ps->toks[ps->i].type) {
+	case TOK_AMP:
+	    /* only a pipeline can run in the background */
+	    if (n->type != N_PIPE) {
+		parse_error(ps);
+		return NULL;
+	    }
+	    n->bg = 1;
+	    ps->i++;
+	    break;
+	case TOK_SEMI:
+	case TOK_NEWLINE:
+	    ps->i++;
+	    break;
+	default:
+	    /* fi, done... right after a compound command */
+	    for (i = 0; stops && stops[i]; i++)
+		if (iskeyword(&ps->toks[ps->i], stops[i]))
+		    return head;
+	    parse_error(ps);
+	    return NULL;
+	}
+    }
+}
+
+/* parse_andor - Parse commands joined by && and || (left to right) */
+struct node_t *parse_andor(struct parser_t *ps)
+{
+    struct node_t *left, *n;
+    int type;
+
+    if ((left = parse_command(ps)) == NULL)
+	return NULL;
+    while (ps->i < ps->ntoks &&
+	   (ps->toks[ps->i].type == TOK_ANDIF || ps->toks[ps->i].type == TOK_ORIF)) {
+	type = ps->toks[ps->i++].type == TOK_ANDIF ? N_AND : N_OR;
+	while (ps->i < ps->ntoks && ps->toks[ps->i].type == TOK_NEWLINE)
+	    ps->i++;
+	n = newnode(ps, type);
+	n->left = left;
+	if ((n->right = parse_command(ps)) == NULL)
+	    return NULL;
+	left = n;
+    }
+    return left;
+}
+
+/*
+ * parse_command - Parse a pipeline or a compound command.  A pipeline
+ *    keeps its tokens, which are expanded again each time it runs, and a
+ *    copy of its text for the job list.
+ */
+struct node_t *parse_command(struct parser_t *ps)
+{
+    static const char *const reserved[] = { "then", "elif", "else", "fi", "do", "done", NULL };
+    struct token_t *t, *toks;
+    struct node_t *n;
+    const char *end;
+    char name[32];          /* longer than any builtin's name */
+    int start, i, j, newlines = 0;
+
+    if (ps->i == ps->ntoks) {
+	ps->incomplete = 1;
+	return NULL;
+    }
+    t = &ps->toks[ps->i];
+    if (iskeyword(t, "if"))
+	return parse_if(ps);
+    if (iskeyword(t, "while") || iskeyword(t, "until"))
+	return parse_while(ps);
+    if (iskeyword(t, "for"))
+	return parse_for(ps);
+    for (i = 0; reserved[i]; i++)
+	if (iskeyword(t, reserved[i])) {
+	    parse_error(ps);
+	    return NULL;
+	}
+
+    /* the pipeline runs up to the next separator; a | may end a line */
+    start = ps->i;
+    for (; ps->i < ps->ntoks; ps->i++) {
+	t = &ps->toks[ps->i];
+	if (t->type == TOK_PIPE || t->type == TOK_WORD || t->type == TOK_IONUM ||
+	    (t->type >= TOK_LESS && t->type <= TOK_GREATAND)) {
+	    if (ps->i == start && t->type == TOK_PIPE)
+		break;
+	    if (t->type == TOK_PIPE)
+		while (ps->i + 1 < ps->ntoks && ps->toks[ps->i+1].type == TOK_NEWLINE) {
+		    ps->i++;
+		    newlines++;
+		}
+	    continue;
+	}
+	break;
+    }
+    if (ps->i == start) {
+	parse_error(ps);
+	return NULL;
+    }
+    if (ps->toks[ps->i-1].type == TOK_PIPE || ps->toks[ps->i-1].type == TOK_NEWLINE) {
+	if (ps->i == ps->ntoks)
+	    ps->incomplete = 1;
+	else
+	    parse_error(ps);
+	return NULL;
+    }
+
+    n = newnode(ps, N_PIPE);
+    n->ntoks = ps->i - start - newlines;
+    if (newlines == 0)
+	n->toks = &ps->toks[start];
+    else {
+	toks = arena_alloc(ps->a, n->ntoks * sizeof(*toks));
+	for (i = start, j = 0; i < ps->i; i++)
+	    if (ps->toks[i].type != TOK_NEWLINE)
+		toks[j++] = ps->toks[i];
+	n->toks = toks;
+    }
+    end = ps->toks[ps->i-1].p + ps->toks[ps->i-1].len;
+    if (ps->i < ps->ntoks && ps->toks[ps->i].type == TOK_AMP)
+	end = ps->toks[ps->i].p + 1;
+    n->srclen = end - n->toks[0].p + 1;
+    n->src = arena_alloc(ps->a, n->srclen + 1);
+    memcpy(n->src, n->toks[0].p, n->srclen - 1);
+    n->src[n->srclen-1] = '\n';
+    n->src[n->srclen] = '\0';
+
+    /* a lone builtin named by a plain word is looked up once */
+    t = &n->toks[0];
+    if (t->type == TOK_WORD && t->flags == 0 && t->len < sizeof(name)) {
+	for (i = 0; i < n->ntoks && n->toks[i].type != TOK_PIPE; i++)
+	    ;
+	if (i == n->ntoks) {
+	    memcpy(name, t->p, t->len);
+	    name[t->len] = '\0';
+	    n->builtin = findbuiltin(name);
+	}
+    }
+    return n;
+}
+
+/* parse_if - Parse if list; then list; [elif list; then list;]... [else list;] fi */
+struct node_t *parse_if(struct parser_t *ps)
+{
+    static const char *const thenstop[] = { "then", NULL };
+    static const char *const bodystop[] = { "elif", "else", "fi", NULL };
+    static const char *const fistop[] = { "fi", NULL };
+    struct node_t *n = newnode(ps, N_IF);
+
+    ps->i++;    /* if or elif */
+    if ((n->cond = parse_list(ps, thenstop)) == NULL || expect(ps, "then") < 0 ||
+	(n->body = parse_list(ps, bodystop)) == NULL) {
+	parse_error(ps);
+	return NULL;
+    }
+    /* elif starts an if of its own that ends at the same fi */
+    if (iskeyword(&ps->toks[ps->i], "elif")) {
+	n->alt = parse_if(ps);
+	return n->alt ? n : NULL;
+    }
+    if (iskeyword(&ps->toks[ps->i], "else")) {
+	ps->i++;
+	if ((n->alt = parse_list(ps, fistop)) == NULL) {
+	    parse_error(ps);
+	    return NULL;
+	}
+    }
+    return expect(ps, "fi") < 0 ? NULL : n;
+}
+
+/* parse_while - Parse while list; do list; done, or the same with until */
+struct node_t *parse_while(struct parser_t *ps)
+{
+    static const char *const dostop[] = { "do", NULL };
+    static const char *const donestop[] = { "done", NULL };
+    struct node_t *n;
+
+    n = newnode(ps, iskeyword(&ps->toks[ps->i], "while") ? N_WHILE : N_UNTIL);
+    ps->i++;
+    if ((n->cond = parse_list(ps, dostop)) == NULL || expect(ps, "do") < 0 ||
+	(n->body = parse_list(ps, donestop)) == NULL || expect(ps, "done") < 0) {
+	parse_error(ps);
+	return NULL;
+    }
+    return n;
+}
+
+/* parse_for - Parse for name in word...; do list; done */
+struct node_t *parse_for(struct parser_t *ps)
+{
+    static const char *const donestop[] = { "done", NULL };
+    struct node_t *n = newnode(ps, N_FOR);
+    struct token_t *t;
+
+    ps->i++;
+    if (ps->i == ps->ntoks) {
+	ps->incomplete = 1;
+	return NULL;
+    }
+    t = &ps->toks[ps->i];
+    if (t->type != TOK_WORD || t->flags != 0 || namelen(t->p) != t->len) {
+	parse_error(ps);
+	return NULL;
+    }
+    n->name = arena_alloc(ps->a, t->len + 1);
+    memcpy(n->name, t->p, t->len);
+    n->name[t->len] = '\0';
+    ps->i++;
+    if (expect(ps, "in") < 0)
+	return NULL;
+
+    /* the words, expanded each time the loop starts */
+    n->toks = &ps->toks[ps->i];
+    for (; ps->i < ps->ntoks && ps->toks[ps->i].type == TOK_WORD; ps->i++)
+	n->ntoks++;
+    if (ps->i == ps->ntoks) {
+	ps->incomplete = 1;
+	return NULL;
+    }
+    if (ps->toks[ps->i].type != TOK_SEMI && ps->toks[ps->i].type != TOK_NEWLINE) {
+	parse_error(ps);
+	return NULL;
+    }
+    ps->i++;
+    while (ps->i < ps->ntoks && ps->toks[ps->i].type == TOK_NEWLINE)
+	ps->i++;
+    if (expect(ps, "do") < 0 ||
+	(n->body = parse_list(ps, donestop)) == NULL || expect(ps, "done") < 0) {
+	parse_error(ps);
+	return NULL;
+    }
+    return n;
+}
+
+/* newnode - Return a cleared node of the given type from the parser's arena */
+struct node_t *newnode(struct parser_t *ps, int type)
+{
+    struct node_t *n = arena_alloc(ps->a, sizeof(*n));
+
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return n;
+}
+
+/* iskeyword - Return true if t is the unquoted word kw */
+int iskeyword(const struct token_t *t, const char *kw)
+{
+    return t->type == TOK_WORD && t->flags == 0 &&
+	!strncmp(t->p, kw, t->len) && kw[t->len] == '\0';
+}
+
+/*
+ * expect - Step over keyword kw.  Returns -1 if it is not there: the
+ *    construct needs more lines, or it is a syntax error.
+ */
+int expect(struct parser_t *ps, const char *kw)
+{
+    if (ps->failed || ps->incomplete)
+	return -1;
+    if (ps->i == ps->ntoks) {
+	ps->incomplete = 1;
+	return -1;
+    }
+    if (!iskeyword(&ps->toks[ps->i], kw)) {
+	parse_error(ps);
+	return -1;
+    }
+    ps->i++;
+    return 0;
+}
+
+/*
+ * parse_error - Report the token the parser stopped at, unless the
+ *    parse has already failed or run out of text.  Callers also use it
+ *    for a list that came out empty (if then).
+ */
+void parse_error(struct parser_t *ps)
+{
+    const struct token_t *t;
+
+    if (ps->failed || ps->incomplete)
+	return;
+    ps->failed = 1;
+    if (ps->i == ps->ntoks) {
+	printf("syntax error: unexpected end of file\n");
+	return;
+    }
+    t = &ps->toks[ps->i];
+    if (t->type == TOK_WORD || t->type == TOK_IONUM)
+	printf("syntax error near unexpected token `%.*s'\n", (int)t->len, t->p);
+    else
+	printf("syntax error near unexpected token `%s'\n", opname[t->type]);
+}
+
+/* run_list - Run the commands of a list one after another */
+void run_list(struct node_t *n)
+{
+    for (; n != NULL && !loopbreak; n = n->next)
+	run_node(n);
+}
+
+/* run_node - Run one command of a compiled script, setting exitstatus */
+void run_node(struct node_t *n)
+{
+    struct arena_t arena;
+    struct cmd_t words;
+    size_t argcap = 0;
+    int status = 0, i;
+
+    switch (n->type) {
+    case N_PIPE:
+	run_pipe(n);
+	break;
+
+    case N_AND:
+    case N_OR:
+	run_node(n->left);
+	if (!loopbreak && (exitstatus == 0) == (n->type == N_AND))
+	    run_node(n->right);
+	break;
+
+    case N_IF:
+	run_list(n->cond);
+	if (loopbreak)
+	    break;
+	if (exitstatus == 0)
+	    run_list(n->body);
+	else if (n->alt)
+	    run_list(n->alt);
+	else
+	    exitstatus = 0;
+	break;
+
+    case N_WHILE:
+    case N_UNTIL:
+	while (1) {
+	    run_list(n->cond);
+	    if (loopbreak || (exitstatus == 0) != (n->type == N_WHILE))
+		break;
+	    run_list(n->body);
+	    status = exitstatus;
+	    loop_poll();
+	    if (loopbreak)
+		break;
+	}
+	exitstatus = status;
+	break;
+
+    case N_FOR:
+	arena_init(&arena);
+	memset(&words, 0, sizeof(words));
+	for (i = 0; i < n->ntoks; i++)
+	    addword(&arena, &words, &argcap, &n->toks[i]);
+	for (i = 0; i < words.argc && !loopbreak; i++) {
+	    setvar(n->name, strlen(n->name), words.argv[i], -1);
+	    run_list(n->body);
+	    status = exitstatus;
+	    loop_poll();
+	}
+	arena_free(&arena);
+	exitstatus = status;
+	break;
+    }
+}
+
+/*
+ * run_pipe - Expand the tokens of a pipeline node and run it.  Only the
+ *    words are redone each time: the tokenizer and parser already ran.
+ */
+void run_pipe(struct node_t *n)
+{
+    struct arena_t arena;
+    struct pipeline_t pl;
+
+    arena_init(&arena);
+    if (buildpipeline(n->toks, n->ntoks, &arena, &pl) < 0)
+	exitstatus = 2;
+    else if (pl.ncmds > 0) {
+	pl.bg = n->bg;
+	if (pl.ncmds == 1)
+	    pl.cmds[0].builtin = n->builtin;
+	run_pipeline(&pl, &arena, n->src, n->srclen);
+    }
+    arena_free(&arena);
+}
+
+/*
+ * loop_poll - Count a loop iteration and, every LOOPPOLL of them, take
+ *    in pending signals and expired timeouts: a loop of builtins never
+ *    waits in the event loop, so ctrl-c, finished children and jobs
+ *    past their deadline would go unnoticed.
+ */
+void loop_poll(void)
+{
+    if ((++looptick & (LOOPPOLL - 1)) == 0) {
+	dispatch_signals();
+	if (wheel.count > 0)
+	    wheel_run();
+    }
+}
+
+/****************************************
+ * End lists, conditionals and loops
+ ****************************************/
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately, with its redirections applied to the shell for
+ *    the duration, and record its status in exitstatus.
+ * Book: page 791
+ */
+int builtin_cmd(struct cmd_t *cmd) 
+{
+    struct builtin_t *b;
+    int fds[cmd->nredirs + 1], copies[cmd->nredirs + 1];
+    int n;
+    long long start;
+
+    //Look the name up in the builtin table (a compiled script has done it already)
+    if ((b = cmd->builtin) == NULL && (b = findbuiltin(cmd->argv[0])) == NULL)
+        return 0;     /* not a builtin command */
+
+    start = now_ns();
+    if (cmd->nredirs == 0) {
+        exitstatus = b->fn(cmd->argv);
+        trace_span(TR_BUILTIN, start, 0, 0);
+        return 1;
+    }
+
+    //Keep copies of the descriptors the redirections replace, run the
+    //builtin with them redirected, then put the originals back
+    fflush(stdout);
+    n = redirect_save(cmd, fds, copies);
+    if (do_redirect(cmd) == 0)
+        exitstatus = b->fn(cmd->argv);
+    else
+        exitstatus = 1;
+    //Output that cannot be written (e.g. >&-) is dropped, not carried over
+    if (fflush(stdout) == EOF) {
+        __fpurge(stdout);
+        clearerr(stdout);
+        exitstatus = 1;
+    }
+    redirect_restore(fds, copies, n);
+    trace_span(TR_BUILTIN, start, 0, 0);
+    return 1;
+}
+
+
+/*
+ * isbuiltin - Return true if name is one of the commands builtin_cmd runs
+ */
+int isbuiltin(const char *name)
+{
+    return findbuiltin(name) != NULL;
+}
+
+/* 
+ * parse_redirect - record the redirection "[fd]op word" in r.  fd is -1
+ *    when no descriptor was given: < and <& then redirect stdin, the
+ *    others stdout.
+ *
+ *        < file    read fd from file
+ *        > file    write fd to file, created or truncated
+ *        >> file   append fd to file, created if missing
+ *        >& m      make fd a copy of descriptor m (also <& m)
+ *        >& -      close fd (also <& -)
+ *
+ *    Returns 0, or -1 after printing a message if word is not a
+ *    descriptor where one is needed.
+ */
+int parse_redirect(int op, int fd, const char *word, struct redir_t *r)
+{
+        const char *p;
+
+        r->fd = fd >= 0 ? fd : (op == TOK_LESS || op == TOK_LESSAND) ? STDIN_FILENO : STDOUT_FILENO;
+        r->path = NULL;
+        r->dupfd = -1;
+        switch (op) {
+        case TOK_LESS:
+                //read from the file
+                r->flags = O_RDONLY;
+                r->path = word;
+                break;
+        case TOK_GREAT:
+                //write to the file; if the file already exists, then truncate it
+                r->flags = O_WRONLY|O_CREAT|O_TRUNC;
+                r->path = word;
+                break;
+        case TOK_DGREAT:
+                //append to the file
+                r->flags = O_WRONLY|O_CREAT|O_APPEND;
+                r->path = word;
+                break;
+        default:
+                //duplicate (or with -, close) a descriptor
+                r->flags = 0;
+                if (!strcmp(word, "-"))
+                        break;
+                for (p = word; isdigit((unsigned char)*p); p++)
+                        ;
+                if (p == word || *p != '\0' || p - word > 9) {
+                        printf("%s: ambiguous redirect\n", word);
+                        return -1;
+                }
+                r->dupfd = atoi(word);
+                break;
+        }
+        return 0;
+}
+
+/* 
+ * do_redirect - apply cmd's redirections, in order, in a forked child.
+ *    Returns 0, or -1 after reporting the first one that failed.
+ */
+int do_redirect(struct cmd_t *cmd)
 {
         int i;
         int fd;
-        system("touch file.txt");//Create a file named file.txt as input file for reading
-        system("touch test.out");//Create a file named test.out to write output into
-        
-        for(i=0; argv[i]; i++)
+        struct redir_t *r;
+
+        for(i=0; i<cmd->nredirs; i++)
         {
-                if (!strcmp(argv[i],"<")) {
-                        /* add code for input redirection below */
-                        //open existing file name file.txt for reading only
-                        fd = open("file.txt", O_RDONLY, 0);
-                        //Check system call for errors
-                        if (fd < 0){
-                            perror("fail to open the input file!");
-                        }
-                        //change standard input to the new file discriptor
-                        dup2(fd,0);
-                        //Close the open file
-                        close(fd);
-                        /* the line below cuts argv short. This
-                           removes the < and whatever follows from argv */
-                        argv[i]=NULL;
+                r = &cmd->redirs[i];
+                //N>&- closes the descriptor
+                if (r->path == NULL && r->dupfd < 0) {
+                        close(r->fd);
+                        continue;
                 }
-                else if (!strcmp(argv[i],">")) {
-                        /* add code for output redirection here */
-                        //open existing file name test.out for writing only
-                        //if the file already exists, then truncate it
-                        fd = open("test.out", O_WRONLY|O_TRUNC, STDOUT_FILENO);
-                        //Check system call for errors
-                        if (fd < 0){
-                            perror("fail to create output file");
+                //N>&M makes N a copy of M
+                if (r->path == NULL) {
+                        if (r->dupfd != r->fd && dup2(r->dupfd, r->fd) < 0) {
+                                printf("%d: %s\n", r->dupfd, strerror(errno));
+                                return -1;
+                        }
+                        if (r->dupfd == r->fd && fcntl(r->fd, F_GETFD) < 0) {
+                                printf("%d: %s\n", r->dupfd, strerror(errno));
+                                return -1;
                         }
-                        //change standard output to the new file discriptor
-                        dup2(fd,STDOUT_FILENO);
-                        //Close the open file
-                        close(fd); 
-                        /* the line below cuts argv short. This
-                           removes the > and whatever follows from argv */
-                        argv[i]=NULL;
+                        continue;
                 }
+                //open the file with the flags recorded by parse_redirect()
+                fd = open(r->path, r->flags|O_CLOEXEC, 0666);
+                //Check system call for errors
+                if (fd < 0){
+                        printf("%s: %s\n", r->path, strerror(errno));
+                        return -1;
+                }
+                //The file may already have landed on the right descriptor
+                if (fd == r->fd) {
+                        fcntl(fd, F_SETFD, 0);
+                        continue;
+                }
+                //change the redirected descriptor to the new file discriptor (dup2 clears O_CLOEXEC)
+                if (dup2(fd, r->fd) < 0) {
+                        printf("%d: %s\n", r->fd, strerror(errno));
+                        close(fd);
+                        return -1;
+                }
+                //Close the open file
+                close(fd);
+        }
+        return 0;
+}
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+//I got advices from office hours TA (David) to write the following code lines for this do_bgfg() function
+//Ref: 2467.cs.uno.edu/activities/next-steps.pdf
+int do_bgfg(char **argv) 
+{
+    struct job_t *job;
+    pid_t argvPid;
+    int jid;
+    
+    //Arguments for fg or bg is missing, argv[0] = fg or bg --> argv[1] = Null if the arguments are missing
+    if (argv[1] == NULL){
+        printf("%s command requires PID or %%jobid argument\n",argv[0]);
+        return 1;
+    }
+
+    //If the first token of an argument for fg or bg is not a "%" --> it can not be a job id, it only can be a pid
+    if (argv[1][0] != '%'){
+    //Continue to check if it is valid pid or not
+        //if not, print out the message of invalid argument
+        if (!isdigit(argv[1][0])){
+            printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+            return 1;
+        }
+        //If argument for fg or bg is a valid pid
+        //use atoi() to convert char* to int
+        argvPid = atoi(argv[1]);
+        //Find a job (by argvPid) on the job list
+        job = getjobpid(&jobs, argvPid);
+        //if no such process, print out that message
+        if (job == NULL){
+            printf("(%s): No such process\n", argv[1]);
+            return 1;
+        }
+    }
+    //Check if the first token of an argument for fg or bg is "%"
+    else{
+     //if it is true, continue to check the second token of that argument, if it is not a digit --> invalid arguments
+        if (!isdigit(argv[1][1])){
+            printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+            return 1;
+        }
+        //If arguments for fg or bg are valid ones
+        //use atoi() to convert char* to int
+        //followed by "%"" will be an integer and it is aslo a job id
+        jid = atoi(&argv[1][1]);
+        //Find a job (by jid) on the job list
+        job = getjobjid(&jobs, jid);
+        //if no such job, print the message out
+        if (job == NULL){
+            printf("%s: No such job\n", argv[1]);
+            return 1;
+        }
+}
+
+    //command line is background job
+    if (!strcmp(argv[0], "bg") && job->state == QU) {
+        if (!startqueued(job, BG))
+            return 127;
+        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+    }
+    else if (!(strcmp(argv[0], "bg"))){
+        //Change state of job to background
+        setjobstate(&jobs, job, BG);
+        //Send continue signal to run again all processes that are suspended before
+        signaljob(job, SIGCONT);
+        //A parallel batch starts the commands it held back while stopped
+        if (job->wq)
+            workq_fill(job);
+        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+    }
+    //A queued job is started right away, whatever the admission limits
+    else if (job->state == QU)
+        return startqueued(job, FG) ? exitstatus : 127;
+    //Comand line is forefround job
+    else {
+        //Change state of job to foreground
+        setjobstate(&jobs, job, FG);
+        //Send continue signal to run again all processes that are suspended before
+        signaljob(job, SIGCONT);
+        if (job->wq)
+            workq_fill(job);
+        //Call waitfg() to wait until the process is terminated
+        waitfg(job->pid);
+        return exitstatus;
+    }
+    return 0;
+}
+
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid)
+{
+    struct job_t *job = getjobpid(&jobs, pid);
+    long long start = now_ns();
+    int jid = job ? job->jid : 0;
+
+    //Run the event loop (signals only, stdin belongs to the job) until the
+    //reaper or a ctrl-z moves the job out of the foreground. The loop sleeps
+    //in epoll_wait and wakes as soon as SIGCHLD is readable on sigfd.
+    //(The job is followed by identity: a parallel batch changes its PID.)
+    while (job != NULL && fgpid(&jobs) != 0 && jobs.fg == job)
+        eventloop_wait(-1, 0);
+    trace_span(TR_WAIT, start, pid, jid);
+    return;
+}
+
+/****************
+ * Job placement
+ ****************/
+
+/*
+ * placeclass - Is the n-byte string s exactly name?
+ */
+int placeclass(const char *s, size_t n, const char *name)
+{
+    return strlen(name) == n && !memcmp(s, name, n);
+}
+
+/*
+ * parse_place - Parse the placement options of run and place starting
+ *    at argv[i] into p:
+ *        --cpus list          CPU affinity, e.g. 0-3,8
+ *        --nice n             nice value
+ *        --ionice class[:n]   idle, best-effort (be) or realtime (rt)
+ *        --sched policy       other, batch or idle
+ *    Returns the index of the first argument after the options, or -1
+ *    after printing a message.
+ */
+int parse_place(char **argv, int i, struct place_t *p)
+{
+    const char *opt, *val, *colon;
+    char *end;
+    size_t n;
+    int class, level;
+
+    memset(p, 0, sizeof(*p));
+    p->ioprio = -1;
+    p->policy = -1;
+    for (; argv[i] && !strncmp(argv[i], "--", 2); i += 2) {
+	opt = argv[i];
+	if ((val = argv[i+1]) == NULL) {
+	    printf("%s: %s requires a value\n", argv[0], opt);
+	    return -1;
+	}
+	if (!strcmp(opt, "--cpus")) {
+	    if (parse_cpus(val, &p->cpus) < 0) {
+		printf("%s: %s: invalid CPU list\n", argv[0], val);
+		return -1;
+	    }
+	    p->hascpus = 1;
+	}
+	else if (!strcmp(opt, "--nice")) {
+	    p->nice = strtol(val, &end, 10);
+	    if (end == val || *end != '\0') {
+		printf("%s: %s: invalid nice value\n", argv[0], val);
+		return -1;
+	    }
+	    p->hasnice = 1;
+	}
+	else if (!strcmp(opt, "--ionice")) {
+	    /* The class is the whole string up to an optional :level */
+	    colon = strchr(val, ':');
+	    n = colon ? (size_t)(colon - val) : strlen(val);
+	    level = 4;
+	    if (colon) {
+		level = strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != '\0')
+		    level = -1;
+	    }
+	    if (placeclass(val, n, "idle"))
+		class = IOPRIO_CLASS_IDLE, level = level < 0 ? level : 0;
+	    else if (placeclass(val, n, "be") || placeclass(val, n, "best-effort"))
+		class = IOPRIO_CLASS_BE;
+	    else if (placeclass(val, n, "rt") || placeclass(val, n, "realtime"))
+		class = IOPRIO_CLASS_RT;
+	    else {
+		printf("%s: %s: invalid I/O class\n", argv[0], val);
+		return -1;
+	    }
+	    if (level < 0 || level > 7) {
+		printf("%s: %s: I/O level must be 0-7\n", argv[0], val);
+		return -1;
+	    }
+	    p->ioprio = class << IOPRIO_CLASS_SHIFT | level;
+	}
+	else if (!strcmp(opt, "--sched")) {
+	    if (!strcmp(val, "other"))
+		p->policy = SCHED_OTHER;
+	    else if (!strcmp(val, "batch"))
+		p->policy = SCHED_BATCH;
+	    else if (!strcmp(val, "idle"))
+		p->policy = SCHED_IDLE;
+	    else {
+		printf("%s: %s: invalid scheduling policy\n", argv[0], val);
+		return -1;
+	    }
+	}
+	else {
+	    printf("%s: %s: unknown option\n", argv[0], opt);
+	    return -1;
+	}
+    }
+    return i;
+}
+
+/* parse_cpus - Parse a CPU list such as 0-3,8,10-11 into set.
+ *    Returns 0, or -1 if s is not a valid list. */
+int parse_cpus(const char *s, cpu_set_t *set)
+{
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    do {
+	lo = hi = strtol(s, &end, 10);
+	if (end == s)
+	    return -1;
+	if (*end == '-') {
+	    s = end + 1;
+	    hi = strtol(s, &end, 10);
+	    if (end == s)
+		return -1;
+	}
+	if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+	    return -1;
+	for (; lo <= hi; lo++)
+	    CPU_SET(lo, set);
+	s = end + 1;
+    } while (*end == ',');
+    return *end == '\0' ? 0 : -1;
+}
+
+/* place_task - Set the affinity and scheduling policy of one thread
+ *    (0 for the caller).  Returns 0, or -1 with errno set. */
+int place_task(const struct place_t *p, pid_t tid)
+{
+    struct sched_param sp = { 0 };
+
+    if (p->hascpus && sched_setaffinity(tid, sizeof(p->cpus), &p->cpus) < 0)
+	return -1;
+    if (p->policy >= 0 && sched_setscheduler(tid, p->policy, &sp) < 0)
+	return -1;
+    return 0;
+}
+
+/* place_self - Apply p to the calling process (a child about to exec).
+ *    Returns 0, or -1 after printing why it failed. */
+int place_self(const struct place_t *p)
+{
+    if (place_task(p, 0) < 0 ||
+	(p->hasnice && setpriority(PRIO_PROCESS, 0, p->nice) < 0) ||
+	(p->ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, p->ioprio) < 0)) {
+	printf("run: %s\n", strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+/* place_merge - Copy the settings given in src over dst */
+void place_merge(struct place_t *dst, const struct place_t *src)
+{
+    if (src->hascpus) {
+	dst->cpus = src->cpus;
+	dst->hascpus = 1;
+    }
+    if (src->hasnice) {
+	dst->nice = src->nice;
+	dst->hasnice = 1;
+    }
+    if (src->ioprio >= 0)
+	dst->ioprio = src->ioprio;
+    if (src->policy >= 0)
+	dst->policy = src->policy;
+}
+
+/*
+ * do_place - Execute the builtin place command
+ *
+ *    place %jobid|pid [--cpus list] [--nice n] [--ionice class[:n]] [--sched policy]
+ *
+ *    Moves a running job: nice and I/O priority are set for its whole
+ *    process group, affinity and policy for every thread of each of its
+ *    live processes.  Commands a parallel batch starts later get the
+ *    same placement.
+ */
+int do_place(char **argv)
+{
+    struct place_t p;
+    struct job_t *job;
+    struct dirent *de;
+    char path[64];
+    DIR *dir;
+    int i, status = 0;
+
+    if (argv[1] == NULL || (i = parse_place(argv, 2, &p)) < 0 || argv[i]) {
+	if (argv[1] == NULL || (argv[1] && i >= 0))
+	    printf("usage: place %%jobid|pid [--cpus list] [--nice n] [--ionice class[:level]] [--sched policy]\n");
+	return 2;
+    }
+    if (argv[1][0] == '%')
+	job = getjobjid(&jobs, atoi(&argv[1][1]));
+    else
+	job = getjobpid(&jobs, atoi(argv[1]));
+    if (job == NULL) {
+	printf("%s: No such job\n", argv[1]);
+	return 1;
+    }
+    if (job->state == QU) {
+	printf("place: %s: job has not started (use submit run ...)\n", argv[1]);
+	return 1;
+    }
+
+    if (p.hasnice && setpriority(PRIO_PGRP, job->pid, p.nice) < 0) {
+	printf("place: nice: %s\n", strerror(errno));
+	status = 1;
+    }
+    if (p.ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PGRP, job->pid, p.ioprio) < 0) {
+	printf("place: ionice: %s\n", strerror(errno));
+	status = 1;
+    }
+    if (p.hascpus || p.policy >= 0) {
+	for (i = 0; i < job->nprocs; i++) {
+	    if (job->procs[i].done)
+		continue;
+	    snprintf(path, sizeof(path), "/proc/%d/task", job->procs[i].pid);
+	    if ((dir = opendir(path)) == NULL)
+		continue;  /* exited meanwhile */
+	    while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' || place_task(&p, atoi(de->d_name)) == 0 || errno == ESRCH)
+		    continue;
+		printf("place: %s: %s\n", de->d_name, strerror(errno));
+		status = 1;
+	    }
+	    closedir(dir);
+	}
+    }
+
+    /* a batch places the commands it has yet to start */
+    if (job->wq) {
+	if (job->wq->place == NULL) {
+	    if ((job->wq->place = malloc(sizeof(struct place_t))) == NULL)
+		unix_error("malloc error");
+	    *job->wq->place = p;
+	}
+	else
+	    place_merge(job->wq->place, &p);
+    }
+    return status;
+}
+
+/********************
+ * End job placement
+ ********************/
+
+/******************
+ * Admission queue
+ ******************/
+
+/*
+ * do_submit - Execute the builtin submit command
+ *
+ *    submit [-j N] [-l load] [-m MB] [command [arg...] [| ...]]
+ *
+ *    Queues the pipeline as a background job that starts once fewer
+ *    than N jobs are running (default: one per online CPU, 0 = no
+ *    limit), the 1-minute load average is below load and at least MB
+ *    megabytes of memory are available.  The limits stay in force for
+ *    later submits; with no command, submit just sets and prints them.
+ *    Variables, $(...) and patterns are expanded when the job is
+ *    submitted, not when it starts.  Queued jobs are listed by jobs with their place in the queue, and
+ *    fg, bg and kill take them out of it.
+ */
+void do_submit(struct pipeline_t *pl, const char *cmdline, size_t len)
+{
+    struct job_t *job;
+    char **argv;
+    int i;
+
+    if (admit.maxrun < 0)
+	admit.maxrun = sysconf(_SC_NPROCESSORS_ONLN);
+    if ((i = parse_submit(pl->cmds[0].argv, &admit)) < 0) {
+	exitstatus = 2;
+	return;
+    }
+    argv = pl->cmds[0].argv + i;
+    if (argv[0] == NULL) {
+	if (pl->ncmds > 1) {
+	    printf("usage: submit [-j N] [-l load] [-m MB] [command [arg...]]\n");
+	    exitstatus = 2;
+	    return;
+	}
+	printf("submit: -j %d -l %.2f -m %ld, %d running, %d queued\n",
+	       admit.maxrun, admit.maxload, admit.minmem, jobs.nrun, jobs.nqueued);
+	exitstatus = 0;
+	return;
+    }
+    if ((pl->ncmds == 1 && isbuiltin(argv[0])) ||
+	!strcmp(argv[0], "parallel") || !strcmp(argv[0], "submit")) {
+	printf("submit: %s: only external commands can be queued\n", argv[0]);
+	exitstatus = 2;
+	return;
+    }
+
+    /* The timer that rechecks load and memory lives in the event loop */
+    if (admit.tfd < 0) {
+	struct epoll_event ev;
+
+	if ((admit.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+	    unix_error("timerfd_create error");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = admit.tfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, admit.tfd, &ev) < 0)
+	    unix_error("epoll_ctl error");
+    }
+
+    /* The words are expanded now; the job runs them as they are then */
+    job = addjob(&jobs, NULL, 0, QU, cmdline, len);
+    job->runline = quotepipeline(pl);
+    exitstatus = 0;
+    admit_jobs();
+    if (getjobjid(&jobs, job->jid) != job)
+	return;  /* started and could not run */
+    if (job->state == QU)
+	printf("[%d] Queued #%d %s", job->jid, queuepos(job), job->cmdline);
+    else
+	printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+}
+
+/* parse_submit - Parse submit's options into lim.  Returns the index of
+ *    the command, or -1 after printing a message. */
+int parse_submit(char **argv, struct admit_t *lim)
+{
+    char *end;
+    int i;
+
+    for (i = 1; argv[i] && argv[i][0] == '-' && argv[i+1]; i += 2) {
+	if (!strcmp(argv[i], "-j"))
+	    lim->maxrun = strtol(argv[i+1], &end, 10);
+	else if (!strcmp(argv[i], "-l"))
+	    lim->maxload = strtod(argv[i+1], &end);
+	else if (!strcmp(argv[i], "-m"))
+	    lim->minmem = strtol(argv[i+1], &end, 10);
+	else
+	    break;
+	if (end == argv[i+1] || *end != '\0' || lim->maxrun < 0 ||
+	    lim->maxload < 0 || lim->minmem < 0) {
+	    printf("submit: %s: invalid value for %s\n", argv[i+1], argv[i]);
+	    return -1;
+	}
+    }
+    if (argv[i] && argv[i][0] == '-') {
+	printf("usage: submit [-j N] [-l load] [-m MB] [command [arg...]]\n");
+	return -1;
+    }
+    return i;
+}
+
+/*
+ * admit_jobs - Start queued jobs, oldest first, while admit_ok allows.
+ *    Called when a job finishes or stops, on submit, and from the timer.
+ *    The load average and free memory lag behind the jobs just started,
+ *    so while either limit is set only one job is let in per tick.
+ */
+void admit_jobs(void)
+{
+    int gated = admit.maxload > 0 || admit.minmem > 0;
+
+    while (jobs.qhead && admit_ok()) {
+	startqueued(jobs.qhead, BG);
+	if (gated)
+	    break;
+    }
+    admit_timer(jobs.qhead && gated);
+}
+
+/* admit_ok - Whether the admission limits let one more job start */
+int admit_ok(void)
+{
+    char buf[4096], *p;
+    double load;
+    ssize_t n;
+    int fd;
+
+    if (admit.maxrun > 0 && jobs.nrun >= admit.maxrun)
+	return 0;
+    if (admit.maxload > 0 && (fd = open("/proc/loadavg", O_RDONLY|O_CLOEXEC)) >= 0) {
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[n > 0 ? n : 0] = '\0';
+	if (sscanf(buf, "%lf", &load) == 1 && load >= admit.maxload)
+	    return 0;
+    }
+    if (admit.minmem > 0 && (fd = open("/proc/meminfo", O_RDONLY|O_CLOEXEC)) >= 0) {
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[n > 0 ? n : 0] = '\0';
+	if ((p = strstr(buf, "MemAvailable:")) != NULL &&
+	    strtol(p + 13, NULL, 10) / 1024 < admit.minmem)
+	    return 0;
+    }
+    return 1;
+}
+
+/* admit_timer - Start or stop the periodic recheck of the queue */
+void admit_timer(int on)
+{
+    struct itimerspec its;
+
+    if (admit.tfd < 0 || admit.armed == on)
+	return;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = ADMITTICK * 1000000L;
+    }
+    timerfd_settime(admit.tfd, 0, &its, NULL);
+    admit.armed = on;
+}
+
+/*
+ * startqueued - Take job off the submit queue and start it in state
+ *    (BG or FG, in which case this waits for it).  The command is parsed
+ *    again from the job's command line.  Returns 1 if it started, 0 if
+ *    nothing could run, in which case the job is gone.
+ */
+int startqueued(struct job_t *job, int state)
+{
+    struct arena_t arena;
+    struct pipeline_t pl;
+    struct admit_t scratch = admit;
+    int i;
+
+    unqueue(&jobs, job);
+    job->state = UNDEF;
+    arena_init(&arena);
+    if (parseline(job->runline, strlen(job->runline), &arena, &pl) < 0 || pl.ncmds == 0 ||
+	(i = parse_submit(pl.cmds[0].argv, &scratch)) < 0) {
+	/* it parsed when it was submitted */
+	arena_free(&arena);
+	removejob(&jobs, job);
+	return 0;
+    }
+    pl.cmds[0].argv += i;
+    pl.cmds[0].argc -= i;
+    pl.bg = state == BG;
+    pl.queued = job;
+    run_pipeline(&pl, &arena, job->cmdline, strlen(job->cmdline));
+    arena_free(&arena);
+    /* run_pipeline clears pl.queued once the job has its processes */
+    if (pl.queued == NULL)
+	return 1;
+    job->status = 127;
+    removejob(&jobs, job);
+    return 0;
+}
+
+/* unqueue - Take job off the submit queue */
+void unqueue(struct joblist_t *jobs, struct job_t *job)
+{
+    struct job_t **pp;
+
+    for (pp = &jobs->qhead; *pp; pp = &(*pp)->qnext) {
+	if (*pp != job)
+	    continue;
+	*pp = job->qnext;
+	if (jobs->qtail == job)
+	    for (jobs->qtail = jobs->qhead; jobs->qtail && jobs->qtail->qnext; )
+		jobs->qtail = jobs->qtail->qnext;
+	job->qnext = NULL;
+	jobs->nqueued--;
+	return;
+    }
+}
+
+/*
+ * quotepipeline - The commands of pl as expanded, written out with
+ *    every word in single quotes, so that parsing the text again gives
+ *    back the same pipeline without expanding anything a second time.
+ *    Returns a malloc'd string.
+ */
+char *quotepipeline(struct pipeline_t *pl)
+{
+    struct cmd_t *cmd;
+    struct redir_t *r;
+    char *buf = NULL, op[32];
+    size_t len = 0, cap = 0, n;
+    int i, j;
+
+    for (i = 0; i < pl->ncmds; i++) {
+	cmd = &pl->cmds[i];
+	if (i > 0)
+	    quoteadd(&buf, &len, &cap, "| ", 2, 0);
+	for (j = 0; j < cmd->nassigns; j++) {
+	    n = namelen(cmd->assigns[j]) + 1;
+	    quoteadd(&buf, &len, &cap, cmd->assigns[j], n, 0);
+	    quoteadd(&buf, &len, &cap, cmd->assigns[j] + n, strlen(cmd->assigns[j] + n), 1);
+	}
+	for (j = 0; j < cmd->argc; j++)
+	    quoteadd(&buf, &len, &cap, cmd->argv[j], strlen(cmd->argv[j]), 1);
+	for (j = 0; j < cmd->nredirs; j++) {
+	    r = &cmd->redirs[j];
+	    if (r->path == NULL) {
+		if (r->dupfd < 0)
+		    n = snprintf(op, sizeof(op), "%d>&- ", r->fd);
+		else
+		    n = snprintf(op, sizeof(op), "%d>&%d ", r->fd, r->dupfd);
+		quoteadd(&buf, &len, &cap, op, n, 0);
+		continue;
+	    }
+	    n = snprintf(op, sizeof(op), "%d%s", r->fd, (r->flags & O_APPEND) ? ">>" :
+			 (r->flags & O_CREAT) ? ">" : "<");
+	    quoteadd(&buf, &len, &cap, op, n, 0);
+	    quoteadd(&buf, &len, &cap, r->path, strlen(r->path), 1);
+	}
+    }
+    quoteadd(&buf, &len, &cap, "\n", 1, 0);
+    return buf;
+}
+
+/* quoteadd - Append the n bytes at s to the string being built in
+ *    *buf; with quote, as a single-quoted word followed by a space */
+void quoteadd(char **buf, size_t *len, size_t *cap, const char *s, size_t n, int quote)
+{
+    size_t i;
+
+    if (*len + 4 * n + 4 > *cap) {
+	*cap = 2 * (*len + 4 * n + 4);
+	if ((*buf = realloc(*buf, *cap)) == NULL)
+	    unix_error("realloc error");
+    }
+    if (!quote) {
+	memcpy(*buf + *len, s, n);
+	*len += n;
+	(*buf)[*len] = '\0';
+	return;
+    }
+    (*buf)[(*len)++] = '\'';
+    for (i = 0; i < n; i++) {
+	if (s[i] == '\'') {
+	    memcpy(*buf + *len, "'\\''", 4);  /* close, escaped quote, reopen */
+	    *len += 4;
+	}
+	else
+	    (*buf)[(*len)++] = s[i];
+    }
+    memcpy(*buf + *len, "' ", 3);
+    *len += 2;
+}
+
+/* queuepos - Place of a queued job in the submit queue, from 1 */
+int queuepos(struct job_t *job)
+{
+    struct job_t *q;
+    int n = 1;
+
+    for (q = jobs.qhead; q && q != job; q = q->qnext)
+	n++;
+    return n;
+}
+
+/**********************
+ * End admission queue
+ **********************/
+
+/***************
+ * Job timeouts
+ ***************/
+
+/*
+ * A job with a deadline sits in one slot of a hierarchical timer wheel,
+ * as in the classic Linux timer code: level 0 has a slot for each of
+ * the next 64 ticks, level 1 one for each 64 ticks after that, and so
+ * on.  Adding or removing a deadline is O(1).  Each tick empties one
+ * level-0 slot, and when a level wraps the next slot of the level above
+ * is filed again one level down.  One timerfd wakes the shell for the
+ * next tick that has work, so no job needs a timer or thread of its own.
+ */
+
+/* parse_duration - Parse a duration such as 30, 1.5s, 200ms, 5m, 2h or
+ *    1d (seconds without a suffix).  Returns ms, or -1 if s is not one. */
+long parse_duration(const char *s)
+{
+    char *end;
+    double v = strtod(s, &end);
+
+    if (end == s || !(v >= 0))
+	return -1;
+    if (!strcmp(end, "ms"))
+	;
+    else if (*end == '\0' || !strcmp(end, "s"))
+	v *= 1000;
+    else if (!strcmp(end, "m"))
+	v *= 60 * 1000;
+    else if (!strcmp(end, "h"))
+	v *= 3600 * 1000;
+    else if (!strcmp(end, "d"))
+	v *= 86400 * 1000;
+    else
+	return -1;
+    if (v > 1e15)
+	return -1;
+    return v > 0 && v < 1 ? 1 : (long)v;
+}
+
+/* parse_timeout - Parse "timeout [-k grace] duration" at the start of
+ *    argv.  Returns the index of the command, or -1 after printing a
+ *    message. */
+int parse_timeout(char **argv, long *timeout, long *grace)
+{
+    int i = 1;
+
+    *grace = KILLGRACE;
+    if (argv[i] && !strcmp(argv[i], "-k") && argv[i+1]) {
+	if ((*grace = parse_duration(argv[i+1])) < 0) {
+	    printf("timeout: %s: invalid duration\n", argv[i+1]);
+	    return -1;
+	}
+	i += 2;
+    }
+    if (argv[i] == NULL || argv[i+1] == NULL) {
+	printf("usage: timeout [-k grace] duration command [arg...]\n");
+	return -1;
+    }
+    if ((*timeout = parse_duration(argv[i])) < 0) {
+	printf("timeout: %s: invalid duration\n", argv[i]);
+	return -1;
+    }
+    return i + 1;
+}
+
+/* settimeout - Give job a deadline ms from now in place of the one it
+ *    has, if any (0: no deadline) */
+void settimeout(struct job_t *job, long ms)
+{
+    struct epoll_event ev;
+    unsigned long now;
+
+    if (job->tpprev)
+	wheel_del(job);
+    if (ms <= 0)
+	return;
+
+    /* The wheel's timer lives in the event loop */
+    if (wheel.tfd < 0) {
+	if ((wheel.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+	    unix_error("timerfd_create error");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = wheel.tfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, wheel.tfd, &ev) < 0)
+	    unix_error("epoll_ctl error");
+	wheel.base = now_ns();
+    }
+
+    /* An empty wheel skips the ticks it slept through; rounding up and
+     * one more tick make sure the deadline is never early */
+    now = wheel_tick();
+    if (wheel.count == 0 && wheel.now < now)
+	wheel.now = now;
+    wheel_add(job, now + 1 + (ms + WHEELTICK - 1) / WHEELTICK);
+    wheel_arm();
+}
+
+/* wheel_tick - The tick the clock is in now */
+unsigned long wheel_tick(void)
+{
+    return (now_ns() - wheel.base) / (WHEELTICK * 1000000LL);
+}
+
+/* wheel_add - File job to expire at tick due, on the lowest level that
+ *    reaches that far.  A deadline past the top level waits in the last
+ *    slot it reaches and is filed again from there. */
+void wheel_add(struct job_t *job, unsigned long due)
+{
+    unsigned long at = due > wheel.now ? due : wheel.now;
+    unsigned long delta = at - wheel.now;
+    struct job_t **slot;
+    int level;
+
+    if (delta >> (WHEELLEVELS * WHEELBITS)) {
+	delta = (1UL << (WHEELLEVELS * WHEELBITS)) - 1;
+	at = wheel.now + delta;
+    }
+    for (level = 0; level < WHEELLEVELS - 1 && delta >> ((level + 1) * WHEELBITS); level++)
+	;
+    slot = &wheel.slots[level][(at >> (level * WHEELBITS)) & WHEELMASK];
+    job->due = due;
+    if ((job->tnext = *slot) != NULL)
+	job->tnext->tpprev = &job->tnext;
+    job->tpprev = slot;
+    *slot = job;
+    wheel.count++;
+}
+
+/* wheel_del - Take job off the wheel */
+void wheel_del(struct job_t *job)
+{
+    if ((*job->tpprev = job->tnext) != NULL)
+	job->tnext->tpprev = job->tpprev;
+    job->tnext = NULL;
+    job->tpprev = NULL;
+    wheel.count--;
+}
+
+/* wheel_cascade - File the jobs in the current slot of level again,
+ *    which puts each on a lower level now that its time is nearer */
+void wheel_cascade(int level)
+{
+    struct job_t **slot = &wheel.slots[level][(wheel.now >> (level * WHEELBITS)) & WHEELMASK];
+    struct job_t *list = *slot, *job;
+
+    *slot = NULL;
+    if (list)
+	list->tpprev = &list;
+    while ((job = list) != NULL) {
+	wheel_del(job);
+	wheel_add(job, job->due);
+    }
+}
+
+/*
+ * wheel_run - Run the ticks up to the current one: where a level wraps,
+ *    cascade the next slot of the level above, then expire the jobs in
+ *    the tick's level-0 slot.  Ticks with nothing to do are skipped, so
+ *    a run costs O(1) beyond the jobs it moves.  Called when the timer
+ *    fires and from long builtin loops.
+ */
+void wheel_run(void)
+{
+    unsigned long target = wheel_tick(), tick, next;
+    struct job_t *list, *job;
+    int level;
+
+    while (wheel.count > 0) {
+	if ((next = wheel_next()) > target) {
+	    wheel.now = target + 1;
+	    break;
+	}
+	wheel.now = next;
+	for (level = 1; level < WHEELLEVELS &&
+		 ((wheel.now >> ((level - 1) * WHEELBITS)) & WHEELMASK) == 0; level++)
+	    wheel_cascade(level);
+	tick = wheel.now++;
+	list = wheel.slots[0][tick & WHEELMASK];
+	wheel.slots[0][tick & WHEELMASK] = NULL;
+	if (list)
+	    list->tpprev = &list;
+	while ((job = list) != NULL) {
+	    wheel_del(job);
+	    if (job->due > tick)
+		wheel_add(job, job->due);  /* parked in a top-level slot */
+	    else
+		job_expire(job);
+	}
+    }
+    wheel_arm();
+}
+
+/*
+ * wheel_next - The first tick from wheel.now with work: a level-0 slot
+ *    in use, or the cascade of a slot in use on a higher level (level n
+ *    cascades when the tick is a multiple of 64^n).  A non-empty wheel
+ *    always has one within 64 slots of each level.
+ */
+unsigned long wheel_next(void)
+{
+    unsigned long next = ULONG_MAX, span, t;
+    int level, k;
+
+    for (level = 0; level < WHEELLEVELS; level++) {
+	span = 1UL << (level * WHEELBITS);
+	t = (wheel.now + span - 1) & ~(span - 1);
+	for (k = 0; k <= WHEELMASK && t < next; k++, t += span)
+	    if (wheel.slots[level][(t >> (level * WHEELBITS)) & WHEELMASK]) {
+		next = t;
+		break;
+	    }
+    }
+    return next;
+}
+
+/* wheel_arm - Set the timer for the next tick with work.  An empty wheel
+ *    stops it. */
+void wheel_arm(void)
+{
+    struct itimerspec its;
+    unsigned long t;
+    long long ns;
+
+    if (wheel.tfd < 0)
+	return;
+    memset(&its, 0, sizeof(its));
+    if (wheel.count > 0) {
+	t = wheel_next();
+	ns = wheel.base + (long long)t * WHEELTICK * 1000000LL;
+	its.it_value.tv_sec = ns / 1000000000LL;
+	its.it_value.tv_nsec = ns % 1000000000LL;
+    }
+    timerfd_settime(wheel.tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * job_expire - A job's deadline has passed.  The first time its process
+ *    group gets SIGTERM (and SIGCONT, so a stopped job can act on it),
+ *    and a second deadline grace ms later; the second time, SIGKILL.
+ *    A parallel batch starts no more commands.
+ */
+void job_expire(struct job_t *job)
+{
+    if (job->expired == 0) {
+	if (verbose)
+	    printf("Job [%d] (%d) timed out\n", job->jid, job->pid);
+	job->expired = 1;
+	signaljob(job, SIGTERM);
+	if (job->state == ST) {
+	    signaljob(job, SIGCONT);
+	    setjobstate(&jobs, job, BG);
+	}
+	if (job->wq)
+	    job->wq->aborted = 1;
+	settimeout(job, job->grace);
+    }
+    else {
+	if (verbose)
+	    printf("Job [%d] (%d) still running, killed\n", job->jid, job->pid);
+	job->expired = 2;
+	signaljob(job, SIGKILL);
+    }
+}
+
+/*******************
+ * End job timeouts
+ *******************/
+
+/**********
+ * History
+ **********/
+
+/*
+ * The history file is a header followed by records appended back to
+ * back.  A shell reserves room for a record with an atomic add on the
+ * header's used count in the shared mapping, fills it in and publishes
+ * it by storing its size last, so shells sharing the file never
+ * overwrite each other.  A writer that cannot finish its record marks
+ * it dead; one that died in between leaves a hole of zeros, which
+ * readers step over once it has stayed empty for a while.  Nothing is
+ * read at startup; the index (record offsets and a trigram -> entries
+ * map) is brought up to date by the history builtin, from where it
+ * left off.
+ */
+
+/* hist_open - Map the history file at path, creating it if needed.
+ *    History is off if that fails. */
+void hist_open(const char *path)
+{
+    struct histhdr_t *h;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0 || fstat(fd, &st) < 0) {
+	printf("history: %s: %s\n", path, strerror(errno));
+	if (fd >= 0)
+	    close(fd);
+	return;
+    }
+    if (st.st_size < (off_t)sizeof(*h) && (errno = posix_fallocate(fd, 0, HISTGROW)) != 0) {
+	printf("history: %s: %s\n", path, strerror(errno));
+	close(fd);
+	return;
+    }
+    histlog.fd = fd;
+    if (!hist_map(0)) {
+	close(fd);
+	histlog.fd = -1;
+	return;
+    }
+    h = (struct histhdr_t *)histlog.map;
+    if (memcmp(h->magic, "tshhist1", 8) != 0) {
+	if (atomic_load(&h->used) != 0) {
+	    printf("history: %s: not a tsh history file\n", path);
+	    munmap(histlog.map, histlog.mapsize);
+	    close(fd);
+	    histlog.fd = -1;
+	    return;
+	}
+	memcpy(h->magic, "tshhist1", 8);
+	atomic_store(&h->used, sizeof(*h));
+    }
+}
+
+/* hist_map - Make sure the file and the mapping cover need bytes
+ *    (0: just map what is there).  Returns 0 if that failed. */
+int hist_map(uint64_t need)
+{
+    struct stat st;
+    size_t size;
+    void *p;
+
+    if (fstat(histlog.fd, &st) < 0)
+	return 0;
+    size = st.st_size;
+    if (need > size) {
+	/* posix_fallocate never shrinks, so shells growing it at once are safe */
+	size = (need + HISTGROW - 1) / HISTGROW * HISTGROW;
+	if (size < (size_t)st.st_size + st.st_size / 4)
+	    size = ((size_t)st.st_size + st.st_size / 4 + HISTGROW - 1) / HISTGROW * HISTGROW;
+	if (posix_fallocate(histlog.fd, 0, size) != 0)
+	    return 0;
+    }
+    if (size == histlog.mapsize)
+	return 1;
+    if (histlog.map)
+	p = mremap(histlog.map, histlog.mapsize, size, MREMAP_MAYMOVE);
+    else
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, histlog.fd, 0);
+    if (p == MAP_FAILED)
+	return 0;
+    histlog.map = p;
+    histlog.mapsize = size;
+    return 1;
+}
+
+/* hist_add - Append a command line to the history.  The write goes to
+ *    the page cache only; the kernel flushes it in its own time. */
+void hist_add(const char *cmdline, size_t len, int status, long long dur)
+{
+    struct histhdr_t *h = (struct histhdr_t *)histlog.map;
+    struct histrec_t *r;
+    const char *cwd = getvar("PWD");
+    size_t cwdlen, size;
+    uint64_t off;
+
+    if (len > 0 && cmdline[len-1] == '\n')
+	len--;
+    if (cwd == NULL)
+	cwd = "";
+    cwdlen = strlen(cwd);
+    size = (sizeof(*r) + len + cwdlen + 2 + 7) & ~(size_t)7;
+    off = atomic_fetch_add(&h->used, size);
+    if (off + size > histlog.mapsize) {
+	if (!hist_map(off + size)) {
+	    /* the entry is lost: mark its room dead so readers step over it */
+	    if (off + sizeof(r->size) <= histlog.mapsize) {
+		r = (struct histrec_t *)(histlog.map + off);
+		atomic_store_explicit(&r->size, size | HISTDEAD, memory_order_release);
+	    }
+	    return;
+	}
+	h = (struct histhdr_t *)histlog.map;
+    }
+
+    r = (struct histrec_t *)(histlog.map + off);
+    r->status = status;
+    r->when = time(NULL);
+    r->dur = dur;
+    r->cmdlen = len;
+    r->cwdlen = cwdlen;
+    memcpy(r->text, cmdline, len);
+    r->text[len] = '\0';
+    memcpy(r->text + len + 1, cwd, cwdlen + 1);
+    atomic_store_explicit(&r->size, size, memory_order_release);
+}
+
+/* hist_sync - Index the entries appended since the last call (by this
+ *    shell or any other).  Stops at an entry that is still being
+ *    written, and steps over dead ones and holes. */
+void hist_sync(void)
+{
+    struct histhdr_t *h;
+    struct histrec_t *r;
+    struct posting_t *pt;
+    uint64_t used;
+    uint32_t size, id, i;
+    const unsigned char *c;
+    int key;
+
+    if (!hist_map(0))
+	return;
+    h = (struct histhdr_t *)histlog.map;
+    used = atomic_load(&h->used);
+    if (histlog.indexed == 0)
+	histlog.indexed = sizeof(*h);
+    while (histlog.indexed + sizeof(*r) <= used &&
+	   histlog.indexed + sizeof(*r) <= histlog.mapsize) {
+	r = (struct histrec_t *)(histlog.map + histlog.indexed);
+	size = atomic_load_explicit(&r->size, memory_order_acquire);
+	if (size & HISTDEAD) {
+	    histlog.indexed += size & ~HISTDEAD;
+	    continue;
+	}
+	if (size == 0) {
+	    if (!hist_skiphole(used))
+		break;
+	    continue;
+	}
+	if (histlog.indexed + size > histlog.mapsize)
+	    break;
+	if (histlog.n == histlog.cap) {
+	    histlog.cap = histlog.cap ? 2 * histlog.cap : 1024;
+	    if ((histlog.offs = realloc(histlog.offs, histlog.cap * sizeof(uint64_t))) == NULL)
+		unix_error("realloc error");
+	}
+	id = histlog.n++;
+	histlog.offs[id] = histlog.indexed;
+	histlog.indexed += size;
+
+	/* post the entry under each distinct trigram of its command line */
+	c = (const unsigned char *)r->text;
+	for (i = 0; i + 3 <= r->cmdlen; i++) {
+	    key = (c[i] << 16 | c[i+1] << 8 | c[i+2]) + 1;
+	    if ((pt = intmap_get(&histlog.tri, key)) == NULL) {
+		if ((pt = calloc(1, sizeof(*pt))) == NULL)
+		    unix_error("calloc error");
+		intmap_put(&histlog.tri, key, pt);
+	    }
+	    if (pt->n && pt->ids[pt->n-1] == id)
+		continue;
+	    if (pt->n == pt->cap) {
+		pt->cap = pt->cap ? 2 * pt->cap : 4;
+		if ((pt->ids = realloc(pt->ids, pt->cap * sizeof(uint32_t))) == NULL)
+		    unix_error("realloc error");
+	    }
+	    pt->ids[pt->n++] = id;
+	}
+    }
+}
+
+/*
+ * hist_skiphole - The record at histlog.indexed is reserved but empty.
+ *    Its writer may still be at work; once it has stayed empty for
+ *    HISTHOLE ms the writer is taken to have died and the index moves to
+ *    the next complete record below used.  Returns 0 if it cannot move
+ *    on yet.
+ */
+int hist_skiphole(uint64_t used)
+{
+    struct histrec_t *r;
+    uint64_t off, end = used < histlog.mapsize ? used : histlog.mapsize;
+    long long now = now_ns();
+
+    if (histlog.holeat != histlog.indexed) {
+	histlog.holeat = histlog.indexed;
+	histlog.holesince = now;
+	return 0;
+    }
+    if (now - histlog.holesince < HISTHOLE * 1000000LL)
+	return 0;
+    for (off = histlog.indexed + 8; off + sizeof(*r) <= end; off += 8) {
+	r = (struct histrec_t *)(histlog.map + off);
+	if (hist_valid(r, end - off)) {
+	    histlog.indexed = off;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* hist_valid - Whether r, with room bytes of the file left, holds a
+ *    complete record: a size that matches its lengths and text that is
+ *    terminated where they say */
+int hist_valid(struct histrec_t *r, uint64_t room)
+{
+    uint32_t size = atomic_load_explicit(&r->size, memory_order_acquire);
+
+    return size != 0 && size <= room && r->cmdlen < size && r->cwdlen < size &&
+	size == ((sizeof(*r) + r->cmdlen + r->cwdlen + 2 + 7) & ~(size_t)7) &&
+	r->text[r->cmdlen] == '\0' && r->text[r->cmdlen + 1 + r->cwdlen] == '\0';
+}
+
+/* hist_match - Whether entry id contains q (or starts with it) */
+int hist_match(uint32_t id, const char *q, size_t qlen, int prefix)
+{
+    struct histrec_t *r = (struct histrec_t *)(histlog.map + histlog.offs[id]);
+
+    if (prefix)
+	return r->cmdlen >= qlen && !memcmp(r->text, q, qlen);
+    return memmem(r->text, r->cmdlen, q, qlen) != NULL;
+}
+
+/*
+ * do_history - Execute the builtin history command
+ *
+ *    history [-l] [-n N] [-p] [text]
+ *
+ *    Prints the last N entries (default 20, 0 for all) that contain text,
+ *    or start with it with -p.  -l adds the start time, exit status,
+ *    duration and directory.  Searches for three or more characters
+ *    only look at the entries listed under the query's rarest trigram.
+ */
+int do_history(char **argv)
+{
+    struct histrec_t *r;
+    struct posting_t *pt, *best = NULL;
+    const char *q = NULL;
+    size_t qlen = 0;
+    uint32_t *hits, nhits = 0, i, id;
+    long max = 20;
+    int longfmt = 0, prefix = 0, k;
+    struct tm tm;
+    time_t when;
+    char tbuf[32];
+
+    for (k = 1; argv[k] && argv[k][0] == '-' && argv[k][1]; k++) {
+	if (!strcmp(argv[k], "-l"))
+	    longfmt = 1;
+	else if (!strcmp(argv[k], "-p"))
+	    prefix = 1;
+	else if (!strcmp(argv[k], "-n") && argv[k+1])
+	    max = atol(argv[++k]);
+	else
+	    break;
+    }
+    if ((argv[k] && argv[k+1]) || (argv[k] && argv[k][0] == '-' && argv[k][1]) || max < 0) {
+	printf("usage: history [-l] [-n N] [-p] [text]\n");
+	return 2;
+    }
+    if (histlog.fd < 0) {
+	printf("history: no history file (see -H)\n");
+	return 1;
+    }
+    if ((q = argv[k]) != NULL)
+	qlen = strlen(q);
+    hist_sync();
+    if (max == 0 || max > histlog.n)
+	max = histlog.n;
+    if ((hits = malloc((max ? max : 1) * sizeof(uint32_t))) == NULL)
+	unix_error("malloc error");
+
+    /* newest first, until max matches are found */
+    if (qlen >= 3) {
+	for (i = 0; i + 3 <= qlen; i++) {
+	    pt = intmap_get(&histlog.tri, ((unsigned char)q[i] << 16 |
+					   (unsigned char)q[i+1] << 8 |
+					   (unsigned char)q[i+2]) + 1);
+	    if (pt == NULL) {
+		best = NULL;
+		break;
+	    }
+	    if (best == NULL || pt->n < best->n)
+		best = pt;
+	}
+	for (i = best ? best->n : 0; i > 0 && nhits < max; i--)
+	    if (hist_match(best->ids[i-1], q, qlen, prefix))
+		hits[nhits++] = best->ids[i-1];
+    }
+    else {
+	for (id = histlog.n; id > 0 && nhits < max; id--)
+	    if (q == NULL || hist_match(id - 1, q, qlen, prefix))
+		hits[nhits++] = id - 1;
+    }
+
+    while (nhits > 0) {
+	id = hits[--nhits];
+	r = (struct histrec_t *)(histlog.map + histlog.offs[id]);
+	if (longfmt) {
+	    when = r->when;
+	    localtime_r(&when, &tm);
+	    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+	    printf("%6u  %s %3d %9.3fs  %s  %s\n", id + 1, tbuf, r->status,
+		   r->dur / 1e9, r->text + r->cmdlen + 1, r->text);
+	}
+	else
+	    printf("%6u  %s\n", id + 1, r->text);
+    }
+    free(hits);
+    return 0;
+}
+
+/**************
+ * End history
+ **************/
+
+/*****************
+ * Output capture
+ *****************/
+
+/*
+ * With -C bytes, the stdout and stderr of every & job go into a pipe
+ * whose read end the event loop drains into a buffer of at most that
+ * many bytes.  The buffer grows by doubling and becomes a ring once
+ * full, so the newest output is kept.  It outlives the job (which keeps
+ * its job ID meanwhile) until output -d drops it.
+ */
+
+/* capture_start - Start collecting job's output from fd */
+void capture_start(struct job_t *job, int fd)
+{
+    struct capture_t *cap;
+    struct epoll_event ev;
+
+    if ((cap = calloc(1, sizeof(*cap))) == NULL)
+	unix_error("calloc error");
+    cap->fd = fd;
+    cap->jid = job->jid;
+    cap->job = job;
+    cap->cmdline = strpool_intern(job->cmdline, strlen(job->cmdline));
+    job->cap = cap;
+    intmap_put(&captures.byjid, cap->jid, cap);
+    intmap_put(&captures.byfd, fd, cap);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	unix_error("epoll_ctl error");
+}
+
+/* capture_read - Move what the job has written into its buffer */
+void capture_read(struct capture_t *cap)
+{
+    size_t pos, size;
+    ssize_t n;
+
+    for (;;) {
+	if (cap->total == cap->size && cap->size < captures.max) {
+	    size = cap->size ? 2 * cap->size : CAPCHUNK;
+	    if (size > captures.max)
+		size = captures.max;
+	    if ((cap->buf = realloc(cap->buf, size)) == NULL)
+		unix_error("realloc error");
+	    cap->size = size;
+	}
+	pos = cap->total % cap->size;
+	if ((n = read(cap->fd, cap->buf + pos, cap->size - pos)) > 0) {
+	    cap->total += n;
+	    continue;
+	}
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && errno == EAGAIN)
+	    return;
+	capture_eof(cap);
+	return;
+    }
+}
+
+/* capture_eof - Stop watching a pipe every writer has closed */
+void capture_eof(struct capture_t *cap)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, cap->fd, NULL);
+    intmap_del(&captures.byfd, cap->fd);
+    close(cap->fd);
+    cap->fd = -1;
+}
+
+/* capture_print - Write cap's output from byte from on (or from the
+ *    oldest byte still held).  Returns the total printed up to. */
+unsigned long long capture_print(struct capture_t *cap, unsigned long long from)
+{
+    size_t pos, n;
+
+    if (cap->total > cap->size && from < cap->total - cap->size) {
+	printf("[output: %llu bytes dropped]\n", cap->total - cap->size - from);
+	from = cap->total - cap->size;
+    }
+    while (from < cap->total) {
+	pos = from % cap->size;
+	n = cap->total - from;
+	if (n > cap->size - pos)
+	    n = cap->size - pos;
+	fwrite(cap->buf + pos, 1, n, stdout);
+	from += n;
+    }
+    return from;
+}
+
+/* capture_drop - Free the captured output of a reaped job */
+void capture_drop(struct capture_t *cap)
+{
+    if (cap->fd >= 0)
+	capture_eof(cap);
+    intmap_del(&captures.byjid, cap->jid);
+    jobs.nheld--;
+    releasejid(&jobs, cap->jid);
+    strpool_release(cap->cmdline);
+    free(cap->buf);
+    free(cap);
+}
+
+/* capcmp - qsort comparison of captures by job ID */
+int capcmp(const void *a, const void *b)
+{
+    return (*(struct capture_t **)a)->jid - (*(struct capture_t **)b)->jid;
+}
+
+/*
+ * do_output - Execute the builtin output command
+ *
+ *    output                       list the captured outputs
+ *    output %jobid [--follow]     print a job's output; --follow keeps
+ *                                 printing until it ends (or ctrl-c)
+ *    output -d [%jobid...]        drop the output of finished jobs
+ *                                 (all of them if none are given)
+ */
+int do_output(char **argv)
+{
+    struct capture_t *cap, **list;
+    unsigned long long at;
+    size_t i, n;
+    int k, status = 0;
+
+    if (argv[1] == NULL) {
+	/* in job ID order */
+	if ((list = malloc((captures.byjid.count + 1) * sizeof(*list))) == NULL)
+	    unix_error("malloc error");
+	for (i = n = 0; i < captures.byjid.cap; i++)
+	    if (captures.byjid.keys[i])
+		list[n++] = captures.byjid.vals[i];
+	qsort(list, n, sizeof(*list), capcmp);
+	for (i = 0; i < n; i++) {
+	    cap = list[i];
+	    printf("[%d] %s", cap->jid, cap->job ? statename[cap->job->state] : "Done");
+	    if (cap->job == NULL)
+		printf(" %d", cap->status);
+	    printf(", %llu bytes", cap->total);
+	    if (cap->total > cap->size)
+		printf(" (%llu dropped)", cap->total - cap->size);
+	    printf(" %s", cap->cmdline);
+	}
+	free(list);
+	return 0;
+    }
+
+    if (!strcmp(argv[1], "-d")) {
+	if (argv[2] == NULL) {
+	    for (i = 0; i < captures.byjid.cap; i++) {
+		/* a drop shifts later entries back; look at slot i again */
+		while (captures.byjid.keys[i] &&
+		       ((struct capture_t *)captures.byjid.vals[i])->job == NULL)
+		    capture_drop(captures.byjid.vals[i]);
+	    }
+	    return 0;
+	}
+	for (k = 2; argv[k]; k++) {
+	    if (argv[k][0] != '%' ||
+		(cap = intmap_get(&captures.byjid, atoi(&argv[k][1]))) == NULL) {
+		printf("output: %s: no captured output\n", argv[k]);
+		status = 1;
+	    }
+	    else if (cap->job) {
+		printf("output: %s: job is still running\n", argv[k]);
+		status = 1;
+	    }
+	    else
+		capture_drop(cap);
+	}
+	return status;
+    }
+
+    if (argv[1][0] != '%' || (argv[2] && strcmp(argv[2], "--follow"))) {
+	printf("usage: output [%%jobid [--follow] | -d [%%jobid...]]\n");
+	return 2;
+    }
+    if ((cap = intmap_get(&captures.byjid, atoi(&argv[1][1]))) == NULL) {
+	printf("output: %s: no captured output\n", argv[1]);
+	return 1;
+    }
+    if (cap->fd >= 0)
+	capture_read(cap);
+    at = capture_print(cap, 0);
+    if (argv[2] == NULL)
+	return 0;
+
+    /* the capture cannot be dropped while we wait here */
+    sigint_pending = 0;
+    while (cap->fd >= 0 && !sigint_pending) {
+	eventloop_wait(-1, 0);
+	at = capture_print(cap, at);
+    }
+    return sigint_pending ? 130 : 0;
+}
+
+/*********************
+ * End output capture
+ *********************/
+
+/**************
+ * Server mode
+ **************/
+
+/*
+ * serve - Run the command server on the Unix socket at path; never
+ *    returns.
+ *
+ *    Clients send command lines, one per line, and may send any number
+ *    before the first finishes.  Each line is run by eval() as a
+ *    background job (so fg and wait hold up every client).  Each
+ *    request gets its replies tagged with its number on the connection,
+ *    counting from 1:
+ *        <n> job <jid> <pgid>        a job was started for it
+ *        <n> queued <jid>            ... or queued by submit
+ *        <n> done <jid> <status> <real> <user> <sys> <maxrss>
+ *                                    it finished (jid 0: nothing was
+ *                                    started, e.g. a builtin)
+ *    The commands' own output goes to the shell's stdout.  ctrl-c stops
+ *    the server.
+ */
+void serve(const char *path)
+{
+    struct sockaddr_un sa;
+    struct epoll_event ev;
+
+    if (strlen(path) >= sizeof(sa.sun_path))
+	app_error("socket path too long");
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    if ((server.fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0)
+	unix_error("socket error");
+    if (bind(server.fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	listen(server.fd, SOMAXCONN) < 0)
+	unix_error(sa.sun_path);
+    server.path = path;
+    server.owner = getpid();
+    atexit(serve_unlink);
+
+    /* The sockets have an epoll set of their own, which sits in the
+     * event loop's set and can be taken out while a request runs */
+    if ((server.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	unix_error("epoll_create1 error");
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = server.fd;
+    if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.fd, &ev) < 0)
+	unix_error("epoll_ctl error");
+    ev.data.fd = server.epfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server.epfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+
+    sigint_pending = 0;
+    while (!sigint_pending)
+	eventloop_wait(-1, 0);
+    exit(0);
+}
+
+/* serve_unlink - Remove the socket when the server exits */
+void serve_unlink(void)
+{
+    if (server.path && getpid() == server.owner)
+	unlink(server.path);
+}
+
+/*
+ * serve_poll - Handle the sockets that are ready.  A request that waits
+ *    in the event loop (wait, fg) must not have more requests run under
+ *    it, so the server's set leaves the loop until that request is done.
+ */
+void serve_poll(void)
+{
+    struct epoll_event evs[16];
+    int i, n;
+
+    if (server.serving) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, server.epfd, NULL);
+	server.paused = 1;
+	return;
+    }
+    n = epoll_wait(server.epfd, evs, 16, 0);
+    for (i = 0; i < n; i++)
+	serve_event(evs[i].data.fd, evs[i].events);
+}
+
+/* serve_event - Handle activity on the listening socket or a client */
+void serve_event(int fd, uint32_t events)
+{
+    struct client_t *c;
+    struct epoll_event ev;
+    char *nl, *p;
+    ssize_t n;
+    int cfd;
+
+    if (fd == server.fd) {
+	while ((cfd = accept4(server.fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+	    if ((c = calloc(1, sizeof(*c))) == NULL)
+		unix_error("calloc error");
+	    c->fd = cfd;
+	    intmap_put(&server.clients, cfd, c);
+	    memset(&ev, 0, sizeof(ev));
+	    ev.events = EPOLLIN;
+	    ev.data.fd = cfd;
+	    if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, cfd, &ev) < 0)
+		unix_error("epoll_ctl error");
+	}
+	return;
+    }
+    if ((c = intmap_get(&server.clients, fd)) == NULL)
+	return;
+
+    if ((events & EPOLLOUT) && !serve_flush(c))
+	return;
+    if (!(events & (EPOLLIN|EPOLLHUP|EPOLLERR)) || c->eof)
+	return;
+
+    /* Take what has arrived and run every complete line */
+    for (;;) {
+	if (c->incap - c->inlen < 4096) {
+	    c->incap = c->incap ? 2 * c->incap : 8192;
+	    if ((c->in = realloc(c->in, c->incap)) == NULL)
+		unix_error("realloc error");
+	}
+	if ((n = read(c->fd, c->in + c->inlen, c->incap - c->inlen)) <= 0)
+	    break;
+	c->inlen += n;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+	serve_close(c);
+	return;
+    }
+    for (p = c->in; (nl = memchr(p, '\n', c->in + c->inlen - p)) != NULL; p = nl + 1) {
+	serve_request(c, p, nl + 1 - p);
+	/* the client is gone if a reply could not be sent */
+	if (intmap_get(&server.clients, fd) != c)
+	    return;
+    }
+    c->inlen -= p - c->in;
+    memmove(c->in, p, c->inlen);
+
+    /* At end of input the connection lives on until every job has
+     * reported back */
+    if (n == 0) {
+	c->eof = 1;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = c->outlen ? EPOLLOUT : 0;
+	ev.data.fd = c->fd;
+	epoll_ctl(server.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	if (c->pending == 0 && c->outlen == 0)
+	    serve_close(c);
+    }
+}
+
+/* serve_request - Run one command line received from c */
+void serve_request(struct client_t *c, const char *line, size_t len)
+{
+    char buf[128];
+    int n;
+
+    c->seq++;
+    server.serving = c;
+    server.lastjob = NULL;
+    eval(line, len);
+    server.serving = NULL;
+    if (server.paused) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = server.epfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, server.epfd, &ev);
+	server.paused = 0;
+    }
+    if (intmap_get(&server.clients, c->fd) != c)
+	return;
+    if (server.lastjob && server.lastjob->state == QU) {
+	n = snprintf(buf, sizeof(buf), "%lu queued %d\n", c->seq, server.lastjob->jid);
+	serve_send(c, buf, n);
+    }
+    else if (server.lastjob) {
+	n = snprintf(buf, sizeof(buf), "%lu job %d %d\n",
+		     c->seq, server.lastjob->jid, server.lastjob->pid);
+	serve_send(c, buf, n);
+    }
+    else {
+	n = snprintf(buf, sizeof(buf), "%lu done 0 %d 0.000 0.000 0.000 0\n", c->seq, exitstatus);
+	serve_send(c, buf, n);
+    }
+}
+
+/* serve_done - Report to its client that job has finished */
+void serve_done(struct job_t *job)
+{
+    struct client_t *c = job->client;
+    char buf[192];
+    int n;
+
+    job->client = NULL;
+    c->pending--;
+    n = snprintf(buf, sizeof(buf), "%lu done %d %d %.3f %.3f %.3f %ld\n",
+		 job->tag, job->jid, job->status,
+		 job->end.tv_sec ? tsdiff(&job->end, &job->start) : 0.0,
+		 job->ru.ru_utime.tv_sec + job->ru.ru_utime.tv_usec / 1e6,
+		 job->ru.ru_stime.tv_sec + job->ru.ru_stime.tv_usec / 1e6,
+		 job->ru.ru_maxrss);
+    serve_send(c, buf, n);
+}
+
+/* serve_send - Queue a reply for c and send what the socket takes */
+void serve_send(struct client_t *c, const char *buf, size_t n)
+{
+    if (c->outcap - c->outlen < n) {
+	while (c->outcap - c->outlen < n)
+	    c->outcap = c->outcap ? 2 * c->outcap : 4096;
+	if ((c->out = realloc(c->out, c->outcap)) == NULL)
+	    unix_error("realloc error");
+    }
+    memcpy(c->out + c->outlen, buf, n);
+    c->outlen += n;
+    /* replies made while a request runs go out together after it */
+    if (server.serving != c)
+	serve_flush(c);
+}
+
+/* serve_flush - Write c's queued replies, watching for EPOLLOUT if the
+ *    socket is full.  Returns 0 if c was closed. */
+int serve_flush(struct client_t *c)
+{
+    struct epoll_event ev;
+    ssize_t n;
+    size_t off = 0;
+
+    while (off < c->outlen) {
+	if ((n = send(c->fd, c->out + off, c->outlen - off, MSG_NOSIGNAL)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN)
+		break;
+	    serve_close(c);
+	    return 0;
+	}
+	off += n;
+    }
+    c->outlen -= off;
+    memmove(c->out, c->out + off, c->outlen);
+
+    if (c->eof && c->pending == 0 && c->outlen == 0) {
+	serve_close(c);
+	return 0;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (c->eof ? 0 : EPOLLIN) | (c->outlen ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    epoll_ctl(server.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 1;
+}
+
+/* serve_close - Drop a client; its jobs keep running unreported */
+void serve_close(struct client_t *c)
+{
+    struct job_t *job;
+
+    for (job = jobs.head; job && c->pending > 0; job = job->next)
+	if (job->client == c) {
+	    job->client = NULL;
+	    c->pending--;
+	}
+    intmap_del(&server.clients, c->fd);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+/******************
+ * End server mode
+ ******************/
+
+/******************
+ * Shell variables
+ ******************/
+
+/*
+ * Variables live in a chained hash table, each as one "NAME=value"
+ * string.  The envp handed to execve is an array of pointers to the
+ * exported ones; it is rebuilt only after an exported variable has
+ * changed, so a script that keeps setting shell variables does not make
+ * every exec pay for a new environment.
+ */
+
+/* initvars - Import the environment, every variable exported */
+void initvars(void)
+{
+    char **e;
+
+    for (e = environ; *e; e++)
+	if (namelen(*e) > 0 && (*e)[namelen(*e)] == '=')
+	    setvar(*e, namelen(*e), *e + namelen(*e) + 1, 1);
+}
+
+/* namelen - Length of the variable name at the start of s (0 if none) */
+size_t namelen(const char *s)
+{
+    size_t n;
+
+    for (n = 0; s[n] == '_' || isalpha((unsigned char)s[n]) ||
+	     (n > 0 && isdigit((unsigned char)s[n])); n++)
+	;
+    return n;
+}
+
+/* findvar - The variable whose name is the len bytes at name, or NULL */
+struct var_t *findvar(const char *name, size_t len)
+{
+    struct var_t *v;
+
+    if (vars.nbuckets == 0)
+	return NULL;
+    for (v = vars.buckets[hashmem(name, len) & (vars.nbuckets - 1)]; v; v = v->next)
+	if (v->namelen == len && !memcmp(v->str, name, len))
+	    return v;
+    return NULL;
+}
+
+/* getvar - Value of the variable name, or NULL if it is not set */
+const char *getvar(const char *name)
+{
+    struct var_t *v = findvar(name, strlen(name));
+
+    return v ? v->str + v->namelen + 1 : NULL;
+}
+
+/*
+ * setvar - Set the variable named by the len bytes at name to value.
+ *    export is 1 to export it, -1 to keep it exported only if it already
+ *    was.  Changing $PATH empties the command cache.
+ */
+void setvar(const char *name, size_t len, const char *value, int export)
+{
+    struct var_t *v, *next, **old;
+    size_t vlen = strlen(value), i, n;
+
+    if ((v = findvar(name, len)) == NULL) {
+	if (vars.count + 1 > vars.nbuckets) {
+	    /* double the table and rehash */
+	    old = vars.buckets;
+	    n = vars.nbuckets;
+	    vars.nbuckets = n ? 2 * n : 64;
+	    if ((vars.buckets = calloc(vars.nbuckets, sizeof(*vars.buckets))) == NULL)
+		unix_error("calloc error");
+	    for (i = 0; i < n; i++) {
+		for (v = old[i]; v; v = next) {
+		    next = v->next;
+		    v->next = vars.buckets[hashmem(v->str, v->namelen) & (vars.nbuckets - 1)];
+		    vars.buckets[hashmem(v->str, v->namelen) & (vars.nbuckets - 1)] = v;
+		}
+	    }
+	    free(old);
+	}
+	if ((v = calloc(1, sizeof(*v))) == NULL)
+	    unix_error("calloc error");
+	v->namelen = len;
+	i = hashmem(name, len) & (vars.nbuckets - 1);
+	v->next = vars.buckets[i];
+	vars.buckets[i] = v;
+	vars.count++;
+    }
+    else if (v->namelen + 1 + vlen == strlen(v->str) &&
+	     !memcmp(v->str + len + 1, value, vlen) && (export < 0 || v->exported)) {
+	return;  /* unchanged */
+    }
+
+    /* a new string, since the current envp may still point at the old one */
+    free(v->str);
+    if ((v->str = malloc(len + vlen + 2)) == NULL)
+	unix_error("malloc error");
+    memcpy(v->str, name, len);
+    v->str[len] = '=';
+    memcpy(v->str + len + 1, value, vlen + 1);
+    if (export > 0 && !v->exported) {
+	v->exported = 1;
+	vars.nexported++;
+    }
+    if (v->exported)
+	vars.envdirty = 1;
+    if (len == 4 && !memcmp(name, "PATH", 4)) {
+	free(cmdhash.pathvar);
+	cmdhash.pathvar = NULL;
+    }
+}
+
+/* unsetvar - Remove the variable name.  Returns 0 if it was not set. */
+int unsetvar(const char *name)
+{
+    struct var_t **vp, *v;
+    size_t len = strlen(name);
+
+    if (vars.nbuckets == 0)
+	return 0;
+    for (vp = &vars.buckets[hashmem(name, len) & (vars.nbuckets - 1)]; (v = *vp); vp = &v->next) {
+	if (v->namelen != len || memcmp(v->str, name, len))
+	    continue;
+	*vp = v->next;
+	vars.count--;
+	if (v->exported) {
+	    vars.nexported--;
+	    vars.envdirty = 1;
+	}
+	if (len == 4 && !memcmp(name, "PATH", 4)) {
+	    free(cmdhash.pathvar);
+	    cmdhash.pathvar = NULL;
+	}
+	free(v->str);
+	free(v);
+	return 1;
+    }
+    return 0;
+}
+
+/* envsnapshot - The environment for the commands the shell runs */
+char **envsnapshot(void)
+{
+    struct var_t *v;
+    size_t i, n = 0;
+
+    if (vars.envp && !vars.envdirty)
+	return vars.envp;
+    if ((vars.envp = realloc(vars.envp, (vars.nexported + 1) * sizeof(char *))) == NULL)
+	unix_error("realloc error");
+    for (i = 0; i < vars.nbuckets; i++)
+	for (v = vars.buckets[i]; v; v = v->next)
+	    if (v->exported)
+		vars.envp[n++] = v->str;
+    vars.envp[n] = NULL;
+    vars.envdirty = 0;
+    return vars.envp;
+}
+
+/**********************
+ * End shell variables
+ **********************/
+
+/*******************
+ * Builtin commands
+ *******************/
+
+/* The commands builtin_cmd runs inside the shell */
+struct builtin_t builtins[] = {
+    { "quit", do_quit },     { "jobs", do_jobs },     { "bg", do_bgfg },
+    { "fg", do_bgfg },       { "hash", do_hash },     { "cd", do_cd },
+    { "echo", do_echo },     { "printf", do_printf }, { "true", do_true },
+    { "false", do_false },   { "test", do_test },     { "[", do_test },
+    { "export", do_export }, { "kill", do_kill },     { "wait", do_wait },
+    { "stats", do_stats },   { "place", do_place },   { "history", do_history },
+    { "output", do_output },   { "unset", do_unset },
+    { NULL, NULL }
+};
+
+/*
+ * initbuiltins - Hash the builtin names into btab.  The table doubles
+ *    until no two names share a slot, so a lookup is one hash and at
+ *    most one strcmp.
+ */
+void initbuiltins(void)
+{
+    struct builtin_t *b;
+    size_t size, i;
+
+    for (size = 16; ; size *= 2) {
+	free(btab);
+	if ((btab = calloc(size, sizeof(*btab))) == NULL)
+	    unix_error("calloc error");
+	for (b = builtins; b->name; b++) {
+	    i = hashname(b->name) & (size - 1);
+	    if (btab[i])
+		break;
+	    btab[i] = b;
+	}
+	if (b->name == NULL)
+	    break;
+    }
+    bmask = size - 1;
+}
+
+/* findbuiltin - Return the builtin called name, or NULL */
+struct builtin_t *findbuiltin(const char *name)
+{
+    struct builtin_t *b;
+
+    if (btab == NULL)
+	initbuiltins();
+    b = btab[hashname(name) & bmask];
+    return b && !strcmp(b->name, name) ? b : NULL;
+}
+
+/*
+ * redirect_save - Before cmd's redirections are applied to the shell,
+ *    copy each descriptor they replace to a close-on-exec descriptor
+ *    above 9 (copies[i] = -1 if fds[i] was not open).  Returns the
+ *    number of descriptors saved.
+ */
+int redirect_save(struct cmd_t *cmd, int *fds, int *copies)
+{
+    int i, j, n = 0;
+
+    for (i = 0; i < cmd->nredirs; i++) {
+	for (j = 0; j < n && fds[j] != cmd->redirs[i].fd; j++)
+	    ;
+	if (j < n)
+	    continue;
+	fds[n] = cmd->redirs[i].fd;
+	copies[n++] = fcntl(cmd->redirs[i].fd, F_DUPFD_CLOEXEC, 10);
+    }
+    return n;
+}
+
+/* redirect_restore - Put back the descriptors saved by redirect_save */
+void redirect_restore(int *fds, int *copies, int n)
+{
+    while (--n >= 0) {
+	if (copies[n] < 0) {
+	    close(fds[n]);
+	    continue;
+	}
+	dup2(copies[n], fds[n]);
+	close(copies[n]);
+    }
+}
+
+/* do_quit - Execute the builtin quit command */
+int do_quit(char **argv)
+{
+    exit(0);
+}
+
+/*
+ * do_cd - Execute the builtin cd command: cd [dir | -]
+ *    With no argument it goes to $HOME, with - to $OLDPWD.  PWD and
+ *    OLDPWD are updated.
+ */
+int do_cd(char **argv)
+{
+    const char *dir = argv[1], *old = getvar("PWD");
+    char buf[PATH_MAX];
+    int i, back = 0;
+
+    if (dir == NULL && (dir = getvar("HOME")) == NULL) {
+	printf("cd: HOME not set\n");
+	return 1;
+    }
+    if (!strcmp(dir, "-")) {
+	if ((dir = getvar("OLDPWD")) == NULL) {
+	    printf("cd: OLDPWD not set\n");
+	    return 1;
+	}
+	back = 1;
+    }
+    if (chdir(dir) < 0) {
+	printf("cd: %s: %s\n", dir, strerror(errno));
+	return 1;
+    }
+    if (back)
+	printf("%s\n", dir);
+    if (old)
+	setvar("OLDPWD", 6, old, 1);
+    if (getcwd(buf, sizeof(buf)))
+	setvar("PWD", 3, buf, 1);
+
+    /* relative $PATH entries were opened from the old directory */
+    for (i = 0; i < cmdhash.ndirs; i++) {
+	if (cmdhash.dirs[i].path[0] != '/') {
+	    free(cmdhash.pathvar);
+	    cmdhash.pathvar = NULL;
+	    cmdhash_reset();
+	    break;
+	}
+    }
+    return 0;
+}
+
+/* do_echo - Execute the builtin echo command: echo [-n] [arg...] */
+int do_echo(char **argv)
+{
+    int i = 1, newline = 1;
+
+    if (argv[1] && !strcmp(argv[1], "-n")) {
+	newline = 0;
+	i++;
+    }
+    for (; argv[i]; i++) {
+	fputs(argv[i], stdout);
+	if (argv[i+1])
+	    putchar(' ');
+    }
+    if (newline)
+	putchar('\n');
+    return 0;
+}
+
+/*
+ * do_printf - Execute the builtin printf command: printf format [arg...]
+ *    The format may use the usual backslash escapes and the conversions
+ *    %s %b %c %d %i %u %o %x %X and %%, with flags, width and precision.
+ *    It is reused until every argument has been consumed; missing
+ *    arguments print as "" or 0.
+ */
+int do_printf(char **argv)
+{
+    const char *f, *arg, *p;
+    char spec[32], *end;
+    char **next = argv + 2, **start;
+    long long v;
+    int n, status = 0;
+
+    if (argv[1] == NULL) {
+	printf("usage: printf format [arg...]\n");
+	return 2;
+    }
+    do {
+	start = next;
+	for (f = argv[1]; *f; f++) {
+	    if (*f == '\\') {
+		f = putescape(f);
+		continue;
+	    }
+	    if (*f != '%') {
+		putchar(*f);
+		continue;
+	    }
+	    if (f[1] == '%') {
+		putchar('%');
+		f++;
+		continue;
+	    }
+
+	    /* copy "%flags width.precision" and add the length modifier */
+	    n = strspn(f + 1, "-+ #0123456789.");
+	    if (n > 20 || f[n+1] == '\0' || !strchr("sbcdiuoxX", f[n+1])) {
+		printf("printf: %.*s: invalid conversion\n", n + 2, f);
+		return 1;
+	    }
+	    memcpy(spec, f, n + 1);
+	    f += n + 1;
+	    arg = *next ? *next++ : NULL;
+	    switch (*f) {
+	    case 's':
+		strcpy(spec + n + 1, "s");
+		printf(spec, arg ? arg : "");
+		break;
+	    case 'b':
+		for (p = arg; p && *p; p++) {
+		    if (*p == '\\')
+			p = putescape(p);
+		    else
+			putchar(*p);
+		}
+		break;
+	    case 'c':
+		strcpy(spec + n + 1, "c");
+		if (arg && *arg)
+		    printf(spec, *arg);
+		break;
+	    default:
+		/* numbers: decimal, 0x hex, 0 octal, or 'c for a character code */
+		v = 0;
+		if (arg && (*arg == '\'' || *arg == '"'))
+		    v = (unsigned char)arg[1];
+		else if (arg) {
+		    errno = 0;
+		    v = strtoll(arg, &end, 0);
+		    if (end == arg || *end != '\0' || errno) {
+			printf("printf: %s: invalid number\n", arg);
+			status = 1;
+		    }
+		}
+		spec[n+1] = 'l';
+		spec[n+2] = 'l';
+		spec[n+3] = *f;
+		spec[n+4] = '\0';
+		printf(spec, v);
+		break;
+	    }
+	}
+    } while (*next && next != start);
+    return status;
+}
+
+/*
+ * putescape - Print the backslash escape starting at p (\n, \t, \\,
+ *    \0nnn and the like) and return a pointer to its last character.
+ */
+const char *putescape(const char *p)
+{
+    static const char from[] = "abefnrtv\\", to[] = "\a\b\033\f\n\r\t\v\\";
+    const char *e;
+    int c = 0, i;
+
+    p++;
+    if (*p == '\0') {
+	putchar('\\');
+	return p - 1;
+    }
+    if ((e = strchr(from, *p)) != NULL) {
+	putchar(to[e - from]);
+	return p;
+    }
+    if (*p >= '0' && *p <= '7') {
+	/* \0nnn or \nnn */
+	if (*p == '0')
+	    p++;
+	for (i = 0; i < 3 && *p >= '0' && *p <= '7'; i++)
+	    c = c * 8 + *p++ - '0';
+	putchar(c);
+	return p - 1;
+    }
+    putchar('\\');
+    putchar(*p);
+    return p;
+}
+
+/* do_true, do_false - Execute the builtin true and false commands */
+int do_true(char **argv)
+{
+    return 0;
+}
+
+int do_false(char **argv)
+{
+    return 1;
+}
+
+/*
+ * do_test - Execute the builtin test command, also spelled [ ... ].
+ *    Follows the POSIX rules for up to four arguments: ! negates, one
+ *    argument is true if it is not empty, and the operators are
+ *        -n -z string, -e -f -d -r -w -x -s -L -h file,
+ *        s1 = s2, s1 != s2, n1 -eq -ne -lt -le -gt -ge n2.
+ *    Returns 0 for true, 1 for false, 2 for a usage error.
+ */
+int do_test(char **argv)
+{
+    int argc, r;
+
+    for (argc = 0; argv[argc]; argc++)
+	;
+    if (!strcmp(argv[0], "[")) {
+	if (strcmp(argv[argc-1], "]")) {
+	    printf("[: missing `]'\n");
+	    return 2;
+	}
+	argc--;
+    }
+    if ((r = testexpr(argv + 1, argc - 1)) < 0)
+	return 2;
+    return !r;
+}
+
+/* testexpr - Evaluate the n words of a test expression: 1 if it is
+ *    true, 0 if false, -1 after printing an error */
+int testexpr(char **av, int n)
+{
+    int r;
+
+    if (n == 0)
+	return 0;
+    if (n == 1)
+	return av[0][0] != '\0';
+    if (n == 3 && (r = testbinary(av[0], av[1], av[2])) != -2)
+	return r;
+    if (!strcmp(av[0], "!")) {
+	r = testexpr(av + 1, n - 1);
+	return r < 0 ? r : !r;
+    }
+    if (n == 2)
+	return testunary(av[0], av[1]);
+    printf("test: too many arguments\n");
+    return -1;
+}
+
+/* testunary - Evaluate "op arg": 1, 0, or -1 after an error */
+int testunary(const char *op, const char *arg)
+{
+    struct stat st;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+	printf("test: %s: unary operator expected\n", op);
+	return -1;
+    }
+    switch (op[1]) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'L':
+    case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'e': return stat(arg, &st) == 0;
+    case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+    }
+    printf("test: %s: unary operator expected\n", op);
+    return -1;
+}
+
+/* testbinary - Evaluate "a op b": 1, 0, -1 after an error, or -2 if op
+ *    is not a binary operator */
+int testbinary(const char *a, const char *op, const char *b)
+{
+    static const char *ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL };
+    long long x, y;
+    char *end;
+    int i;
+
+    if (!strcmp(op, "="))
+	return strcmp(a, b) == 0;
+    if (!strcmp(op, "!="))
+	return strcmp(a, b) != 0;
+    for (i = 0; ops[i] && strcmp(op, ops[i]); i++)
+	;
+    if (ops[i] == NULL)
+	return -2;
+
+    x = strtoll(a, &end, 10);
+    if (end == a || *end != '\0') {
+	printf("test: %s: integer expression expected\n", a);
+	return -1;
+    }
+    y = strtoll(b, &end, 10);
+    if (end == b || *end != '\0') {
+	printf("test: %s: integer expression expected\n", b);
+	return -1;
+    }
+    switch (i) {
+    case 0: return x == y;
+    case 1: return x != y;
+    case 2: return x < y;
+    case 3: return x <= y;
+    case 4: return x > y;
+    default: return x >= y;
+    }
+}
+
+/*
+ * do_export - Execute the builtin export command
+ *    export              print the exported variables
+ *    export name[=value] pass name (set to value) to later commands
+ */
+int do_export(char **argv)
+{
+    struct var_t *v;
+    char **e;
+    size_t n;
+    int i, status = 0;
+
+    if (argv[1] == NULL) {
+	for (e = envsnapshot(); *e; e++)
+	    printf("export %s\n", *e);
+	return 0;
+    }
+    for (i = 1; argv[i]; i++) {
+	/* name must be a letter or _ followed by letters, digits or _ */
+	n = namelen(argv[i]);
+	if (n == 0 || (argv[i][n] != '\0' && argv[i][n] != '=')) {
+	    printf("export: `%s': not a valid identifier\n", argv[i]);
+	    status = 1;
+	    continue;
+	}
+	if (argv[i][n] == '=')
+	    setvar(argv[i], n, argv[i] + n + 1, 1);
+	else if ((v = findvar(argv[i], n)) != NULL && !v->exported) {
+	    v->exported = 1;
+	    vars.nexported++;
+	    vars.envdirty = 1;
+	}
+    }
+    return status;
+}
+
+/* do_unset - Execute the builtin unset command: unset name... */
+int do_unset(char **argv)
+{
+    int i;
+
+    for (i = 1; argv[i]; i++)
+	unsetvar(argv[i]);
+    return 0;
+}
+
+/*
+ * do_kill - Execute the builtin kill command
+ *    kill [-s sig | -sig] pid | %jobid ...
+ *    kill -l
+ *    A signal may be given by number or name (TERM or SIGTERM); the
+ *    default is SIGTERM.  A job is signalled as a whole process group,
+ *    and a stopped job is continued so that it can act on the signal.
+ */
+int do_kill(char **argv)
+{
+    struct job_t *job;
+    int i = 1, sig = SIGTERM, status = 0;
+
+    if (argv[1] && !strcmp(argv[1], "-l")) {
+	for (sig = 1; sig < NSIG; sig++)
+	    if (sigabbrev_np(sig))
+		printf("%2d) SIG%s\n", sig, sigabbrev_np(sig));
+	return 0;
+    }
+    if (argv[1] && !strcmp(argv[1], "-s") && argv[2]) {
+	sig = signum(argv[2]);
+	i = 3;
+    }
+    else if (argv[1] && argv[1][0] == '-') {
+	sig = signum(argv[1] + 1);
+	i = 2;
+    }
+    if (sig < 0) {
+	printf("kill: %s: invalid signal specification\n", argv[i-1]);
+	return 1;
+    }
+    if (argv[i] == NULL) {
+	printf("usage: kill [-s sig | -sig] pid | %%jobid ... or kill -l\n");
+	return 2;
+    }
+
+    for (; argv[i]; i++) {
+	if (argv[i][0] == '%') {
+	    if ((job = getjobjid(&jobs, atoi(&argv[i][1]))) == NULL) {
+		printf("%s: No such job\n", argv[i]);
+		status = 1;
+		continue;
+	    }
+	    //a job that has not started yet just leaves the queue
+	    if (job->state == QU) {
+		if (sig != 0 && sig != SIGCONT) {
+		    job->status = 128 + sig;
+		    removejob(&jobs, job);
+		}
+		continue;
+	    }
+	    signaljob(job, sig);
+	    if (job->state == ST && sig != SIGCONT && sig != SIGSTOP && sig != SIGTSTP)
+		signaljob(job, SIGCONT);
+	    continue;
+	}
+	if (!isdigit((unsigned char)argv[i][0])) {
+	    printf("kill: %s: arguments must be process or job IDs\n", argv[i]);
+	    status = 1;
+	    continue;
+	}
+	if (kill(atoi(argv[i]), sig) < 0) {
+	    printf("kill: (%s) - %s\n", argv[i], strerror(errno));
+	    status = 1;
+	}
+    }
+    return status;
+}
+
+/* signum - Signal number for a number or a name with or without SIG,
+ *    or -1 */
+int signum(const char *name)
+{
+    int sig;
+
+    if (isdigit((unsigned char)name[0]))
+	return (sig = atoi(name)) < NSIG ? sig : -1;
+    if (!strncmp(name, "SIG", 3))
+	name += 3;
+    for (sig = 1; sig < NSIG; sig++)
+	if (sigabbrev_np(sig) && !strcmp(sigabbrev_np(sig), name))
+	    return sig;
+    return -1;
+}
+
+/*
+ * do_wait - Execute the builtin wait command
+ *
+ *    wait [-n] [-t seconds] [pid | %jobid ...]
+ *
+ *    Waits until the given jobs (all running background and queued jobs
+ *    if none are given) have finished or stopped, or with -n until the
+ *    first of them has.  The pidfds of their processes are watched by
+ *    the event loop alongside SIGCHLD.  Returns the status of the last
+ *    job (the first to finish with -n), 128 plus the signal for one that
+ *    stopped, 127 if a job does not exist (or -n has none to wait for),
+ *    124 when the timeout expires and 130 when interrupted by ctrl-c.
+ */
+int do_wait(char **argv)
+{
+    struct job_t **wj;
+    struct epoll_event ev;
+    long long deadline = -1, left;
+    int *st, i, k, n = 0, any = 0, ndone, first = -1, status = 0;
+    struct job_t *job;
+    char *end;
+
+    for (k = 1; argv[k] && argv[k][0] == '-' && argv[k][1]; k++) {
+	if (!strcmp(argv[k], "-n"))
+	    any = 1;
+	else if (!strcmp(argv[k], "-t") && argv[k+1]) {
+	    deadline = now_ns() + (long long)(strtod(argv[++k], &end) * 1e9);
+	    if (*end != '\0') {
+		printf("wait: %s: invalid timeout\n", argv[k]);
+		return 2;
+	    }
+	}
+	else {
+	    printf("usage: wait [-n] [-t seconds] [pid | %%jobid ...]\n");
+	    return 2;
+	}
+    }
+
+    /* Collect the jobs; each reports its status into st when removed */
+    for (i = k; argv[i]; i++)
+	n++;
+    n += jobs.count;
+    wj = malloc((n + 1) * sizeof(*wj));
+    st = malloc((n + 1) * sizeof(*st));
+    if (wj == NULL || st == NULL)
+	unix_error("malloc error");
+    n = 0;
+    if (argv[k] == NULL) {
+	for (job = jobs.head; job; job = job->next)
+	    if (job->state == BG || job->state == QU)
+		wj[n++] = job;
+    }
+    for (; argv[k]; k++) {
+	if ((job = waitarg(argv[k])) == NULL) {
+	    printf("wait: %s: no such job\n", argv[k]);
+	    status = 127;
+	    continue;
+	}
+	wj[n++] = job;
+    }
+    for (i = 0; i < n; i++) {
+	st[i] = -1;
+	if (wj[i]->waitst)  /* listed twice */
+	    wj[i] = NULL;
+	else
+	    wj[i]->waitst = &st[i];
+    }
+    for (i = 0; i < n; i++) {
+	if (wj[i] == NULL)
+	    continue;
+	for (k = 0; k < wj[i]->nprocs; k++) {
+	    if (wj[i]->procs[k].done || wj[i]->procs[k].pidfd < 0)
+		continue;
+	    memset(&ev, 0, sizeof(ev));
+	    ev.events = EPOLLIN;
+	    ev.data.fd = wj[i]->procs[k].pidfd;
+	    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == 0)
+		intmap_put(&waitfds, ev.data.fd, wj[i]);
+	}
+    }
+
+    sigint_pending = 0;
+    for (;;) {
+	/* a job that stopped counts as done; removed jobs have set st */
+	for (i = ndone = 0; i < n; i++) {
+	    if (wj[i] && st[i] < 0 && wj[i]->state == ST) {
+		st[i] = 128 + wj[i]->stopsig;
+		wj[i]->waitst = NULL;
+	    }
+	    if (wj[i] == NULL || st[i] >= 0) {
+		ndone++;
+		if (first < 0 && wj[i])
+		    first = i;
+	    }
+	}
+	if (ndone == n || (any && first >= 0) || sigint_pending)
+	    break;
+	left = -1;
+	if (deadline >= 0 && (left = deadline - now_ns()) <= 0)
+	    break;
+	eventloop_wait(left < 0 ? -1 : (int)((left + 999999) / 1000000), 0);
+    }
+
+    /* Stop watching; jobs still running forget about st */
+    for (i = 0; i < n; i++) {
+	if (wj[i] == NULL || st[i] >= 0)
+	    continue;
+	wj[i]->waitst = NULL;
+	for (k = 0; k < wj[i]->nprocs; k++)
+	    if (!wj[i]->procs[k].done && wj[i]->procs[k].pidfd >= 0 &&
+		intmap_get(&waitfds, wj[i]->procs[k].pidfd)) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, wj[i]->procs[k].pidfd, NULL);
+		intmap_del(&waitfds, wj[i]->procs[k].pidfd);
+	    }
+    }
+
+    if (sigint_pending)
+	status = 130;
+    else if (any && n == 0)
+	status = 127;
+    else if (any ? first < 0 && n > 0 : ndone < n)
+	status = 124;
+    else if (any && first >= 0)
+	status = st[first];
+    else if (status == 0) {
+	for (i = n - 1; i >= 0 && wj[i] == NULL; i--)
+	    ;
+	if (i >= 0)
+	    status = st[i];
+    }
+    free(wj);
+    free(st);
+    return status;
+}
+
+/* waitarg - The job named by a wait argument (pid or %jobid), or NULL */
+struct job_t *waitarg(const char *arg)
+{
+    if (arg[0] == '%')
+	return getjobjid(&jobs, atoi(&arg[1]));
+    return getjobpid(&jobs, atoi(arg));
+}
+
+/***********************
+ * End builtin commands
+ ***********************/
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/*
+ * The handlers below are not installed with sigaction. Their signals are
+ * kept blocked and read from sigfd by eventloop_wait(), which calls the
+ * matching handler synchronously, so they may use stdio and modify the
+ * job list freely.
+ */
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.  
+ */
+//Got advices from David (TA) to write the following code lines
+void sigchld_handler(int sig) 
+{
+    pid_t pid;
+    int child_status;
+    struct rusage ru;
+    struct job_t *job;
+
+    //Call wait4 (waitpid plus the child's resource usage) to reap any child in the wait set (Ref: Cs: APP pg.780)
+    //WNOHANG|WUNTRACED: return pid of terminated or stopped process/ other way, return 0 if no child process has stopped or terminated
+    while ((pid = wait4(-1, &child_status, WNOHANG|WUNTRACED, &ru)) > 0){
+        //Find the job this process belongs to (any command of its pipeline)
+        if ((job = getjobpid(&jobs, pid)) == NULL)
+            continue;
+        trace_post(TR_REAP, now_ns(), 0, pid, job->jid);
+        //if the child process that caused the return is currently stopped, return true
+        if(WIFSTOPPED(child_status)){
+            //Change job's state to stopped state, reporting the pipeline once
+            if (job->state != ST)
+                printf("Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, WSTOPSIG(child_status));
+            if (jobs.fg == job)
+                exitstatus = 128 + WSTOPSIG(child_status);
+            job->stopsig = WSTOPSIG(child_status);
+            setjobstate(&jobs, job, ST);
+            continue;
+        }
+        //if the child process terminated because of an uncaught signal, remember it
+        if(WIFSIGNALED(child_status))
+            job->termsig = WTERMSIG(child_status);
+        //the last command of a pipeline gives the job its status
+        if (pid == job->procs[job->nprocs-1].pid)
+            job->status = WIFEXITED(child_status) ? WEXITSTATUS(child_status) : 128 + WTERMSIG(child_status);
+        //the process exited or was killed: charge its usage to the job,
+        //which is done once every command is
+        rusage_add(&job->ru, &ru);
+        procdone(&jobs, job, pid);
+        //a parallel batch starts its next command as soon as one finishes
+        if (job->wq)
+            workq_reaped(job, child_status);
+        if (job->nlive == 0) {
+            if (job->termsig)
+                printf("Job [%d] (%d) terminated by signal %d%s\n", job->jid, job->pid, job->termsig,
+                       job->expired ? " (timed out)" : "");
+            else if (job->expired)
+                printf("Job [%d] (%d) timed out\n", job->jid, job->pid);
+            if (job->wq) {
+                workq_report(job->wq);
+                job->status = job->wq->failed != 0;
+            }
+            //a job that ran out of time has status 124, as with timeout(1)
+            if (job->expired)
+                job->status = 124;
+            if (jobs.fg == job)
+                exitstatus = job->status;
+            clock_gettime(CLOCK_MONOTONIC, &job->end);
+            if (job->timed || verbose)
+                jobusage(job);
+            //when it is true, delete that job 
+            deletejob(&jobs, job->pid);
         }
+    }
+
+    //a finished or stopped job may make room for a queued one
+    if (jobs.qhead)
+        admit_jobs();
+    return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.  The "terminated by signal" report is
+ *    printed by sigchld_handler once the job actually dies.
+ */
+void sigint_handler(int sig) 
+{
+   pid_t pid;
+   //Get pid of current foreground job
+   pid = fgpid(&jobs);
+   
+   //Either way the loop or list that is running stops
+   loopbreak = 1;
+
+   //If the pid is valid
+   if (pid > 0){
+       //A parallel batch stops handing out work as well
+       if (jobs.fg->wq)
+           jobs.fg->wq->aborted = 1;
+       //Send SIGINT signal to all processes that are running in a group
+       signaljob(jobs.fg, sig);
+   } 
+   //Otherwise it interrupts a builtin that is waiting (wait)
+   else
+       sigint_pending = 1;
+    return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.  The job is marked
+ *     stopped by sigchld_handler when the stop is reported.
+ */
+void sigtstp_handler(int sig) 
+{
+    pid_t pid;
+   //Get pid of current foreground job
+   pid = fgpid(&jobs);
+   
+   //If the pid is valid
+   if (pid > 0){
+       //Send SIGSTP signal to all processes that are running in a group
+       signaljob(jobs.fg, SIGTSTP);
+   } 
+    return;
+}
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/*******************
+ * Parallel batches
+ *******************/
+
+/*
+ * do_parallel - Execute the builtin parallel command
+ *
+ *    parallel [-j N] [-a file] command [arg...] [< file]
+ *
+ *    Runs command once per input line, with {} in the arguments replaced
+ *    by the line (or the line appended if there is no {}), keeping at
+ *    most N commands running (default: one per online CPU).  Input comes
+ *    from -a file, a < redirection, or stdin when the shell reads its
+ *    commands from a script file.  The batch is one job:
+ *    jobs lists it, fg/bg/ctrl-z apply to every running command, and
+ *    ctrl-c kills them and drops the rest of the queue.  The reaper
+ *    starts the next command as soon as one finishes.
+ */
+void do_parallel(struct pipeline_t *pl, const char *cmdline, size_t len)
+{
+    struct cmd_t *cmd = &pl->cmds[0];
+    struct workq_t *wq;
+    struct job_t *job;
+    char **argv = cmd->argv;
+    const char *argfile = NULL;
+    char *p, *nl;
+    size_t n = 0, cap = 0;
+    ssize_t rc;
+    pid_t pid;
+    int i, fd = STDIN_FILENO;
+
+    if ((wq = calloc(1, sizeof(*wq))) == NULL)
+	unix_error("calloc error");
+    clock_gettime(CLOCK_MONOTONIC, &wq->start);
+    wq->maxrun = sysconf(_SC_NPROCESSORS_ONLN);
+    if (pl->place) {
+	if ((wq->place = malloc(sizeof(struct place_t))) == NULL)
+	    unix_error("malloc error");
+	*wq->place = *pl->place;
+    }
+
+    for (i = 1; argv[i] && argv[i][0] == '-'; i++) {
+	if (!strcmp(argv[i], "-j") && argv[i+1])
+	    wq->maxrun = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-a") && argv[i+1])
+	    argfile = argv[++i];
+	else
+	    break;
+    }
+    if (argv[i] == NULL || wq->maxrun < 1) {
+	printf("usage: parallel [-j N] [-a file] command [arg...] [< file]\n");
+	workq_free(wq);
+	return;
+    }
+    wq->tmplc = cmd->argc - i;
+    if ((wq->tmpl = calloc(wq->tmplc + 1, sizeof(char *))) == NULL)
+	unix_error("calloc error");
+    for (n = 0; argv[i + n]; n++)
+	wq->tmpl[n] = strdup(argv[i + n]);
+
+    /* The input redirection names the item list; output redirections
+     * apply to every command (truncating once, then appending). */
+    if ((wq->redirs = calloc(cmd->nredirs + 1, sizeof(struct redir_t))) == NULL)
+	unix_error("calloc error");
+    for (i = 0; i < cmd->nredirs; i++) {
+	if (cmd->redirs[i].fd == STDIN_FILENO && cmd->redirs[i].path) {
+	    argfile = cmd->redirs[i].path;
+	    continue;
+	}
+	wq->redirs[wq->nredirs] = cmd->redirs[i];
+	if (cmd->redirs[i].path)
+	    wq->redirs[wq->nredirs].path = strdup(cmd->redirs[i].path);
+	if (cmd->redirs[i].flags & O_TRUNC) {
+	    if ((fd = open(cmd->redirs[i].path, cmd->redirs[i].flags|O_CLOEXEC, 0666)) < 0) {
+		perror(cmd->redirs[i].path);
+		workq_free(wq);
+		return;
+	    }
+	    close(fd);
+	    wq->redirs[wq->nredirs].flags = (cmd->redirs[i].flags & ~O_TRUNC) | O_APPEND;
+	}
+	wq->nredirs++;
+    }
+
+    /* Stdin is not free to read when the shell takes its commands from it:
+     * the items would be the command lines that follow */
+    if (argfile == NULL && input.fd == STDIN_FILENO) {
+	printf("parallel: no item list (use -a file or < file)\n");
+	workq_free(wq);
+	return;
+    }
+
+    /* Read the whole item list */
+    fd = STDIN_FILENO;
+    if (argfile && (fd = open(argfile, O_RDONLY|O_CLOEXEC)) < 0) {
+	perror(argfile);
+	workq_free(wq);
+	return;
+    }
+    n = 0;
+    do {
+	if (cap - n < 65536) {
+	    cap = cap ? 2 * cap : 262144;
+	    if ((wq->itembuf = realloc(wq->itembuf, cap + 1)) == NULL)
+		unix_error("realloc error");
+	}
+	if ((rc = read(fd, wq->itembuf + n, cap - n)) > 0)
+	    n += rc;
+    } while (rc > 0 || (rc < 0 && errno == EINTR));
+    if (fd != STDIN_FILENO)
+	close(fd);
+    wq->itembuf[n] = '\0';
+
+    /* Split it into lines, skipping empty ones */
+    for (p = wq->itembuf; p < wq->itembuf + n; p = nl + 1) {
+	if ((nl = memchr(p, '\n', wq->itembuf + n - p)) == NULL)
+	    nl = wq->itembuf + n;
+	*nl = '\0';
+	if (nl == p)
+	    continue;
+	if ((wq->nitems & (wq->nitems - 1)) == 0 &&
+	    (wq->items = realloc(wq->items, (wq->nitems ? 2 * wq->nitems : 1) * sizeof(char *))) == NULL)
+	    unix_error("realloc error");
+	wq->items[wq->nitems++] = p;
+    }
+
+    /* The job is created around the first command that starts */
+    pid = -1;
+    while (pid < 0 && wq->next < wq->nitems)
+	pid = workq_start(wq, 0);
+    if (pid < 0) {
+	workq_report(wq);
+	workq_free(wq);
+	return;
+    }
+    job = addjob(&jobs, &pid, 1, pl->bg ? BG : FG, cmdline, len);
+    job->wq = wq;
+    job->timed = pl->timed;
+    job->grace = pl->grace;
+    settimeout(job, pl->timeout);
+    workq_fill(job);
+
+    if (!pl->bg)
+	waitfg(job->pid);
+    else
+	printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
 }
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
+/*
+ * workq_start - Start the command for the next item of wq in process
+ *    group pgid (0 for a new group).  Returns its PID, or -1 if it could
+ *    not be started, which counts as a finished, failed command.
  */
-//I got advices from office hours TA (David) to write the following code lines for this do_bgfg() function
-//Ref: 2467.cs.uno.edu/activities/next-steps.pdf
-void do_bgfg(char **argv) 
+pid_t workq_start(struct workq_t *wq, pid_t pgid)
 {
-    struct job_t *job;
-    pid_t argvPid;
-    int jid;
-    
-    //Arguments for fg or bg is missing, argv[0] = fg or bg --> argv[1] = Null if the arguments are missing
-    if (argv[1] == NULL){
-        printf("%s command requires PID or %%jobid argument\n",argv[0]);
-        return;
+    struct arena_t arena;
+    struct cmd_t cmd;
+    const char *item = wq->items[wq->next++], *t, *brace;
+    char *o;
+    size_t itemlen = strlen(item), n;
+    int i, used = 0;
+    pid_t pid;
+
+    arena_init(&arena);
+    cmd.argv = arena_alloc(&arena, (wq->tmplc + 2) * sizeof(char *));
+    cmd.argc = 0;
+    for (i = 0; i < wq->tmplc; i++) {
+	t = wq->tmpl[i];
+	if (strstr(t, "{}") == NULL) {
+	    cmd.argv[cmd.argc++] = (char *)t;
+	    continue;
+	}
+	/* replace every {} in the argument with the item */
+	o = arena_alloc(&arena, strlen(t) / 2 * itemlen + strlen(t) + 1);
+	cmd.argv[cmd.argc++] = o;
+	while ((brace = strstr(t, "{}")) != NULL) {
+	    n = brace - t;
+	    memcpy(o, t, n);
+	    memcpy(o + n, item, itemlen);
+	    o += n + itemlen;
+	    t = brace + 2;
+	}
+	strcpy(o, t);
+	used = 1;
     }
+    if (!used)
+	cmd.argv[cmd.argc++] = (char *)item;
+    cmd.argv[cmd.argc] = NULL;
+    cmd.redirs = wq->redirs;
+    cmd.nredirs = wq->nredirs;
+    cmd.assigns = NULL;
+    cmd.nassigns = 0;
+    cmd.builtin = NULL;
 
-    //If the first token of an argument for fg or bg is not a "%" --> it can not be a job id, it only can be a pid
-    if (argv[1][0] != '%'){
-    //Continue to check if it is valid pid or not
-        //if not, print out the message of invalid argument
-        if (!isdigit(argv[1][0])){
-            printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-            return;
-        }
-        //If argument for fg or bg is a valid pid
-        //use atoi() to convert char* to int
-        argvPid = atoi(argv[1]);
-        //Find a job (by argvPid) on the job list
-        job = getjobjid(jobs, argvPid);
-        //if no such process, print out that message
-        if (job == NULL){
-            printf("(%s): No such process\n", argv[1]);
-            return;
-        }
+    pid = spawn(&cmd, pgid, -1, -1, 0, wq->place);
+    arena_free(&arena);
+    if (pid < 0) {
+	wq->done++;
+	wq->failed++;
     }
-    //Check if the first token of an argument for fg or bg is "%"
-    else{
-     //if it is true, continue to check the second token of that argument, if it is not a digit --> invalid arguments
-        if (!isdigit(argv[1][1])){
-            printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-            return;
-        }
-        //If arguments for fg or bg are valid ones
-        //use atoi() to convert char* to int
-        //followed by "%"" will be an integer and it is aslo a job id
-        jid = atoi(&argv[1][1]);
-        //Find a job (by jid) on the job list
-        job = getjobjid(jobs, jid);
-        //if no such job, print the message out
-        if (job == NULL){
-            printf("%s: No such job\n", argv[1]);
-            return;
-        }
+    return pid;
 }
 
-    //command line is background job
-    if (!(strcmp(argv[0], "bg"))){
-        //Change state of job to background
-        job->state = BG;
-        //Send continue signal to run again all processes that are suspended before
-        kill(-(job->pid), SIGCONT);
-        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+/*
+ * workq_fill - Start commands from job's queue until maxrun are running,
+ *    unless the job is stopped or was interrupted.  Returns the number
+ *    of live processes.
+ */
+int workq_fill(struct job_t *job)
+{
+    struct workq_t *wq = job->wq;
+    pid_t pid;
+
+    while (job->nlive < wq->maxrun && wq->next < wq->nitems &&
+	   !wq->aborted && job->state != ST) {
+	/* join the batch's group while it has members, else lead a new one */
+	if ((pid = workq_start(wq, job->nlive ? job->pid : 0)) > 0)
+	    addjobproc(&jobs, job, pid);
     }
-    //Comand line is forefround job
+    return job->nlive;
+}
+
+/* workq_reaped - Account for a finished command of job's batch and
+ *    start the next ones */
+void workq_reaped(struct job_t *job, int status)
+{
+    job->wq->done++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	job->wq->failed++;
+    workq_fill(job);
+}
+
+/* workq_report - Print the totals of a finished batch */
+void workq_report(struct workq_t *wq)
+{
+    double t = elapsed(&wq->start);
+
+    printf("parallel: %d of %d commands run, %d failed, %.3f s, %.1f commands/s\n",
+	   wq->done, wq->nitems, wq->failed, t, t > 0 ? wq->done / t : 0.0);
+}
+
+/* workq_free - Release a work queue */
+void workq_free(struct workq_t *wq)
+{
+    int i;
+
+    for (i = 0; i < wq->tmplc; i++)
+	free(wq->tmpl[i]);
+    for (i = 0; i < wq->nredirs; i++)
+	free((char *)wq->redirs[i].path);
+    free(wq->tmpl);
+    free(wq->redirs);
+    free(wq->items);
+    free(wq->itembuf);
+    free(wq->place);
+    free(wq);
+}
+
+/* elapsed - Seconds since a CLOCK_MONOTONIC timestamp */
+double elapsed(struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/***********************
+ * End parallel batches
+ ***********************/
+
+/**********************
+ * Resource accounting
+ **********************/
+
+/*
+ * do_jobs - Execute the builtin jobs command
+ *
+ *    jobs           list the jobs
+ *    jobs -l        ... with their processes, start time and usage
+ *    jobs --stats   one row of usage figures per job
+ *
+ *    The usage of a job covers the processes reaped so far.
+ */
+int do_jobs(char **argv)
+{
+    if (argv[1] == NULL)
+	listjobs(&jobs);
+    else if (!strcmp(argv[1], "-l"))
+	listjobs_long(&jobs);
+    else if (!strcmp(argv[1], "--stats"))
+	listjobs_stats(&jobs);
+    else if (!strcmp(argv[1], "--check"))
+	return checkjobs(&jobs) != 0;
     else {
-        //Change state of job to foreground
-        job->state = FG;
-        //Send continue signal to run again all processes that are suspended before
-        kill(-(job->pid), SIGCONT);
-        //Call waitfg() to wait until the process is terminated
-        waitfg(job->pid);
+	printf("usage: jobs [-l | --stats | --check]\n");
+	return 2;
+    }
+    return 0;
+}
+
+/* timebuiltin - Run a builtin under time: it is charged to the shell */
+void timebuiltin(struct cmd_t *cmd)
+{
+    struct timespec start, end;
+    struct rusage before, ru;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(RUSAGE_SELF, &before);
+    builtin_cmd(cmd);
+    getrusage(RUSAGE_SELF, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    rusage_sub(&ru, &before);
+    reportusage("time", tsdiff(&end, &start), &ru);
+}
+
+/* rusage_add - Add the usage of one reaped process to a job's total.
+ *    The max RSS of a job is the largest of its processes. */
+void rusage_add(struct rusage *sum, const struct rusage *ru)
+{
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss)
+	sum->ru_maxrss = ru->ru_maxrss;
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* rusage_sub - Turn ru into the usage since before (max RSS is kept,
+ *    a peak cannot be differenced) */
+void rusage_sub(struct rusage *ru, const struct rusage *before)
+{
+    timersub(&ru->ru_utime, &before->ru_utime, &ru->ru_utime);
+    timersub(&ru->ru_stime, &before->ru_stime, &ru->ru_stime);
+    ru->ru_minflt -= before->ru_minflt;
+    ru->ru_majflt -= before->ru_majflt;
+    ru->ru_nvcsw -= before->ru_nvcsw;
+    ru->ru_nivcsw -= before->ru_nivcsw;
+}
+
+/* tsdiff - Seconds from start to end */
+double tsdiff(const struct timespec *end, const struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* reportusage - Print real time and resource usage on one line */
+void reportusage(const char *label, double real, const struct rusage *ru)
+{
+    printf("%s: %.3f s real, %.3f s user, %.3f s sys, %ld KB maxrss, "
+	   "%ld major + %ld minor faults, %ld + %ld context switches\n",
+	   label, real,
+	   ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+	   ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+	   ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt,
+	   ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/* jobusage - Report the usage of a job whose last process was reaped */
+void jobusage(struct job_t *job)
+{
+    if (job->timed)
+	reportusage("time", tsdiff(&job->end, &job->start), &job->ru);
+    else {
+	sprintf(sbuf, "Job [%d] (%d)", job->jid, job->pid);
+	reportusage(sbuf, tsdiff(&job->end, &job->start), &job->ru);
+    }
+}
+
+/**************************
+ * End resource accounting
+ **************************/
+
+/**********************************
+ * Tracing and latency statistics
+ **********************************/
+
+/*
+ * Every span (parse, builtin, spawn, wait, command) is timed and added
+ * to a histogram for the stats builtin.  With -T, spans and instant
+ * events also go to a ring buffer in a shared anonymous mapping: writers
+ * claim a slot with an atomic increment and publish it by storing its
+ * sequence number, so a forked child (or a signal handler) can post
+ * without locks.  The event loop drains the ring to the trace file
+ * before it sleeps and at exit.
+ */
+
+static const char *tracename[NTRACE] = {
+    "parse", "builtin", "spawn", "wait", "command",
+    "exec", "sigchld", "reap", "prompt"
+};
+
+/* now_ns - CLOCK_MONOTONIC in nanoseconds */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* trace_open - Start writing trace events to path */
+void trace_open(const char *path)
+{
+    if ((traceout = fopen(path, "we")) == NULL)
+	unix_error((char *)path);
+    tracering = mmap(NULL, sizeof(*tracering), PROT_READ|PROT_WRITE,
+		     MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (tracering == MAP_FAILED)
+	unix_error("mmap error");
+    trace_t0 = now_ns();
+    trace_owner = getpid();
+    fputs("[\n", traceout);
+    atexit(trace_close);
+}
+
+/* trace_post - Add an event to the trace ring (no-op without -T) */
+void trace_post(int type, long long ts, long long dur, pid_t pid, int jid)
+{
+    struct trace_t *e;
+    unsigned long i;
+
+    if (tracering == NULL)
+	return;
+    i = atomic_fetch_add_explicit(&tracering->head, 1, memory_order_relaxed);
+    e = &tracering->ev[i & (TRACECAP - 1)];
+    atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->type = type;
+    e->pid = pid;
+    e->jid = jid;
+    e->ts = ts;
+    e->dur = dur;
+    atomic_store_explicit(&e->seq, i + 1, memory_order_release);
+}
+
+/* trace_span - Close a span that began at start: record its duration
+ *    in the type's histogram and post it to the trace */
+void trace_span(int type, long long start, pid_t pid, int jid)
+{
+    long long end = now_ns();
+    unsigned long long d = end - start;
+    struct hist_t *h = &hists[type];
+
+    h->count++;
+    h->sum += d;
+    if (d > h->max)
+	h->max = d;
+    h->buckets[histbucket(d)]++;
+    trace_post(type, start, d, pid, jid);
+}
+
+/* trace_flush - Write the completed events in the ring to the trace file */
+void trace_flush(void)
+{
+    struct tracering_t *r = tracering;
+    struct trace_t *e, ev;
+    unsigned long head, seq;
+    pid_t self = getpid();
+
+    if (r == NULL)
+	return;
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head - r->tail > TRACECAP) {
+	r->dropped += head - r->tail - TRACECAP;
+	r->tail = head - TRACECAP;
+    }
+    for (; r->tail != head; r->tail++) {
+	e = &r->ev[r->tail & (TRACECAP - 1)];
+	if ((seq = atomic_load_explicit(&e->seq, memory_order_acquire)) != r->tail + 1) {
+	    if (seq > r->tail + 1) {  /* already overwritten */
+		r->dropped++;
+		continue;
+	    }
+	    break;                    /* still being written */
+	}
+	ev.type = e->type;
+	ev.pid = e->pid;
+	ev.jid = e->jid;
+	ev.ts = e->ts;
+	ev.dur = e->dur;
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&e->seq, memory_order_relaxed) != seq) {
+	    r->dropped++;
+	    continue;
+	}
+
+	fprintf(traceout, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,",
+		trace_nwritten++ ? ",\n" : "", tracename[ev.type],
+		ev.type < TR_EXEC ? "X" : "i", (ev.ts - trace_t0) / 1e3);
+	if (ev.type < TR_EXEC)
+	    fprintf(traceout, "\"dur\":%.3f,", ev.dur / 1e3);
+	else
+	    fputs("\"s\":\"t\",", traceout);
+	fprintf(traceout, "\"pid\":%d,\"tid\":%d,\"args\":{\"pid\":%d,\"jid\":%d}}",
+		self, ev.pid ? ev.pid : self, ev.pid, ev.jid);
+    }
+    fflush(traceout);
+}
+
+/* trace_close - Drain the ring and finish the JSON array (at exit) */
+void trace_close(void)
+{
+    if (traceout == NULL || getpid() != trace_owner) /* a forked child */
+	return;
+    trace_flush();
+    fputs("\n]\n", traceout);
+    fclose(traceout);
+    traceout = NULL;
+}
+
+/*
+ * histbucket - Histogram bucket of v: exact below 2*HISTSUB, then
+ *    HISTSUB buckets per power of two (about 3% relative error).
+ */
+int histbucket(unsigned long long v)
+{
+    int msb;
+
+    if (v < 2 * HISTSUB)
+	return v;
+    msb = 63 - __builtin_clzll(v);
+    return 2 * HISTSUB + (msb - 6) * HISTSUB + ((v >> (msb - 5)) & (HISTSUB - 1));
+}
+
+/* histvalue - Midpoint of the values that fall in bucket b */
+unsigned long long histvalue(int b)
+{
+    int msb, sub;
+
+    if (b < 2 * HISTSUB)
+	return b;
+    msb = (b - 2 * HISTSUB) / HISTSUB + 6;
+    sub = (b - 2 * HISTSUB) % HISTSUB;
+    return ((unsigned long long)(HISTSUB + sub) << (msb - 5)) + (1ULL << (msb - 6));
+}
+
+/* histpct - The pct'th percentile of h */
+unsigned long long histpct(struct hist_t *h, double pct)
+{
+    unsigned long long want = (unsigned long long)(pct / 100 * h->count + 0.5), seen = 0;
+    int b;
+
+    if (want == 0)
+	want = 1;
+    for (b = 0; b < HISTBUCKETS; b++)
+	if ((seen += h->buckets[b]) >= want)
+	    return histvalue(b) < h->max ? histvalue(b) : h->max;
+    return h->max;
+}
+
+/*
+ * do_stats - Execute the builtin stats command
+ *    stats      print latency percentiles of each traced phase
+ *    stats -r   reset the histograms
+ */
+int do_stats(char **argv)
+{
+    struct hist_t *h;
+    int t;
+
+    if (argv[1] && !strcmp(argv[1], "-r")) {
+	memset(hists, 0, sizeof(hists));
+	return 0;
+    }
+    printf("%-8s %9s %10s %10s %10s %10s %10s\n",
+	   "phase", "count", "mean", "p50", "p90", "p99", "max");
+    for (t = 0; t < TR_EXEC; t++) {
+	h = &hists[t];
+	if (h->count == 0)
+	    continue;
+	printf("%-8s %9llu %8.1fus %8.1fus %8.1fus %8.1fus %8.1fus\n",
+	       tracename[t], h->count, (double)h->sum / h->count / 1e3,
+	       histpct(h, 50) / 1e3, histpct(h, 90) / 1e3,
+	       histpct(h, 99) / 1e3, h->max / 1e3);
+    }
+    if (tracering && tracering->dropped)
+	printf("trace: %lu events dropped\n", tracering->dropped);
+    return 0;
+}
+
+/**************************************
+ * End tracing and latency statistics
+ **************************************/
+
+/*************
+ * Event loop
+ *************/
+
+/*
+ * init_eventloop - Block the job control signals, open sigfd for them
+ *    and register sigfd with a fresh epoll instance.
+ */
+void init_eventloop(void)
+{
+    struct epoll_event ev;
+
+    sigemptyset(&loop_mask);
+    sigaddset(&loop_mask, SIGCHLD);
+    sigaddset(&loop_mask, SIGINT);
+    sigaddset(&loop_mask, SIGTSTP);
+    sigaddset(&loop_mask, SIGQUIT);
+    if (sigprocmask(SIG_BLOCK, &loop_mask, &child_mask) < 0)
+	unix_error("sigprocmask error");
+
+    if ((sigfd = signalfd(-1, &loop_mask, SFD_NONBLOCK|SFD_CLOEXEC)) < 0)
+	unix_error("signalfd error");
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	unix_error("epoll_create1 error");
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sigfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+}
+
+/*
+ * dispatch_signals - Drain sigfd and run the handler for each signal
+ */
+void dispatch_signals(void)
+{
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+    int i;
+
+    while ((n = read(sigfd, si, sizeof(si))) > 0) {
+	for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++) {
+	    switch (si[i].ssi_signo) {
+	    case SIGCHLD:
+		trace_post(TR_SIGCHLD, now_ns(), 0, si[i].ssi_pid, 0);
+		sigchld_handler(SIGCHLD);
+		break;
+	    case SIGINT:
+		sigint_handler(SIGINT);
+		break;
+	    case SIGTSTP:
+		sigtstp_handler(SIGTSTP);
+		break;
+	    case SIGQUIT:
+		sigquit_handler(SIGQUIT);
+		break;
+	    }
+	}
+    }
+}
+
+/*
+ * eventloop_wait - Wait up to timeout ms (-1 = forever) for events and
+ *    dispatch them.  Signals are always serviced; the input is only
+ *    watched when want_input is set, so a foreground job keeps the
+ *    terminal to itself.  Sets input.ready when the input is readable.
+ */
+void eventloop_wait(int timeout, int want_input)
+{
+    struct epoll_event evs[8], ev;
+    struct capture_t *cap;
+    int i, n;
+
+    /* The input is only registered while wanted: a hung-up pipe would
+     * otherwise report EPOLLHUP on every wait, even with no events set */
+    if (input.pollable && input.watching != want_input) {
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = input.fd;
+	if (epoll_ctl(epfd, want_input ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, input.fd, &ev) < 0)
+	    unix_error("epoll_ctl error");
+	input.watching = want_input;
+    }
+
+    /* Everything printed so far must be visible before we sleep */
+    if (timeout != 0) {
+	fflush(stdout);
+	trace_flush();
+    }
+
+    if ((n = epoll_wait(epfd, evs, 8, timeout)) < 0) {
+	if (errno == EINTR)
+	    return;
+	unix_error("epoll_wait error");
+    }
+    for (i = 0; i < n; i++) {
+	if (evs[i].data.fd == sigfd)
+	    dispatch_signals();
+	else if (evs[i].data.fd == input.fd)
+	    input.ready = 1;
+	else if (evs[i].data.fd == admit.tfd) {
+	    uint64_t ticks;
+	    if (read(admit.tfd, &ticks, sizeof(ticks)) > 0)
+		admit_jobs();
+	}
+	else if (evs[i].data.fd == wheel.tfd) {
+	    uint64_t ticks;
+	    if (read(wheel.tfd, &ticks, sizeof(ticks)) > 0)
+		wheel_run();
+	}
+	else if (intmap_get(&waitfds, evs[i].data.fd) != NULL)
+	    sigchld_handler(SIGCHLD);  /* a process wait is watching exited */
+	else if ((cap = intmap_get(&captures.byfd, evs[i].data.fd)) != NULL)
+	    capture_read(cap);
+	else if (evs[i].data.fd == server.epfd)
+	    serve_poll();
+    }
+}
+
+/*
+ * input_open - Start reading command lines from fd.  A regular file is
+ *    mapped whole, so lines are handed out in place without any copy or
+ *    read() calls.  Anything else (terminal, pipe) is read in large
+ *    chunks into a buffer that grows to hold the longest line.
+ */
+void input_open(int fd)
+{
+    struct epoll_event ev;
+    struct stat st;
+    void *map;
+
+    input.fd = fd;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	input.buf = map;
+	input.len = st.st_size;
+	input.mapped = 1;
+	input.eof = 1;
+	return;
+    }
+
+    input.cap = INBUFSIZE;
+    if ((input.buf = malloc(input.cap)) == NULL)
+	unix_error("malloc error");
+
+    /* Regular files and /dev/null cannot be polled (EPERM); they are
+     * always readable, so the reader just calls read() directly. */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    input.pollable = input.watching = (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+}
+
+/*
+ * readcmdline - Point *line at the next line of input and set *len to
+ *    its length, including the trailing '\n'.  The line is not copied:
+ *    it stays valid until the next call.  There is no length limit.
+ *    Signals keep being serviced while the shell waits for input.
+ *    Returns 0 at end of file.
+ */
+int readcmdline(const char **line, size_t *len)
+{
+    char *start, *nl;
+    size_t n;
+    ssize_t rc;
+
+    while (1) {
+	/* Hand out a complete line if we have one */
+	start = input.buf + input.pos;
+	n = input.len - input.pos;
+	if ((nl = memchr(start, '\n', n)) != NULL) {
+	    *line = start;
+	    *len = nl - start + 1;
+	    input.pos += *len;
+	    return 1;
+	}
+	if (input.eof) {
+	    if (n == 0)
+		return 0;
+	    /* Unterminated last line: give it the '\n' callers expect */
+	    free(input.tail);
+	    if ((input.tail = malloc(n + 1)) == NULL)
+		unix_error("malloc error");
+	    memcpy(input.tail, start, n);
+	    input.tail[n] = '\n';
+	    input.pos = input.len;
+	    *line = input.tail;
+	    *len = n + 1;
+	    return 1;
+	}
+
+	/* Make room: drop consumed bytes, then grow for very long lines */
+	if (input.pos > 0) {
+	    memmove(input.buf, start, n);
+	    input.pos = 0;
+	    input.len = n;
+	}
+	if (input.cap - input.len < INBUFSIZE / 2) {
+	    input.cap *= 2;
+	    if ((input.buf = realloc(input.buf, input.cap)) == NULL)
+		unix_error("realloc error");
+	}
+
+	/* Sleep in the event loop until the input is readable */
+	if (input.pollable && !input.ready) {
+	    eventloop_wait(-1, 1);
+	    continue;
+	}
+	input.ready = 0;
+	rc = read(input.fd, input.buf + input.len, input.cap - input.len);
+	if (rc < 0) {
+	    if (errno == EINTR || errno == EAGAIN)
+		continue;
+	    app_error("read error");
+	}
+	if (rc == 0)
+	    input.eof = 1;
+	input.len += rc;
     }
-    return;
 }
 
+/*****************
+ * End event loop
+ *****************/
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
- */
-void waitfg(pid_t pid)
+/**************
+ * PATH search
+ **************/
+
+/* pathvar - The current search path ($PATH, or a default if unset) */
+const char *pathvar(void)
 {
-    //Get pid of current foreground job, stored in variable temp
-    pid_t temp = fgpid(jobs);
-    struct job_t *job;
-    //Find a job (by temp) on the job list
-    job = getjobpid(jobs, temp);
-    //if temp is not equal to given pid, do nothing and return
-    if (temp != pid)
-        return;
-    
-    //if pid is equal to pid of foreground job in the job lists, waitfg() will block until this pid is no longer the fg process
-    //Blocking way here is putting this process to sleep infinitely (Ref: 2467.cs.uno.edu/activities/next-steps.pdf)
-    while(job->state == FG){
-        sleep(1);
-        }
-    return;
+    const char *p = getvar("PATH");
+
+    return p ? p : "/usr/local/bin:/usr/bin:/bin";
 }
 
-/*****************
- * Signal handlers
- *****************/
+/* hashmem - FNV-1a hash of len bytes at p */
+size_t hashmem(const char *p, size_t len)
+{
+    size_t h = 2166136261u;
+
+    while (len--)
+	h = (h ^ (unsigned char)*p++) * 16777619u;
+    return h;
+}
+
+/* hashname - Hash of a command name */
+size_t hashname(const char *name)
+{
+    return hashmem(name, strlen(name));
+}
 
 /* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+ * cmdhash_reset - Drop every cached entry and, if $PATH changed since
+ *    the directories were opened, reopen them.
  */
-//Got advices from David (TA) to write the following code lines
-void sigchld_handler(int sig) 
+void cmdhash_reset(void)
 {
-    pid_t pid;
-    int child_status;
+    const char *path = pathvar();
+    char *copy, *dir, *save;
+    struct hashent_t *e, *next;
+    size_t i;
 
-    //Call waitpid to suspends execution of the calling process until a child process in its wait set terminate (Ref: Cs: APP pg.780)
-    //WNOHANG|WUNTRACED: return pid of terminated or stopped process/ other way, return 0 if no child process has stopped or terminated
-    while ((pid = waitpid(-1, &child_status, WNOHANG|WUNTRACED)) > 0){
-        //if the child process terminate normally, delete it based on its pid
-        if(WIFEXITED(child_status)){
-            deletejob(jobs, pid);
-        }
-        //if the child process that caused the return is currently stopped, return true
-        else if(WIFSTOPPED(child_status)){
-            //when it is true, get job based on process id
-            struct job_t *job = getjobpid(jobs, pid);
-            //Change job's state to stopped state
-            job->state = ST;
-        }
-        //if the child process terminated because of an uncaught signal, return true
-        else if(WIFSIGNALED(child_status)){ 
-            //when it is true, delete that job 
-            deletejob(jobs, pid);
-        }
+    for (i = 0; i < cmdhash.nbuckets; i++) {
+	for (e = cmdhash.buckets[i]; e; e = next) {
+	    next = e->next;
+	    free(e->name);
+	    free(e->path);
+	    free(e);
+	}
+	cmdhash.buckets[i] = NULL;
     }
+    cmdhash.count = 0;
 
-    return;
+    if (cmdhash.pathvar && !strcmp(cmdhash.pathvar, path))
+	return;
+
+    for (i = 0; i < (size_t)cmdhash.ndirs; i++) {
+	free(cmdhash.dirs[i].path);
+	if (cmdhash.dirs[i].fd >= 0)
+	    close(cmdhash.dirs[i].fd);
+    }
+    free(cmdhash.dirs);
+    free(cmdhash.pathvar);
+    cmdhash.pathvar = strdup(path);
+    cmdhash.dirs = NULL;
+    cmdhash.ndirs = 0;
+
+    copy = strdup(path);
+    for (dir = strtok_r(copy, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+	cmdhash.dirs = realloc(cmdhash.dirs, (cmdhash.ndirs + 1) * sizeof(struct pathdir_t));
+	if (cmdhash.dirs == NULL)
+	    unix_error("realloc error");
+	cmdhash.dirs[cmdhash.ndirs].path = strdup(dir);
+	cmdhash.dirs[cmdhash.ndirs].fd = open(dir, O_PATH|O_DIRECTORY|O_CLOEXEC);
+	cmdhash.ndirs++;
+    }
+    free(copy);
 }
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+/*
+ * cmdhash_insert - Add name -> path (found in pathdirs[dir], whose mtime
+ *    was mtime) to the cache, growing the bucket array when it fills up.
  */
-void sigint_handler(int sig) 
+struct hashent_t *cmdhash_insert(const char *name, const char *path, int dir,
+				 struct timespec mtime)
 {
-   pid_t pid;
-   struct job_t *job;
-   //Get pid of current foreground job
-   pid = fgpid(jobs);
-   
-   //If the pid is valid
-   if (pid > 0){
-       //Send SIGINT signal to all processes that are running in a group
-       kill(-pid, sig);
-       //Find a job from jobs list based on its pid
-       job = getjobpid(jobs, pid);
-       //print out its property
-       printf("Job [%d] (%d) terminated by signal %d\n",job->jid, job->pid, sig);
-   } 
-    return;
+    struct hashent_t *e, **nb, *next;
+    size_t i, nn;
+
+    if (cmdhash.count >= cmdhash.nbuckets) {
+	nn = cmdhash.nbuckets ? cmdhash.nbuckets * 2 : 64;
+	if ((nb = calloc(nn, sizeof(*nb))) == NULL)
+	    unix_error("calloc error");
+	for (i = 0; i < cmdhash.nbuckets; i++) {
+	    for (e = cmdhash.buckets[i]; e; e = next) {
+		next = e->next;
+		e->next = nb[hashname(e->name) & (nn - 1)];
+		nb[hashname(e->name) & (nn - 1)] = e;
+	    }
+	}
+	free(cmdhash.buckets);
+	cmdhash.buckets = nb;
+	cmdhash.nbuckets = nn;
+    }
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+	unix_error("calloc error");
+    e->name = strdup(name);
+    e->path = strdup(path);
+    e->dir = dir;
+    e->mtime = mtime;
+    i = hashname(name) & (cmdhash.nbuckets - 1);
+    e->next = cmdhash.buckets[i];
+    cmdhash.buckets[i] = e;
+    cmdhash.count++;
+    return e;
+}
+
+/* cmdhash_delete - Remove name from the cache; returns 1 if it was there */
+int cmdhash_delete(const char *name)
+{
+    struct hashent_t **pp, *e;
+
+    if (cmdhash.nbuckets == 0)
+	return 0;
+    for (pp = &cmdhash.buckets[hashname(name) & (cmdhash.nbuckets - 1)]; (e = *pp); pp = &e->next) {
+	if (!strcmp(e->name, name)) {
+	    *pp = e->next;
+	    free(e->name);
+	    free(e->path);
+	    free(e);
+	    cmdhash.count--;
+	    return 1;
+	}
+    }
+    return 0;
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ * findcmd - Resolve a command name (no '/') to an executable in $PATH.
+ *    A cached entry costs one fstat of its directory: if the directory's
+ *    mtime moved since the entry was made the entry is searched again.
+ *    Returns NULL if the command is not found.
  */
-void sigtstp_handler(int sig) 
+struct hashent_t *findcmd(const char *name)
 {
-    pid_t pid;
-   struct job_t *job;
-   //Get pid of current foreground job
-   pid = fgpid(jobs);
-   
-   //If the pid is valid
-   if (pid > 0){
-       //Send SIGSTP signal to all processes that are running in a group
-       kill(-pid, SIGTSTP);
-       //Find a job from jobs list based on its pid
-       job = getjobpid(jobs, pid);
-       //Change jobs's state into stopped state
-       job->state = ST;
-       //Print out its property
-       printf("Job [%d] (%d) stopped by signal %d\n",job->jid, job->pid, sig);
-   } 
-    return;
+    struct hashent_t *e = NULL;
+    struct stat st, fst;
+    char buf[PATH_MAX];
+    int i;
+
+    /* setvar drops pathvar when $PATH changes */
+    if (cmdhash.pathvar == NULL)
+	cmdhash_reset();
+
+    if (cmdhash.nbuckets) {
+	for (e = cmdhash.buckets[hashname(name) & (cmdhash.nbuckets - 1)]; e; e = e->next)
+	    if (!strcmp(e->name, name))
+		break;
+    }
+    if (e) {
+	if (e->dir < 0)
+	    goto hit;
+	if (fstat(cmdhash.dirs[e->dir].fd, &st) == 0 &&
+	    st.st_mtim.tv_sec == e->mtime.tv_sec && st.st_mtim.tv_nsec == e->mtime.tv_nsec)
+	    goto hit;
+	cmdhash_delete(name); /* directory changed: search again */
+    }
+
+    for (i = 0; i < cmdhash.ndirs; i++) {
+	if (cmdhash.dirs[i].fd < 0 || fstat(cmdhash.dirs[i].fd, &st) < 0)
+	    continue;
+	if (faccessat(cmdhash.dirs[i].fd, name, X_OK, 0) == 0) {
+	    if (fstatat(cmdhash.dirs[i].fd, name, &fst, 0) < 0 || !S_ISREG(fst.st_mode))
+		continue;
+	    snprintf(buf, sizeof(buf), "%s/%s", cmdhash.dirs[i].path, name);
+	    e = cmdhash_insert(name, buf, i, st.st_mtim);
+	    goto hit;
+	}
+    }
+    return NULL;
+
+ hit:
+    e->hits++;
+    return e;
 }
 
-/*********************
- * End signal handlers
- *********************/
+/*
+ * do_hash - Execute the builtin hash command
+ *    hash               list the cached commands
+ *    hash -r            forget every cached command
+ *    hash -d name...    forget the given commands
+ *    hash -p path name  use path for name
+ *    hash -t name...    print where each command resolves to
+ *    hash name...       search $PATH and cache the commands
+ */
+int do_hash(char **argv)
+{
+    struct hashent_t *e;
+    struct timespec none = {0, 0};
+    size_t i;
+    int j, status = 0;
+
+    if (argv[1] == NULL) {
+	if (cmdhash.count == 0) {
+	    printf("hash: hash table empty\n");
+	    return 0;
+	}
+	printf("hits\tcommand\n");
+	for (i = 0; i < cmdhash.nbuckets; i++)
+	    for (e = cmdhash.buckets[i]; e; e = e->next)
+		printf("%4d\t%s\n", e->hits, e->path);
+	return 0;
+    }
+    if (!strcmp(argv[1], "-r")) {
+	cmdhash_reset();
+	return 0;
+    }
+    if (!strcmp(argv[1], "-p")) {
+	if (argv[2] == NULL || argv[3] == NULL) {
+	    printf("hash: -p requires a path and a name\n");
+	    return 1;
+	}
+	cmdhash_delete(argv[3]);
+	cmdhash_insert(argv[3], argv[2], -1, none);
+	return 0;
+    }
+    if (!strcmp(argv[1], "-d")) {
+	for (j = 2; argv[j]; j++) {
+	    if (!cmdhash_delete(argv[j])) {
+		printf("hash: %s: not found\n", argv[j]);
+		status = 1;
+	    }
+	}
+	return status;
+    }
+    if (!strcmp(argv[1], "-t")) {
+	for (j = 2; argv[j]; j++) {
+	    if ((e = findcmd(argv[j])) == NULL) {
+		printf("hash: %s: not found\n", argv[j]);
+		status = 1;
+		continue;
+	    }
+	    e->hits--; /* looking is not using */
+	    printf("%s\n", e->path);
+	}
+	return status;
+    }
+    for (j = 1; argv[j]; j++) {
+	if (strchr(argv[j], '/'))
+	    continue;
+	if ((e = findcmd(argv[j])) == NULL) {
+	    printf("hash: %s: not found\n", argv[j]);
+	    status = 1;
+	}
+	else
+	    e->hits--;
+    }
+    return status;
+}
+
+/******************
+ * End PATH search
+ ******************/
 
 /***********************************************
  * Helper routines that manipulate the job list
@@ -567,149 +7333,614 @@ void sigtstp_handler(int sig)
 
 /* clearjob - Clear the entries in a job struct */
 void clearjob(struct job_t *job) {
+    int i;
+
+    /* a process still unreaped (the job was dropped) keeps its pidfd */
+    for (i = 0; i < job->nprocs; i++)
+	if (job->procs[i].pidfd >= 0) {
+	    intmap_del(&waitfds, job->procs[i].pidfd);
+	    close(job->procs[i].pidfd);
+	}
     job->pid = 0;
     job->jid = 0;
     job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    job->nprocs = 0;
+    job->nlive = 0;
+    job->termsig = 0;
+    job->stopsig = 0;
+    job->status = 0;
+    free(job->procs);
+    job->procs = NULL;
+    job->proccap = 0;
+    if (job->wq)
+	workq_free(job->wq);
+    job->wq = NULL;
+    memset(&job->ru, 0, sizeof(job->ru));
+    memset(&job->start, 0, sizeof(job->start));
+    memset(&job->end, 0, sizeof(job->end));
+    job->started = 0;
+    job->timed = 0;
+    job->expired = 0;
+    job->grace = 0;
+    job->due = 0;
+    if (job->cmdline)
+	strpool_release(job->cmdline);
+    job->cmdline = NULL;
+    job->prev = job->next = job->qnext = NULL;
+    free(job->runline);
+    job->runline = NULL;
+    job->cap = NULL;
+    job->waitst = NULL;
+    job->client = NULL;
+    job->tag = 0;
 }
 
 /* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+void initjobs(struct joblist_t *jobs) {
+    memset(jobs, 0, sizeof(*jobs));
+    jobs->nextjid = 1;
+}
+
+/* addjob - Add a job whose processes are pids[0..nprocs-1] to the job
+ *    list.  pids[0] leads the process group and becomes the job's PID.
+ *    A QU job has no processes yet (PID 0) and is appended to the submit
+ *    queue.  Returns the new job, or NULL if pids is empty. */
+struct job_t *addjob(struct joblist_t *jobs, pid_t *pids, int nprocs, int state,
+		     const char *cmdline, size_t len) 
+{
+    struct job_t *job;
     int i;
+    
+    if (state != QU && (nprocs < 1 || pids[0] < 1))
+	return NULL;
+
+    if ((job = jobs->spare) != NULL)
+	jobs->spare = job->next;
+    else if ((job = calloc(1, sizeof(*job))) == NULL)
+	unix_error("calloc error");
+    if ((job->procs = calloc(nprocs ? nprocs : 1, sizeof(struct proc_t))) == NULL)
+	unix_error("calloc error");
+    for (i = 0; i < nprocs; i++) {
+	job->procs[i].pid = pids[i];
+	job->procs[i].pidfd = syscall(SYS_pidfd_open, pids[i], 0);
+	intmap_put(&jobs->bypid, pids[i], job);
+    }
+    job->nprocs = job->nlive = nprocs;
+    job->proccap = nprocs ? nprocs : 1;
+    job->pid = nprocs ? pids[0] : 0;
+    job->state = UNDEF;
+    setjobstate(jobs, job, state);
+    job->jid = jobs->nfree ? jobs->freejids[--jobs->nfree] : jobs->nextjid++;
+    intmap_put(&jobs->byjid, job->jid, job);
+    job->cmdline = strpool_intern(cmdline, len);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->started = time(NULL);
+    if ((job->client = substdepth || scripts.depth ? NULL : server.serving) != NULL) {
+	job->tag = job->client->seq;
+	job->client->pending++;
+	server.lastjob = job;
+    }
+
+    job->prev = jobs->tail;
+    job->next = NULL;
+    if (jobs->tail)
+	jobs->tail->next = job;
+    else
+	jobs->head = job;
+    jobs->tail = job;
+    jobs->count++;
 
-    for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+    if (state == QU) {
+	job->qnext = NULL;
+	if (jobs->qtail)
+	    jobs->qtail->qnext = job;
+	else
+	    jobs->qhead = job;
+	jobs->qtail = job;
+	jobs->nqueued++;
+    }
+
+    if(verbose){
+	printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return job;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) 
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct joblist_t *jobs, pid_t pid) 
 {
-    int i, max=0;
+    struct job_t *job;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+    if ((job = getjobpid(jobs, pid)) == NULL)
+	return 0;
+    removejob(jobs, job);
+    return 1;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+/* removejob - Take job off the job list (and the submit queue) */
+void removejob(struct joblist_t *jobs, struct job_t *job)
 {
     int i;
-    
-    if (pid < 1)
-	return 0;
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
-	    jobs[i].pid = pid;
-	    jobs[i].state = state;
-	    jobs[i].jid = nextjid++;
-	    if (nextjid > MAXJOBS)
-		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
-  	    if(verbose){
-	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
-	}
+    if (job->state == QU)
+	unqueue(jobs, job);
+    if (job->tpprev)
+	wheel_del(job);
+    if (job->client)
+	serve_done(job);
+    if (job->waitst)
+	*job->waitst = job->status;
+    setjobstate(jobs, job, UNDEF);
+    for (i = 0; i < job->nprocs; i++)
+	if (intmap_get(&jobs->bypid, job->procs[i].pid) == job)
+	    intmap_del(&jobs->bypid, job->procs[i].pid);
+    intmap_del(&jobs->byjid, job->jid);
+    if (jobs->fg == job)
+	jobs->fg = NULL;
+
+    if (job->prev)
+	job->prev->next = job->next;
+    else
+	jobs->head = job->next;
+    if (job->next)
+	job->next->prev = job->prev;
+    else
+	jobs->tail = job->prev;
+
+    /* Captured output keeps its job ID until it is dropped */
+    jobs->count--;
+    if (job->cap) {
+	job->cap->job = NULL;
+	job->cap->status = job->status;
+	jobs->nheld++;
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    else
+	releasejid(jobs, job->jid);
+
+    clearjob(job);
+    job->next = jobs->spare;
+    jobs->spare = job;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) 
+/* releasejid - Recycle a job ID; once no job or captured output holds
+ *    one, numbering restarts at 1 */
+void releasejid(struct joblist_t *jobs, int jid)
+{
+    if (jobs->count == 0 && jobs->nheld == 0) {
+	jobs->nfree = 0;
+	jobs->nextjid = 1;
+	return;
+    }
+    if (jobs->nfree == jobs->freecap) {
+	jobs->freecap = jobs->freecap ? 2 * jobs->freecap : 64;
+	if ((jobs->freejids = realloc(jobs->freejids, jobs->freecap * sizeof(int))) == NULL)
+	    unix_error("realloc error");
+    }
+    jobs->freejids[jobs->nfree++] = jid;
+}
+
+/* setjobstate - Change a job's state, keeping track of the FG job */
+void setjobstate(struct joblist_t *jobs, struct job_t *job, int state)
+{
+    if (jobs->fg == job && state != FG)
+	jobs->fg = NULL;
+    if (state == FG)
+	jobs->fg = job;
+    jobs->nrun += (state == FG || state == BG) - (job->state == FG || job->state == BG);
+    job->state = state;
+}
+
+/* procdone - Record that process pid of job has been reaped.  Its PID
+ *    is dropped from the index right away (the kernel may hand it out
+ *    again), except for the group leader whose PID stays reserved while
+ *    the group has members.  Returns the number of live processes left. */
+int procdone(struct joblist_t *jobs, struct job_t *job, pid_t pid)
 {
     int i;
 
-    if (pid < 1)
-	return 0;
+    for (i = 0; i < job->nprocs; i++) {
+	if (job->procs[i].pid == pid && !job->procs[i].done) {
+	    job->procs[i].done = 1;
+	    job->nlive--;
+	    if (job->procs[i].pidfd >= 0) {
+		intmap_del(&waitfds, job->procs[i].pidfd);
+		close(job->procs[i].pidfd);
+		job->procs[i].pidfd = -1;
+	    }
+	    if (pid != job->pid)
+		intmap_del(&jobs->bypid, pid);
+	}
+    }
+    return job->nlive;
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
+/* addjobproc - Add process pid to a running job.  If every earlier
+ *    process has been reaped, pid must lead a new process group and
+ *    becomes the job's PID. */
+void addjobproc(struct joblist_t *jobs, struct job_t *job, pid_t pid)
+{
+    int i, n;
+
+    if (job->nlive == 0) {
+	if (job->pid && intmap_get(&jobs->bypid, job->pid) == job)
+	    intmap_del(&jobs->bypid, job->pid);
+	job->pid = pid;
+    }
+    if (job->nprocs == job->proccap) {
+	/* squeeze out reaped processes before growing */
+	for (i = n = 0; i < job->nprocs; i++)
+	    if (!job->procs[i].done || job->procs[i].pid == job->pid)
+		job->procs[n++] = job->procs[i];
+	job->nprocs = n;
+	if (2 * n > job->proccap) {
+	    job->proccap = 2 * job->proccap;
+	    if ((job->procs = realloc(job->procs, job->proccap * sizeof(struct proc_t))) == NULL)
+		unix_error("realloc error");
 	}
     }
-    return 0;
+    job->procs[job->nprocs].pid = pid;
+    job->procs[job->nprocs].pidfd = syscall(SYS_pidfd_open, pid, 0);
+    job->procs[job->nprocs].done = 0;
+    job->nprocs++;
+    job->nlive++;
+    intmap_put(&jobs->bypid, pid, job);
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+/* signaljob - Send sig to job's process group.  It is addressed through
+ *    the pidfd of a process of the job, so it cannot reach a group that
+ *    took over a recycled PID; kill() is the fallback when pidfds or
+ *    group signals are not supported.  Returns 0 or -1 with errno set. */
+int signaljob(struct job_t *job, int sig)
+{
+    int i, tried = 0;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
-    return 0;
+    for (i = 0; i < job->nprocs; i++) {
+	if (job->procs[i].done || job->procs[i].pidfd < 0)
+	    continue;
+	if (syscall(SYS_pidfd_send_signal, job->procs[i].pidfd, sig, NULL,
+		    PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+	    return 0;
+	if (errno != ESRCH)
+	    break;  /* EINVAL: no group signals before Linux 6.9 */
+	tried = 1;
+    }
+    if (tried && errno == ESRCH)
+	return -1;
+    return job->pid > 0 ? kill(-job->pid, sig) : -1;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct joblist_t *jobs) {
+    return jobs->fg ? jobs->fg->pid : 0;
+}
 
+/* getjobpid  - Find a job (by the PID of any of its processes) on the job list */
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid) {
     if (pid < 1)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+    return intmap_get(&jobs->bypid, pid);
 }
 
 /* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
+struct job_t *getjobjid(struct joblist_t *jobs, int jid) 
 {
-    int i;
-
     if (jid < 1)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+    return intmap_get(&jobs->byjid, jid);
 }
 
 /* pid2jid - Map process ID to job ID */
 int pid2jid(pid_t pid) 
 {
-    int i;
+    struct job_t *job = getjobpid(&jobs, pid);
 
-    if (pid < 1)
-	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+    return job ? job->jid : 0;
 }
 
 /* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) 
+void listjobs(struct joblist_t *jobs) 
 {
-    int i;
+    struct job_t *job;
     
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid != 0) {
-	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-	    switch (jobs[i].state) {
-		case BG: 
-		    printf("Running ");
-		    break;
-		case FG: 
-		    printf("Foreground ");
-		    break;
-		case ST: 
-		    printf("Stopped ");
-		    break;
-	    default:
-		    printf("listjobs: Internal error: job[%d].state=%d ", 
-			   i, jobs[i].state);
+    for (job = jobs->head; job; job = job->next) {
+	printf("[%d] (%d) ", job->jid, job->pid);
+	switch (job->state) {
+	    case BG: 
+		printf(job->expired ? "Expired " : "Running ");
+		break;
+	    case FG: 
+		printf("Foreground ");
+		break;
+	    case ST: 
+		printf("Stopped ");
+		break;
+	    case QU:
+		printf("Queued #%d ", queuepos(job));
+		break;
+	default:
+		printf("listjobs: Internal error: job[%d].state=%d ", 
+		       job->jid, job->state);
+	}
+	printf("%s", job->cmdline);
+    }
+}
+
+/* listjobs_long - Print the job list with every process of each job,
+ *    when it started, what it has used so far and its deadline */
+void listjobs_long(struct joblist_t *jobs)
+{
+    struct job_t *job;
+    struct timespec now;
+    struct tm tm;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (job = jobs->head; job; job = job->next) {
+	printf("[%d] (%d) %s %s", job->jid, job->pid,
+	       job->expired ? "Expired" : statename[job->state], job->cmdline);
+	for (i = 0; i < job->nprocs; i++)
+	    printf("    %d %s\n", job->procs[i].pid,
+		   job->procs[i].done ? "Done" : statename[job->state]);
+	localtime_r(&job->started, &tm);
+	strftime(sbuf, sizeof(sbuf), "    started %H:%M:%S", &tm);
+	reportusage(sbuf, tsdiff(&now, &job->start), &job->ru);
+	if (job->tpprev)
+	    printf("    %s in %.2f s\n", job->expired ? "SIGKILL" : "timeout",
+		   job->due > wheel_tick() ? (job->due - wheel_tick()) * WHEELTICK / 1000.0 : 0.0);
+    }
+}
+
+/* listjobs_stats - Print a table of the jobs' resource usage */
+void listjobs_stats(struct joblist_t *jobs)
+{
+    struct job_t *job;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("%-5s %-7s %-10s %9s %9s %9s %9s %7s %8s %8s %8s  %s\n",
+	   "JID", "PGID", "STATE", "REAL", "USER", "SYS", "MAXRSS",
+	   "MAJFLT", "MINFLT", "VCSW", "IVCSW", "COMMAND");
+    for (job = jobs->head; job; job = job->next)
+	printf("%-5d %-7d %-10s %9.3f %9.3f %9.3f %9ld %7ld %8ld %8ld %8ld  %s",
+	       job->jid, job->pid, job->expired ? "Expired" : statename[job->state],
+	       tsdiff(&now, &job->start),
+	       job->ru.ru_utime.tv_sec + job->ru.ru_utime.tv_usec / 1e6,
+	       job->ru.ru_stime.tv_sec + job->ru.ru_stime.tv_usec / 1e6,
+	       job->ru.ru_maxrss, job->ru.ru_majflt, job->ru.ru_minflt,
+	       job->ru.ru_nvcsw, job->ru.ru_nivcsw, job->cmdline);
+}
+
+/*
+ * checkjobs - Check the job list against its counters and indexes and
+ *    against the kernel, printing each problem found: a job left in the
+ *    foreground (jobs runs in the shell, so none can be), a process the
+ *    shell never reaped that no longer exists, a job with nothing left
+ *    to wait for, an index entry for a deleted job, a pidfd left open
+ *    for a reaped process, a deadline missing from the timer wheel.  Returns the number of problems.
+ */
+int checkjobs(struct joblist_t *jobs)
+{
+    struct job_t *job, *prev = NULL, *j;
+    int bad = 0, count = 0, nrun = 0, nqueued = 0, nprocs = 0, ntimed = 0, nlive, i;
+    size_t slot;
+
+#define BAD(...) do { printf("jobs: " __VA_ARGS__); bad++; } while (0)
+
+    for (job = jobs->head; job; prev = job, job = job->next) {
+	count++;
+	if (job->prev != prev)
+	    BAD("[%d] broken list link\n", job->jid);
+	if (job->jid < 1 || job->jid >= jobs->nextjid || getjobjid(jobs, job->jid) != job)
+	    BAD("[%d] not found by its job ID\n", job->jid);
+	if (job->state == FG)
+	    BAD("[%d] (%d) stuck in the foreground\n", job->jid, job->pid);
+	if (job->tpprev) {
+	    ntimed++;
+	    if (*job->tpprev != job)
+		BAD("[%d] broken timer wheel link\n", job->jid);
+	}
+	if (job->state == FG || job->state == BG)
+	    nrun++;
+	else if (job->state == QU) {
+	    nqueued++;
+	    continue;
+	}
+	else if (job->state != ST) {
+	    BAD("[%d] bad state %d\n", job->jid, job->state);
+	    continue;
+	}
+
+	if (getjobpid(jobs, job->pid) != job)
+	    BAD("[%d] (%d) not found by its process group\n", job->jid, job->pid);
+	for (i = nlive = 0; i < job->nprocs; i++) {
+	    if (job->procs[i].done) {
+		if (job->procs[i].pidfd >= 0)
+		    BAD("[%d] process %d was reaped but its pidfd is open\n", job->jid, job->procs[i].pid);
+		continue;
+	    }
+	    nlive++;
+	    if (getjobpid(jobs, job->procs[i].pid) != job)
+		BAD("[%d] process %d not found by its PID\n", job->jid, job->procs[i].pid);
+	    /* an unreaped child is at least a zombie */
+	    if (kill(job->procs[i].pid, 0) < 0 && errno == ESRCH)
+		BAD("[%d] process %d is gone but was never reaped\n", job->jid, job->procs[i].pid);
+	}
+	if (nlive != job->nlive)
+	    BAD("[%d] counts %d live processes, has %d\n", job->jid, job->nlive, nlive);
+	if (nlive == 0)
+	    BAD("[%d] (%d) has no processes left\n", job->jid, job->pid);
+	nprocs += nlive;
+    }
+    if (jobs->tail != prev)
+	BAD("tail is not the last job\n");
+    if (count != jobs->count)
+	BAD("count is %d, the list has %d jobs\n", jobs->count, count);
+    if (nrun != jobs->nrun)
+	BAD("%d jobs counted as running, %d are\n", jobs->nrun, nrun);
+    if (nqueued != jobs->nqueued)
+	BAD("%d jobs counted as queued, %d are\n", jobs->nqueued, nqueued);
+    if (jobs->fg != NULL)
+	BAD("[%d] is still the foreground job\n", jobs->fg->jid);
+    if (ntimed != wheel.count)
+	BAD("%d deadlines on the timer wheel, %d jobs have one\n", wheel.count, ntimed);
+
+    /* every index entry leads to a job on the list */
+    for (slot = 0; slot < jobs->bypid.cap; slot++)
+	if (jobs->bypid.keys[slot] != 0 &&
+	    ((j = jobs->bypid.vals[slot]) == NULL || j->state == UNDEF || getjobjid(jobs, j->jid) != j))
+	    BAD("PID %d belongs to a deleted job\n", jobs->bypid.keys[slot]);
+    for (slot = 0; slot < jobs->byjid.cap; slot++)
+	if (jobs->byjid.keys[slot] != 0 &&
+	    ((j = jobs->byjid.vals[slot]) == NULL || j->state == UNDEF || j->jid != jobs->byjid.keys[slot]))
+	    BAD("job ID %d belongs to a deleted job\n", jobs->byjid.keys[slot]);
+    for (slot = 0; slot < waitfds.cap; slot++)
+	if (waitfds.keys[slot] != 0 &&
+	    ((j = waitfds.vals[slot]) == NULL || j->state == UNDEF || getjobjid(jobs, j->jid) != j))
+	    BAD("pidfd %d is watched for a deleted job\n", waitfds.keys[slot]);
+#undef BAD
+
+    if (bad == 0)
+	printf("jobs: ok, %d jobs, %d processes\n", count, nprocs);
+    else
+	printf("jobs: %d problem%s\n", bad, bad == 1 ? "" : "s");
+    return bad;
+}
+
+/*
+ * intmap_slot - Index of key's slot in m, or of the empty slot where it
+ *    would go.  Fibonacci hashing spreads consecutive PIDs and job IDs.
+ */
+size_t intmap_slot(struct intmap_t *m, int key)
+{
+    size_t i = ((size_t)(unsigned)key * 11400714819323198485ull) & (m->cap - 1);
+
+    while (m->keys[i] != 0 && m->keys[i] != key)
+	i = (i + 1) & (m->cap - 1);
+    return i;
+}
+
+/* intmap_put - Insert or replace key -> val, doubling m at half load */
+void intmap_put(struct intmap_t *m, int key, void *val)
+{
+    struct intmap_t old = *m;
+    size_t i;
+
+    if (2 * (m->count + 1) > m->cap) {
+	m->cap = old.cap ? 2 * old.cap : 64;
+	m->count = 0;
+	if ((m->keys = calloc(m->cap, sizeof(int))) == NULL ||
+	    (m->vals = calloc(m->cap, sizeof(void *))) == NULL)
+	    unix_error("calloc error");
+	for (i = 0; i < old.cap; i++)
+	    if (old.keys[i])
+		intmap_put(m, old.keys[i], old.vals[i]);
+	free(old.keys);
+	free(old.vals);
+    }
+    i = intmap_slot(m, key);
+    if (m->keys[i] == 0)
+	m->count++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+}
+
+/* intmap_get - Value stored for key, or NULL */
+void *intmap_get(struct intmap_t *m, int key)
+{
+    size_t i;
+
+    if (m->cap == 0)
+	return NULL;
+    i = intmap_slot(m, key);
+    return m->keys[i] ? m->vals[i] : NULL;
+}
+
+/* intmap_del - Remove key, shifting later entries of its probe run back
+ *    so lookups never need tombstones */
+void intmap_del(struct intmap_t *m, int key)
+{
+    size_t i, j, home;
+
+    if (m->cap == 0 || m->keys[i = intmap_slot(m, key)] == 0)
+	return;
+    m->count--;
+    for (j = i;;) {
+	m->keys[i] = 0;
+	for (;;) {
+	    j = (j + 1) & (m->cap - 1);
+	    if (m->keys[j] == 0)
+		return;
+	    home = ((size_t)(unsigned)m->keys[j] * 11400714819323198485ull) & (m->cap - 1);
+	    /* move j back to i unless its home lies cyclically in (i, j] */
+	    if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+		break;
+	}
+	m->keys[i] = m->keys[j];
+	m->vals[i] = m->vals[j];
+	i = j;
+    }
+}
+
+/*
+ * strpool_intern - Return a shared NUL-terminated copy of the len bytes
+ *    at s, taking a reference on it.  Scripts that launch the same
+ *    command line many times keep one copy.
+ */
+const char *strpool_intern(const char *s, size_t len)
+{
+    struct strent_t *e, **nb, *next;
+    size_t h = hashmem(s, len), i, nn;
+
+    if (strpool.nbuckets) {
+	for (e = strpool.buckets[h & (strpool.nbuckets - 1)]; e; e = e->next) {
+	    if (e->hash == h && !strncmp(e->s, s, len) && e->s[len] == '\0') {
+		e->refs++;
+		return e->s;
+	    }
+	}
+    }
+
+    if (strpool.count >= strpool.nbuckets) {
+	nn = strpool.nbuckets ? 2 * strpool.nbuckets : 64;
+	if ((nb = calloc(nn, sizeof(*nb))) == NULL)
+	    unix_error("calloc error");
+	for (i = 0; i < strpool.nbuckets; i++) {
+	    for (e = strpool.buckets[i]; e; e = next) {
+		next = e->next;
+		e->next = nb[e->hash & (nn - 1)];
+		nb[e->hash & (nn - 1)] = e;
 	    }
-	    printf("%s", jobs[i].cmdline);
 	}
+	free(strpool.buckets);
+	strpool.buckets = nb;
+	strpool.nbuckets = nn;
     }
+
+    if ((e = malloc(sizeof(*e) + len + 1)) == NULL)
+	unix_error("malloc error");
+    memcpy(e->s, s, len);
+    e->s[len] = '\0';
+    e->hash = h;
+    e->refs = 1;
+    e->next = strpool.buckets[h & (strpool.nbuckets - 1)];
+    strpool.buckets[h & (strpool.nbuckets - 1)] = e;
+    strpool.count++;
+    return e->s;
+}
+
+/* strpool_release - Drop a reference taken by strpool_intern */
+void strpool_release(const char *s)
+{
+    struct strent_t *e = (struct strent_t *)(s - offsetof(struct strent_t, s));
+    struct strent_t **pp;
+
+    if (--e->refs > 0)
+	return;
+    for (pp = &strpool.buckets[e->hash & (strpool.nbuckets - 1)]; *pp != e; pp = &(*pp)->next)
+	;
+    *pp = e->next;
+    strpool.count--;
+    free(e);
 }
 /******************************
  * end job list helper routines
@@ -725,10 +7956,18 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvp] [-C bytes] [-H file] [-P bytes] [-s spawn|fork] [-S socket] [-t duration] [-T file] [-f script | script]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -C   keep the last bytes of each & job's output for the output builtin\n");
+    printf("   -f   run the commands in script without prompting\n");
+    printf("   -H   keep the command history in file (default ~/.tsh_history when interactive)\n");
+    printf("   -P   size pipeline pipe buffers to bytes (F_SETPIPE_SZ)\n");
+    printf("   -s   start commands with posix_spawn (default) or fork\n");
+    printf("   -S   run the command lines sent to a Unix socket as background jobs\n");
+    printf("   -t   give every job a deadline (also --timeout), as with the timeout prefix\n");
+    printf("   -T   write a Chrome trace (trace-event JSON) to file\n");
     exit(1);
 }
 